@@ -5,3 +5,17 @@
 #define GC_DATA_BIT	(1<<5)
 
 
+
+/* Also support N64 controllers, detected when connected. Comment out
+ * for a smaller, gamecube only firmware. See README.md */
+#define N64_SUPPORT
+
+/* Read a second gamecube controller (data on PC4) and answer the NES
+ * using the Four Score protocol. See README.md */
+//#define FOUR_SCORE
+
+#ifdef FOUR_SCORE
+#define GC_NUM_PADS	2
+#else
+#define GC_NUM_PADS	1
+#endif
@@ -0,0 +1,21 @@
+#ifndef _cycles_h__
+#define _cycles_h__
+
+/* Compile-time conversion of durations to CPU cycles, for the
+ * timing critical assembly loops. Everything here is usable in
+ * preprocessor tests (#if) as well as in asm operands. */
+
+#ifndef F_CPU
+#error F_CPU must be defined
+#endif
+
+#define CYCLES_PER_US		(F_CPU / 1000000L)
+
+/* Rounded to the nearest cycle */
+#define NS_TO_CYCLES(ns)	((F_CPU / 1000L * (ns) + 500000L) / 1000000L)
+
+/* Emit a run of nops. The argument is an asm operand reference
+ * such as "%4" holding the count (0 is allowed). */
+#define ASM_NOPS(n)			".rept " n "\n nop\n .endr\n"
+
+#endif // _cycles_h__
@@ -19,79 +19,239 @@
 	You should have received a copy of the GNU General Public License
 	along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <avr/pgmspace.h>
 #include <string.h>
-#include "gamepad.h"
 #include "gamecube.h"
 #include "gcn64_protocol.h"
+#include "boarddef.h"
+#include "n64.h"
 
-/*********** prototypes *************/
-static void gamecubeInit(void);
-static char gamecubeUpdate(void);
-static char gamecubeChanged(int rid);
-
+/* One report per controller (GC_NUM_PADS). The report id is the
+ * controller number. */
 
 /* What was most recently read from the controller */
-static unsigned char last_built_report[GCN64_REPORT_SIZE];
-
-/* What was most recently sent to the host */
-static unsigned char last_sent_report[GCN64_REPORT_SIZE];
+unsigned char gc_last_report[GC_NUM_PADS][GCN64_REPORT_SIZE];
 
 static int gc_rumbling = 0;
-static int gc_analog_lr_disable = 0;
+static unsigned char gc_analog_lr_disable[GC_NUM_PADS];
+
+/* Controller session. GC_GETID is only sent until the controller has
+ * been identified, and again after a failed status read (unplugged,
+ * out of range, etc). N64 controllers (N64_SUPPORT) are then read by
+ * the N64 driver. */
+#define GC_SESSION_IDENTIFY		0
+#define GC_SESSION_READY		1
+#define GC_SESSION_N64			2
+
+static unsigned char gc_session[GC_NUM_PADS]; // GC_SESSION_IDENTIFY at reset
+
+static char gamecubeUpdatePad(unsigned char pad);
+
+/* Main stick origin (rest position). Read with GC_GETORIGIN before the
+ * first status of each session, and again when the status has the get
+ * origin bit set (after X+Y+Start is held for 3 seconds, or when the
+ * controller is plugged). The command clears the bit. Reports are
+ * corrected so the origin reads 0x80 whatever the controller's real
+ * center. */
+#define GC_STATUS0_GET_ORIGIN	0x20
 
-static void gamecubeInit(void)
+static unsigned char gc_origin_x[GC_NUM_PADS], gc_origin_y[GC_NUM_PADS];
+static unsigned char gc_origin_valid[GC_NUM_PADS];
+
+/* A controller stopped answering (not disturbed by the NES): identify
+ * it again, and report it at rest meanwhile. With two controllers
+ * (FOUR_SCORE), the polls still succeed thanks to the other one, so
+ * its last buttons would otherwise stay pressed. */
+static void gamecubeLost(unsigned char pad)
 {
-	if (0 == gamecubeUpdate()) {
-		unsigned char btns2;
+	unsigned char *report = gc_last_report[pad];
 
-		btns2 = gcn64_protocol_getByte(8);
+	gc_session[pad] = GC_SESSION_IDENTIFY;
+	gc_origin_valid[pad] = 0;
 
-		//if (gcn64_workbuf[GC_BTN_L] && gcn64_workbuf[GC_BTN_R]) {
-		if ((btns2 & 0x06) == 0x06) { // L + R
-			gc_analog_lr_disable = 1;
-		} else {
-			gc_analog_lr_disable = 0;
-		}
+	report[0] = report[1] = report[2] = report[3] = 0x80;
+	report[4] = report[5] = 0xff;
+	report[6] = report[7] = 0;
+}
+
+/* Consecutive failures of each controller (GC_LOST_FAILURES) */
+static unsigned char gc_failures[GC_NUM_PADS];
+
+static void gamecubeFailed(unsigned char pad)
+{
+	if (++gc_failures[pad] >= GC_LOST_FAILURES) {
+		gc_failures[pad] = 0;
+		gamecubeLost(pad);
 	}
 }
 
-static char gamecubeUpdate(void)
+/* Returns 0 on success, GCN64_PREEMPTED if the transaction was
+ * disturbed, 1 otherwise. */
+static char gamecubeGetOrigin(unsigned char pad)
 {
-	int i;
-	unsigned char tmp=0;
-	unsigned char tmpdata[8];	
-	unsigned char count;
-	unsigned char x,y,cx,cy,rtrig,ltrig,btns1,btns2,rb1,rb2;
-
-#if 1
-	/* Get ID command.
-	 *
-	 * If we don't do that, the wavebird does not work.
-	 *
-	 * 2015-12-08: RA:
-	 * 	In fact, calling gcn64_detectController at least
-	 * 	once is enough to "enable" the wavebird receiver. In any case,
-	 * 	the GET_STATUS commands below get answered. This means
-	 * 	this GET_ID command is in fact optional. Removing it
-	 * 	does not seem to do harm with my receiver at least. But
-	 * 	I will not risk changing what has been there for years.
-	 */
-	tmp = GC_GETID;
+	unsigned char tmp = GC_GETORIGIN;
+	int count;
+
 	count = gcn64_transaction(&tmp, 1);
-	if (count != GC_GETID_REPLY_LENGTH) {
-		return 1;
+	if (count != GC_GETORIGIN_REPLY_LENGTH) {
+		return count == GCN64_PREEMPTED ? GCN64_PREEMPTED : 1;
+	}
+
+	gc_origin_x[pad] = gcn64_protocol_getByte(16);
+	gc_origin_y[pad] = gcn64_protocol_getByte(24);
+	gc_origin_valid[pad] = 1;
+
+	return 0;
+}
+
+static unsigned char gamecubeRecenter(unsigned char value, unsigned char origin)
+{
+	int v = value - origin + 0x80;
+
+	if (v < 0)
+		return 0;
+	if (v > 0xff)
+		return 0xff;
+
+	return v;
+}
+
+void gamecubeInit(void)
+{
+	unsigned char pad;
+
+	for (pad=0; pad<GC_NUM_PADS; pad++) {
+		// At rest until the controller answers
+		gamecubeLost(pad);
+		if (0 == gamecubeUpdatePad(pad)) {
+			unsigned char btns2;
+
+			btns2 = gcn64_protocol_getByte(8);
+
+			//if (gcn64_workbuf[GC_BTN_L] && gcn64_workbuf[GC_BTN_R]) {
+			if ((btns2 & 0x06) == 0x06) { // L + R
+				gc_analog_lr_disable[pad] = 1;
+			} else {
+				gc_analog_lr_disable[pad] = 0;
+			}
+		}
+	}
+}
+
+/* Get ID command.
+ *
+ * If we don't do that, the wavebird does not work.
+ *
+ * 2015-12-08: RA:
+ * 	In fact, calling gcn64_detectController at least
+ * 	once is enough to "enable" the wavebird receiver. In any case,
+ * 	the GET_STATUS commands below get answered.
+ *
+ * A Wavebird receiver answers 0xA800 until its controller is on and
+ * linked, and 0xE9A0 afterwards. We keep identifying until the 0xA8
+ * answer goes away so the receiver gets the same command sequence as
+ * before, then only GET_STATUS is sent.
+ */
+static char gamecubeIdentify(unsigned char pad)
+{
+	switch (gcn64_detectController()) {
+		case CONTROLLER_IS_GC:
+			break;
+
+#ifdef N64_SUPPORT
+		case CONTROLLER_IS_N64:
+			gc_session[pad] = GC_SESSION_N64;
+			return 0;
+#endif
+
+		case GCN64_PREEMPTED:
+			// Not an unknown controller: identify it at the next poll
+			return 1;
+
+		default:
+			// Absent, unknown, or not supported (keyboard)
+			return 1;
+	}
+
+	if (gcn64_protocol_getByte(0) != 0xA8) {
+		gc_session[pad] = GC_SESSION_READY;
+	}
+
+	return 0;
+}
+
+/* Button bits of the report (see gamecube.h) from the first two status
+ * bytes. One test per button rather than loops with variable shifts,
+ * as this runs between the reply and the NES byte update. */
+static void gamecubeButtons(unsigned char btns1, unsigned char btns2, unsigned char *report)
+{
+	unsigned char rb1, rb2;
+
+	rb1 = rb2 = 0;
+	if (btns1 & 0x10) rb1 |= 0x01; // Start
+	if (btns1 & 0x08) rb1 |= 0x02; // Y
+	if (btns1 & 0x04) rb1 |= 0x04; // X
+	if (btns1 & 0x02) rb1 |= 0x08; // B
+	if (btns1 & 0x01) rb1 |= 0x10; // A
+	if (btns2 & 0x40) rb1 |= 0x20; // L
+	if (btns2 & 0x20) rb1 |= 0x40; // R
+	if (btns2 & 0x10) rb1 |= 0x80; // Z
+	if (btns2 & 0x08) rb2 |= 0x01; // Up
+	if (btns2 & 0x04) rb2 |= 0x02; // Down
+	if (btns2 & 0x02) rb2 |= 0x04; // Right
+	if (btns2 & 0x01) rb2 |= 0x08; // Left
+
+	report[6] = rb1;
+	report[7] = rb2;
+}
+
+static char gamecubeUpdatePad(unsigned char pad)
+{
+	unsigned char tmpdata[8];
+	int count;
+	unsigned char x,y,cx,cy,rtrig,ltrig,btns1,btns2;
+	unsigned char *report = gc_last_report[pad];
+	char res;
+
+	gcn64_setChannel(pad);
+
+	if (gc_session[pad] == GC_SESSION_IDENTIFY) {
+		if (gamecubeIdentify(pad)) {
+			return 1;
+		}
+	}
+
+#ifdef N64_SUPPORT
+	if (gc_session[pad] == GC_SESSION_N64) {
+		res = n64UpdatePad(report);
+		if (!res) {
+			gc_failures[pad] = 0;
+		} else if (res != GCN64_PREEMPTED) {
+			gamecubeFailed(pad);
+		}
+		return res ? 1 : 0;
 	}
 #endif
 
+	if (!gc_origin_valid[pad]) {
+		res = gamecubeGetOrigin(pad);
+		if (res) {
+			if (res != GCN64_PREEMPTED) {
+				gamecubeFailed(pad);
+			}
+			return 1;
+		}
+	}
+
 	tmpdata[0] = GC_GETSTATUS1;
 	tmpdata[1] = GC_GETSTATUS2;
 	tmpdata[2] = GC_GETSTATUS3(gc_rumbling);
 
 	count = gcn64_transaction(tmpdata, 3);
 	if (count != GC_GETSTATUS_REPLY_LENGTH) {
+		// Being interrupted by the NES says nothing about the controller
+		if (count != GCN64_PREEMPTED) {
+			gamecubeFailed(pad);
+		}
 		return 1; // failure
 	}
 
@@ -100,7 +260,8 @@ static char gamecubeUpdate(void)
 		updated 8th March 2004, by James.)
 
 	Bit		Function
-	0-2		Always 0 
+	0-1		Always 0 
+	2		Get origin (see gc_origin_x)
 	3		Start
 	4		Y
 	5		X
@@ -128,72 +289,107 @@ static char gamecubeUpdate(void)
 	ltrig = gcn64_protocol_getByte(48);
 	rtrig = gcn64_protocol_getByte(56);
 
-	/* Prepare button bits */
-	rb1 = rb2 = 0;
-	for (i=0; i<5; i++) // St Y X B A
-		rb1 |= (btns1 & (0x10 >> i)) ? (0x01<<i) : 0;
-	for (i=0; i<3; i++) // L R Z
-		rb1 |= (btns2 & (0x40 >> i)) ? (0x20<<i) : 0;
-	for (i=0; i<4; i++) // Up,Down,Right,Left
-		rb2 |= (btns2 & (0x08 >> i)) ? (0x01<<i) : 0;
-
-	if (gc_analog_lr_disable) {
+	if (gc_analog_lr_disable[pad]) {
 		ltrig = 0x7f;
 		rtrig = 0x7f;
 	}
 
-	last_built_report[0] = x;
-	last_built_report[1] = y ^ 0xff;
-	last_built_report[2] = cx;
-	last_built_report[3] = cy ^ 0xff;
+	x = gamecubeRecenter(x, gc_origin_x[pad]);
+	y = gamecubeRecenter(y, gc_origin_y[pad]);
+
+	report[0] = x;
+	report[1] = y ^ 0xff;
+	report[2] = cx;
+	report[3] = cy ^ 0xff;
 	// Sliders value to decrease as pushed (v2.x behaviour)
-	last_built_report[4] = ltrig ^ 0xff;
-	last_built_report[5] = rtrig ^ 0xff;
-	last_built_report[6] = rb1;
-	last_built_report[7] = rb2;
+	report[4] = ltrig ^ 0xff;
+	report[5] = rtrig ^ 0xff;
+	gamecubeButtons(btns1, btns2, report);
+
+	// Read the new origin at the next poll
+	if (btns1 & GC_STATUS0_GET_ORIGIN) {
+		gc_origin_valid[pad] = 0;
+	}
+	gc_failures[pad] = 0;
 
 	return 0; // success
 }
 
-static char gamecubeProbe(void)
+/* The status command, but only the buttons (the first two bytes) are
+ * received. Only once the session is established: identification and
+ * origin take full transactions. */
+static char gamecubeUpdatePadButtons(unsigned char pad)
 {
-	if (0 == gamecubeUpdate())
+	unsigned char tmpdata[3];
+	unsigned char btns1;
+	int count;
+	char res;
+
+	gcn64_setChannel(pad);
+
+#ifdef N64_SUPPORT
+	if (gc_session[pad] == GC_SESSION_N64) {
+		res = n64UpdateButtons(gc_last_report[pad]);
+		if (!res) {
+			gc_failures[pad] = 0;
+		} else if (res != GCN64_PREEMPTED) {
+			gamecubeFailed(pad);
+		}
+		return res ? 1 : 0;
+	}
+#endif
+
+	if (gc_session[pad] != GC_SESSION_READY || !gc_origin_valid[pad]) {
+		return 1;
+	}
+
+	tmpdata[0] = GC_GETSTATUS1;
+	tmpdata[1] = GC_GETSTATUS2;
+	tmpdata[2] = GC_GETSTATUS3(gc_rumbling);
+
+	count = gcn64_transactionPartial(tmpdata, 3, GCN64_BUTTONS_REPLY_LENGTH);
+	if (count != GCN64_BUTTONS_REPLY_LENGTH) {
+		if (count != GCN64_PREEMPTED) {
+			gamecubeFailed(pad);
+		}
 		return 1;
+	}
+
+	btns1 = gcn64_protocol_getByte(0);
+	gamecubeButtons(btns1, gcn64_protocol_getByte(8), gc_last_report[pad]);
+
+	if (btns1 & GC_STATUS0_GET_ORIGIN) {
+		gc_origin_valid[pad] = 0;
+	}
+	gc_failures[pad] = 0;
 
 	return 0;
 }
 
-static char gamecubeChanged(int id)
+/* Read all controllers. Succeeds if at least one could be read. */
+char gamecubeUpdate(void)
 {
-	return memcmp(last_built_report, last_sent_report, GCN64_REPORT_SIZE);
-}
+	unsigned char pad;
+	char res = 1;
 
-static int gamecubeBuildReport(unsigned char *reportBuffer, int id)
-{
-	if (reportBuffer != NULL)
-		memcpy(reportBuffer, last_built_report, GCN64_REPORT_SIZE);
-	
-	memcpy(last_sent_report, last_built_report, GCN64_REPORT_SIZE);	
-	return GCN64_REPORT_SIZE;
-}
+	for (pad=0; pad<GC_NUM_PADS; pad++) {
+		if (0 == gamecubeUpdatePad(pad))
+			res = 0;
+	}
 
-static void gamecubeVibration(int value)
-{
-	gc_rumbling = value;
+	return res;
 }
 
-static Gamepad GamecubeGamepad = {
-	.num_reports			= 1,
-	.init					= gamecubeInit,
-	.update					= gamecubeUpdate,
-	.changed				= gamecubeChanged,
-	.buildReport			= gamecubeBuildReport,
-	.probe					= gamecubeProbe,
-	.setVibration			= gamecubeVibration,
-};
-
-Gamepad *gamecubeGetGamepad(void)
+/* Read the buttons of all controllers. Same result as gamecubeUpdate. */
+char gamecubeUpdateButtons(void)
 {
-	return &GamecubeGamepad;
-}
+	unsigned char pad;
+	char res = 1;
 
+	for (pad=0; pad<GC_NUM_PADS; pad++) {
+		if (0 == gamecubeUpdatePadButtons(pad))
+			res = 0;
+	}
+
+	return res;
+}
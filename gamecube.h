@@ -1,8 +1,40 @@
-#include "gamepad.h"
+#ifndef _gamecube_h__
+#define _gamecube_h__
+
+#include <string.h>
+#include "boarddef.h"
 
 #define GCN64_REPORT_SIZE	8
 
-Gamepad *gamecubeGetGamepad(void);
+/* Consecutive failed transactions (not disturbed by the NES) after
+ * which a controller is considered lost: reported at rest, and
+ * identified again. Before that, a bad reply (noise, WaveBird
+ * dropout) keeps the last report and the session, so held buttons
+ * are not released and no GETID/GETORIGIN is needed. */
+#define GC_LOST_FAILURES	3
+
+void gamecubeInit(void);
+char gamecubeUpdate(void);
+char gamecubeUpdateButtons(void);
+
+/* Latest report of each controller, filled by gamecubeUpdate() */
+extern unsigned char gc_last_report[GC_NUM_PADS][GCN64_REPORT_SIZE];
+
+/* See gamepadReport() in gamepad.h. Only the joystick (bytes 0 and 1)
+ * and the buttons (bytes 6 and 7) are compared, as the mappings do
+ * not use the C stick and the analog triggers. */
+static inline char gamecubeReport(unsigned char pad, unsigned char *buf)
+{
+	const unsigned char *report = gc_last_report[pad];
+
+	if (report[0] == buf[0] && report[1] == buf[1] &&
+			report[6] == buf[6] && report[7] == buf[7])
+		return 0;
+
+	memcpy(buf, report, GCN64_REPORT_SIZE);
+
+	return 1;
+}
 
 #define GC_GET_START(report) (report[6] & 0x01)
 #define GC_GET_Y(report) (report[6] & 0x02)
@@ -18,3 +50,4 @@ Gamepad *gamecubeGetGamepad(void);
 #define GC_GET_DPAD_RIGHT(report) (report[7] & 0x04)
 #define GC_GET_DPAD_LEFT(report) (report[7] & 0x08)
 
+#endif // _gamecube_h__
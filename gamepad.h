@@ -1,29 +1,36 @@
 #ifndef _gamepad_h__
 #define _gamepad_h__
 
-typedef struct {
-	int num_reports;
-
-	// size of reports built by buildReport
-	int report_size;
-
-	int reportDescriptorSize;
-	void *reportDescriptor; // must be in flash
-
-	int deviceDescriptorSize; // if 0, use default
-	void *deviceDescriptor; // must be in flash
-
-	void (*init)(void);
-	char (*update)(void);
-	char (*changed)(int id);
-	int (*buildReport)(unsigned char *buf, int id);
-	void (*setVibration)(int value);
-
-	/* Check for the controller */
-	char (*probe)(void); /* return true if found */
-} Gamepad;
+/* Controller driver interface. The driver is chosen at build time, so
+ * the calls made for every poll are direct (or inlined) rather than
+ * going through function pointers.
+ *
+ *  gamepadInit()
+ *
+ *    Initialize the driver and the controllers.
+ *
+ *  char gamepadUpdate()
+ *
+ *    Read all controllers. Returns 0 if at least one could be read.
+ *
+ *  char gamepadUpdateButtons()
+ *
+ *    Same, but only the buttons are read. The transaction is shorter,
+ *    for when the NES leaves little time between latches. The sticks
+ *    and triggers keep their previous values.
+ *
+ *  char gamepadReport(unsigned char pad, unsigned char *buf)
+ *
+ *    Copy the latest report of a controller (gamecube.h format) to buf
+ *    if the bytes used by the mappings differ from those already in
+ *    buf. Returns non-zero if it did. buf must keep the previous report
+ *    of the controller.
+ */
+#include "gamecube.h"
+
+#define gamepadInit()				gamecubeInit()
+#define gamepadUpdate()				gamecubeUpdate()
+#define gamepadUpdateButtons()		gamecubeUpdateButtons()
+#define gamepadReport(pad, buf)		gamecubeReport(pad, buf)
 
 #endif // _gamepad_h__
-
-
-
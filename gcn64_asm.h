@@ -0,0 +1,230 @@
+#ifndef _gcn64_asm_h__
+#define _gcn64_asm_h__
+
+/* Timing constants and assembly of the Joybus send and receive loops.
+ * gcn64_protocol.c inlines them (see gcn64_receive and gcn64_sendBytes
+ * there for what they do and for the operands). The host tool
+ * tools/joybus.c assembles the same text and runs it in a simulated
+ * AVR against a virtual controller, so keep everything the loops need
+ * in here. */
+
+#include "cycles.h"
+
+// The bit timeout is a counter to 127. This is the
+// start value. Counting from 0 takes hundreads of
+// microseconds. Because of this, the reception function
+// "hangs in there" much longer than necessary..
+//
+// The receive loops take 5 cycles per iteration. The start value is chosen
+// for about 11uS (100 at 12MHz). Twice the expected maximum bit period.
+#define TIMING_OFFSET	(127 - NS_TO_CYCLES(11250) / 5)
+
+// Below 12MHz, the instructions following a rising edge of the reply
+// take about as long as a 1us low level. Run against a virtual controller
+// (tools/joybus.c), 1 in 200 replies with levels 250ns off was misread
+// at 10MHz, and 8MHz missed bits of replies with exact timings.
+#if F_CPU < 12000000L
+#error Joybus reception needs at least 12MHz
+#endif
+
+// Each level is timed by the loops below, but the code following a falling
+// edge (packing the bit that just completed) is longer than the code
+// following a rising edge: the first sample of a low level comes 13
+// cycles after the edge is seen (15 when a byte is stored), the first
+// sample of a high level 6 cycles after. Low levels therefore start
+// counting 2 loops (10 cycles) ahead. Like with the byte per level loop
+// and gcn64_decodeWorkbuf this replaced, lows are then counted a few
+// cycles long, and equal counts give a 0.
+#define LOW_COMPENSATION	2
+
+/* Operands:
+ *   %0 count (upper register), %1 Z (reply buffer), %2 PIN register,
+ *   %3 TIMING_OFFSET + LOW_COMPENSATION, %4 TIMING_OFFSET,
+ *   %5 max_bits (register), %6 data bit number
+ *
+ * Register usage:
+ *   r16 : Level duration counter
+ *   r17 : Duration of the last low level
+ *   r18 : Byte being assembled. Starts at 0x01 so the marker bit
+ *         reaches the carry once 8 bits have been shifted in.
+ */
+#define GCN64_RECEIVE_ASM \
+		"	push r30				\n"	/* save Z */ \
+		"	push r31				\n"	/* save Z */ \
+\
+		"	clr %0					\n" \
+		"	ldi r18, 0x01			\n" \
+		"	clr r16					\n" \
+"rx_initial_wait_low%=:\n" \
+		"	inc r16					\n" \
+		"	breq rx_error%=			\n" /* overflow to 0 */ \
+		"	sbic %2, %6				\n" \
+		"	rjmp rx_initial_wait_low%=	\n" \
+		ASM_NOPS("8") /* the low level of each next bit comes after 8 more cycles */ \
+\
+"rx_low%=:\n" \
+		"	ldi r16, %3				\n" \
+"rx_low_lp%=:\n" \
+		"	inc r16					\n" \
+		"	brmi rx_error%=			\n" /* > 127. Stuck low. */ \
+		"	sbis %2, %6				\n" \
+		"	rjmp rx_low_lp%=		\n" \
+\
+		"	mov r17, r16			\n" /* remember the low duration */ \
+		"	ldi r16, %4				\n" \
+"rx_high_lp%=:\n" \
+		"	inc r16					\n" \
+		"	brmi rx_done%=			\n" /* > 127. Stop bit. */ \
+		"	sbic %2, %6				\n" \
+		"	rjmp rx_high_lp%=		\n" \
+\
+		/* Falling edge. The bit is 1 if low < high (carry set) */ \
+		"	cp r17, r16				\n" \
+		"	rol r18					\n" \
+		"	brcc rx_next%=			\n" /* byte not complete yet */ \
+		"	st z+, r18				\n" \
+		"	ldi r18, 0x01			\n" \
+"rx_next%=:\n" \
+		"	inc %0					\n" /* count this bit */ \
+		"	cp %0, %5				\n" /* same cycles as cpi */ \
+		"	brne rx_low%=			\n" \
+		"	rjmp rx_done%=			\n" \
+\
+"rx_error%=:\n" \
+		"	clr %0					\n" \
+"rx_done%=:\n" \
+		"	pop r31					\n" /* restore z */ \
+		"	pop r30					\n" /* restore z */
+
+#ifdef GAMECUBE_TIMINGS // (3.6/1.4us)
+#define TX_SHORT_NS		1400
+#define TX_LONG_NS		3600
+#else // N64 timings (3/1us)
+#define TX_SHORT_NS		1000
+#define TX_LONG_NS		3000
+#endif
+
+#define TX_SHORT		NS_TO_CYCLES(TX_SHORT_NS)
+#define TX_LONG			NS_TO_CYCLES(TX_LONG_NS)
+
+// Levels may be off by this much when the instructions between
+// two edges do not fit in the requested duration.
+#define TX_TOLERANCE	NS_TO_CYCLES(250)
+
+// Delays to insert around the fixed instructions of gcn64_sendBytes
+// so levels last TX_SHORT/TX_LONG cycles. The sbi/cbi instructions,
+// NEXT_BIT (9), the loop end (4) and the next bit selection (3) are
+// accounted for.
+#define TX_DLY_SHORT_1ST	(TX_SHORT - 2)
+#define TX_DLY_LARGE_1ST	(TX_LONG - 2 - 9)
+#define TX_DLY_SHORT_2ND	(TX_SHORT < 9 ? 0 : TX_SHORT - 2 - 4 - 3)
+#define TX_DLY_LARGE_2ND	(TX_LONG - 2 - 9 - 4 - 3)
+
+#if (9 - TX_SHORT) > TX_TOLERANCE
+#error F_CPU too low for Joybus transmit timings
+#endif
+#if TX_DLY_LARGE_1ST > 255
+#error F_CPU too high for Joybus transmit timings
+#endif
+#if TX_DLY_LARGE_2ND < 0
+#error F_CPU too low for Joybus transmit timings
+#endif
+
+	// the value of the gpio is pre-configured to low. We simulate
+	// an open drain output by toggling the direction.
+#define PULL_DATA		"	sbi %2, %8              \n"
+#define RELEASE_DATA	"	cbi %2, %8              \n"
+
+	// Takes 9 cycles whether or not a new byte is loaded: within a byte,
+	// at the end of a byte, and at the end of the last one.
+#define NEXT_BIT		"	dec r18\n breq 1f\n nop\n nop\n nop\n nop\n nop\n rjmp 3f\n" \
+						"1: ldi r18, 8\n dec r19\n brne 2f\n nop\n rjmp 3f\n" \
+						"2: ld r16, z+\n3:\n"
+
+	// busy looping delays. The argument is an operand holding a cycle
+	// count (see TX_DLY_* above). A delay sub call takes 3*r17+7 cycles,
+	// so short delays are made of nops only.
+#define DLY(n)	".if " n " >= 10\n" \
+				" ldi r17, (" n " - 7) / 3\n rcall sb_dly%=\n" \
+				ASM_NOPS("(" n " - 7) - 3 * ((" n " - 7) / 3)") \
+				".else\n" \
+				ASM_NOPS(n) \
+				".endif\n"
+
+#define DLY_SHORT_1ST	DLY("%4")
+#define DLY_LARGE_1ST	DLY("%5")
+#define DLY_SHORT_2ND	DLY("%6")
+#define DLY_LARGE_2ND	DLY("%7")
+
+/* Operands:
+ *   %0 bits left (upper register pair, sbiw), %1 Z (source bytes),
+ *   %2 DDR register, %3 PIN register, %4-%7 TX_DLY_SHORT_1ST,
+ *   TX_DLY_LARGE_1ST, TX_DLY_SHORT_2ND, TX_DLY_LARGE_2ND,
+ *   %8 data bit number, %9 n_bytes (register)
+ *
+ * Register usage:
+ *   r16 : Byte being sent (shifted left, MSb goes to carry)
+ *   r17 : Delay loop counter
+ *   r18 : Bits left in r16
+ *   r19 : Bytes left, including r16. The byte after the last one is
+ *         not read.
+ */
+#define GCN64_SENDBYTES_ASM \
+	"	ld r16, z+			\n" \
+	"	ldi r18, 8			\n" \
+	"	mov r19, %9			\n" \
+\
+	"sb_loop%=:				\n" \
+	"	lsl r16				\n" \
+	"	brcs sb_send1%=		\n" \
+	"	nop					\n" /* same cycle count as brcs taken */ \
+\
+	"sb_send0%=:			\n" \
+	PULL_DATA \
+	NEXT_BIT \
+	DLY_LARGE_1ST \
+	RELEASE_DATA \
+	DLY_SHORT_2ND \
+	"	sbiw	%0, 1		\n" \
+	"	brne sb_loop%=		\n" \
+	"	rjmp sb_end%=		\n" \
+\
+	"sb_send1%=:			\n" \
+	PULL_DATA \
+	DLY_SHORT_1ST \
+	RELEASE_DATA \
+	NEXT_BIT \
+	DLY_LARGE_2ND \
+	"	sbiw	%0, 1		\n" \
+	"	brne sb_loop%=		\n" \
+	"	rjmp sb_end%=		\n" \
+\
+/* delay sub (arg r17) */ \
+	"sb_dly%=:				\n" \
+	"	dec r17				\n" \
+	"	brne sb_dly%=		\n" \
+	"	ret					\n" \
+\
+	"sb_end%=:\n" \
+	/* going here is fast so we need to extend the last */ \
+	/* delay. The high level before the stop bit ends up 4 */ \
+	/* cycles longer than the others, like with the byte per */ \
+	/* bit loop. */ \
+	"	nop\nnop\nnop\nnop\nnop\nnop\n" \
+	PULL_DATA \
+	DLY_SHORT_1ST \
+	RELEASE_DATA \
+\
+	/* Now, we need to loop until the wire is high to */ \
+	/* prevent the reception code from thinking this is */ \
+	/* the beginning of the first reply bit. */ \
+\
+	"	ldi r16, 0xff		\n" /* setup a timeout */ \
+	"sb_waitHigh%=:			\n" \
+	"	dec r16				\n" /* decrement timeout */ \
+	"	breq sb_wait_high_done%=		\n" /* handle timeout condition */ \
+	"	sbis %3, %8			\n" /* Read the port */ \
+	"	rjmp sb_waitHigh%=	\n" \
+"sb_wait_high_done%=:\n"
+
+#endif // _gcn64_asm_h__
@@ -18,6 +18,7 @@
 #include <util/delay.h>
 
 #include "gcn64_protocol.h"
+#include "boarddef.h"
 
 #undef FORCE_KEYBOARD
 #undef FORCE_GAMECUBE
@@ -31,296 +32,136 @@
 // But the option is there for those of you who are going to compile
 // the project and are willing to change this.
 #undef GAMECUBE_TIMINGS // If not defined, use N64 timings
+#ifdef GAMECUBE_TIMINGS
+#warning USING GAMECUBE TIMINGS
+#endif
+
+#include "gcn64_asm.h"
 
-#define GCN64_BUF_SIZE	300
-static volatile unsigned char gcn64_workbuf[GCN64_BUF_SIZE];
+/* Replies are packed on the fly by gcn64_receive, MSb first. The longest
+ * reply is the 80 bit gamecube origin. */
+#define GCN64_RX_MAX_BITS	80
+static volatile unsigned char gcn64_rxbuf[GCN64_RX_MAX_BITS / 8];
 
 /******** IO port definitions **************/
 #define GCN64_DATA_PORT	PORTC
 #define GCN64_DATA_DDR	DDRC
 #define GCN64_DATA_PIN	PINC
-#define GCN64_DATA_BIT	(1<<5)
+#define GCN64_DATA_BITNUM	5
+#define GCN64_DATA_BIT	(1<<GCN64_DATA_BITNUM)
 
-/*
- * \brief Explode bytes to bits
- * \param bytes 	The input byte array
- * \param num_bytes	The number of input bytes
- * \param workbuf_bit_offset	The offset to start writing at
- * \return number of bits (i.e. written output bytes)
- *
- * 1 input byte = 8 output bytes, where each output byte is zero or non-zero depending
- * on the input byte bits, starting with the most significant one.
- */
-static int bitsToWorkbufBytes(unsigned char *bytes, int num_bytes, int workbuf_bit_offset)
-{
-	int i, bit;
-	unsigned char p;
-
-	if (num_bytes * 8 > GCN64_BUF_SIZE)
-		return 0;
-
-	for (i=0,bit=0; i<num_bytes; i++) {
-		for (p=0x80; p; p>>=1) {
-			gcn64_workbuf[bit+workbuf_bit_offset] = bytes[i] & p;
-			bit++;
-		}
-	}	
+/* Second controller (GC_NUM_PADS > 1), on the same port */
+#define GCN64_DATA2_BITNUM	4
+#define GCN64_DATA2_BIT	(1<<GCN64_DATA2_BITNUM)
 
-	return bit;
-}
+/* The send and receive functions address the data pin with sbi/cbi/sbic/sbis,
+ * so the bit must be a constant. They are inlined once per channel. */
+#define GCN64_INLINE	static inline __attribute__((always_inline))
 
-/* Read a byte from the buffer (where 1 byte is 1 bit).
- * MSb first.
+/* Read a byte from the reply buffer. The offset is in bits
+ * and must be a multiple of 8.
  */
 unsigned char gcn64_protocol_getByte(int offset)
 {
-	unsigned char val, b;
-	unsigned char volatile *addr = gcn64_workbuf + offset;
-
-	for (b=0x80, val=0; b; b>>=1)
-	{
-		if (*addr)
-			val |= b;
-		addr++;
-	}
-	return val;
+	return gcn64_rxbuf[offset >> 3];
 }
 
 void gcn64_protocol_getBytes(int offset, int n_bytes, unsigned char *dstbuf)
 {
-	int i;
+	unsigned char volatile *src = gcn64_rxbuf + (offset >> 3);
 
-	for (i=0; i<n_bytes; i++) {
-		*dstbuf = gcn64_protocol_getByte(offset + (i*8));
+	while (n_bytes--) {
+		*dstbuf = *src;
 		dstbuf++;
+		src++;
 	}
 }
 
-// The bit timeout is a counter to 127. This is the 
-// start value. Counting from 0 takes hundreads of 
-// microseconds. Because of this, the reception function
-// "hangs in there" much longer than necessary..
-#define TIMING_OFFSET	100 // gives about 12uS. Twice the expected maximum bit period.
-
-static unsigned char gcn64_receive()
+/*
+ * \brief Receive a reply, packing bits as they arrive
+ * \param max_bits Stop once this many bits are received
+ * \return The number of bits received, 0 on timeout/error.
+ *
+ * Each bit is a low level followed by a high level. As soon as the
+ * high level of a bit ends (the falling edge starting the next bit or
+ * the stop bit), both durations are compared and the bit is shifted
+ * into the current byte:
+ *
+ *          ________________
+ * 1 : ____/                  (low shorter than high)
+ *                      ____
+ * 0 : ________________/      (low longer than high)
+ *
+ * The timings on a real N64 are 1/3us, but HORI pads use something
+ * similar to 1.5/4.5us. Only the ratio matters here.
+ *
+ * The stop bit is a short low state followed by an "infinite" high
+ * state which times out and ends the reception. A low state that
+ * times out is an error. When max_bits is reached first, the
+ * controller is still sending the rest of the reply.
+ *
+ * The loop is GCN64_RECEIVE_ASM in gcn64_asm.h.
+ */
+GCN64_INLINE unsigned char gcn64_receive(unsigned char bitnum, unsigned char max_bits)
 {
-	register unsigned char count=0;
+	register unsigned char count;
 
-#define SET_DBG	"	sbi %3, 4		\n"
-#define CLR_DBG	"	cbi %3, 4		\n"
-
-	// The data line has been released. 
+	// The data line has been released.
 	// The receive part below expects it to be still high
 	// and will wait for it to become low before beginning
 	// the counting.
 	asm volatile(
-		"	push r30				\n"	// save Z
-		"	push r31				\n"	// save Z
-		
-		"	clr %0					\n"
-		"	clr r16					\n"
-"initial_wait_low:\n"
-		"	inc r16					\n"
-		"	breq timeout			\n" // overflow to 0
-		"	sbic %2, 5				\n"
-		"	rjmp initial_wait_low	\n"
-
-		// the next transition is to a high bit	
-		"	rjmp waithigh			\n"
-
-"waitlow:\n"
-		"	ldi r16, %4				\n"
-"waitlow_lp:\n"
-		"	inc r16					\n"
-		"	brmi timeout			\n" // > 127 (approx 50uS timeout)
-		"	sbic %2, 5				\n"
-		"	rjmp waitlow_lp			\n"
-	
-		"	inc %0					\n" // count this timed low level
-		"	breq overflow			\n" // > 255
-		"	st z+,r16				\n"
-
-"waithigh:\n"
-		"	ldi r16, %4				\n"
-"waithigh_lp:\n"
-		"	inc r16					\n"
-		"	brmi timeout			\n" // > 127
-		"	sbis %2, 5				\n"
-		"	rjmp waithigh_lp		\n"
-	
-		"	inc %0					\n" // count this timed high level
-		"	breq overflow			\n" // > 255
-		"	st z+,r16				\n"
-
-		"	rjmp waitlow			\n"
-
-"overflow:  \n"
-"timeout:	\n"
-"			pop r31				\n" // restore z
-"			pop r30				\n" // restore z
-
-		: 	"=&r" (count)						// %0
-		: 	"z" ((unsigned char volatile *)gcn64_workbuf),		// %1
+		GCN64_RECEIVE_ASM
+		: 	"=&d" (count)						// %0
+		: 	"z" ((unsigned char volatile *)gcn64_rxbuf),		// %1
 			"I" (_SFR_IO_ADDR(GCN64_DATA_PIN)),	// %2
-			"I" (_SFR_IO_ADDR(PORTB)),			// %3
-			"M" (TIMING_OFFSET)					// %4
-		: 	"r16"
+			"M" (TIMING_OFFSET + LOW_COMPENSATION),	// %3
+			"M" (TIMING_OFFSET),				// %4
+			"r" (max_bits),						// %5
+			"I" (bitnum)						// %6
+		: 	"r16", "r17", "r18"
 	);
 
+	// Longer than the buffer
+	if (count > GCN64_RX_MAX_BITS)
+		return 0;
+
 	return count;
 }
 
-static void gcn64_sendBytes(unsigned char *data, unsigned char n_bytes)
+/*
+ * \brief Send bytes MSb first, followed by a stop bit
+ *
+ * Bits are shifted straight out of the caller's buffer. The next byte
+ * is fetched during the long part of each bit (NEXT_BIT in
+ * gcn64_asm.h), so all bits take the same time regardless of byte
+ * boundaries.
+ *
+ * The loop is GCN64_SENDBYTES_ASM in gcn64_asm.h.
+ */
+GCN64_INLINE void gcn64_sendBytes(unsigned char *data, unsigned char n_bytes, unsigned char bitnum)
 {
 	unsigned int bits;
+	unsigned char *src = data;
 
 	if (n_bytes == 0)
 		return;
 
-	// Explode the data to one byte per bit for very easy transmission in assembly.
-	// This trades memory for ease of implementation.
-	bits = bitsToWorkbufBytes(data, n_bytes, 0);
-	if (!bits)
-		return;
+	bits = n_bytes * 8;
 
-	// the value of the gpio is pre-configured to low. We simulate
-	// an open drain output by toggling the direction.
-#define PULL_DATA		"	sbi %0, 5               \n"
-#define RELEASE_DATA	"	cbi %0, 5               \n"
-
-	// busy looping delays based on busy loop and nop tuning.
-	// valid for 12Mhz clock.
-#ifdef GAMECUBE_TIMINGS // (3.6/1.5us)
-#define DLY_SHORT_1ST	"ldi r17, 2\n rcall sb_dly%=\nnop\nnop\n "
-#define DLY_LARGE_1ST	"ldi r17, 11\n rcall sb_dly%=\nnop\n"
-#define DLY_SHORT_2ND	"nop\nnop\nnop\nnop\nnop\n"
-#define DLY_LARGE_2ND	"ldi r17, 7\n rcall sb_dly%=\n nop\nnop\n"
-#warning USING GAMECUBE TIMINGS
-#else // N64 timings (3/1us)
-#define DLY_SHORT_1ST	"ldi r17, 1\n rcall sb_dly%=\n "
-#define DLY_LARGE_1ST	"ldi r17, 9\n rcall sb_dly%=\n"
-#define DLY_SHORT_2ND	"\n" 
-#define DLY_LARGE_2ND	"ldi r17, 5\n rcall sb_dly%=\n nop\nnop\n"
-#endif
 	asm volatile(
-	// Save the modified input operands
-	"	push r28			\n" // y
-	"	push r29			\n"
-	"	push r30			\n" // z
-	"	push r31			\n"
-
-	"sb_loop%=:				\n"
-	"	ld r16, z+			\n"
-	"	tst r16				\n"
-	"	breq sb_send0%=		\n"
-	"	brne sb_send1%=		\n"
-
-	"	rjmp sb_end%=		\n" // not reached
-
-
-	"sb_send0%=:			\n"
-	"	nop					\n"
-	PULL_DATA
-	DLY_LARGE_1ST
-	RELEASE_DATA
-	DLY_SHORT_2ND
-	"	sbiw	%1, 1		\n"
-	"	brne sb_loop%=		\n"
-	"	rjmp sb_end%=		\n"
-
-	"sb_send1%=:			\n"
-	PULL_DATA
-	DLY_SHORT_1ST
-	RELEASE_DATA
-	DLY_LARGE_2ND
-	"	sbiw	%1, 1		\n"
-	"	brne sb_loop%=		\n"
-	"	rjmp sb_end%=		\n"
-
-// delay sub (arg r17)
-	"sb_dly%=:				\n"
-	"	dec r17				\n"
-	"	brne sb_dly%=		\n"
-	"	ret					\n"
-	
-
-	"sb_end%=:\n"
-	// going here is fast so we need to extend the last
-	// delay by 500nS
-	"	nop\n "
-	"	pop r31				\n"
-	"	pop r30				\n"
-	"	pop r29				\n"
-	"	pop r28				\n"
-	PULL_DATA
-	DLY_SHORT_1ST
-	RELEASE_DATA
-
-	// Now, we need to loop until the wire is high to 
-	// prevent the reception code from thinking this is
-	// the beginning of the first reply bit.
-
-	"	ldi r16, 0xff		\n" // setup a timeout
-	"sb_waitHigh%=:			\n"
-	"	dec r16				\n" // decrement timeout
-	"	breq sb_wait_high_done%=		\n" // handle timeout condition
-	"	sbis %3, 5			\n" // Read the port
-	"	rjmp sb_waitHigh%=	\n"
-"sb_wait_high_done%=:\n"
-	:
-	: "I" (_SFR_IO_ADDR(GCN64_DATA_DDR)), // %0
-	  "w" (bits),						// %1
-	  "z" ((unsigned char volatile *)gcn64_workbuf),					// %2
-	  "I" (_SFR_IO_ADDR(GCN64_DATA_PIN))	// %3
-	: "r16", "r17");
-}
-
-/* \brief Decode the received length of low/high states to byte-per-bit format
- *
- * The result is in workbuf.
- *
- **/
-static void gcn64_decodeWorkbuf(unsigned char count)
-{
-	unsigned char i;
-	volatile unsigned char *output = gcn64_workbuf;
-	volatile unsigned char *input = gcn64_workbuf;
-	unsigned char t;
-
-    //  
-    //          ________
-    // ________/
-    //  
-    //   [i*2]    [i*2+1]
-    //  
-    //          ________________
-    // 0 : ____/
-    //                      ____
-    // 1 : ________________/
-    //  
-    // The timings on a real N64 are
-    //  
-    // 0 : 1 us low, 3 us high
-    // 1 : 3 us low, 1 us high
-    //  
-    // However, HORI pads use something similar to
-    //  
-    // 0 : 1.5 us low, 4.5 us high
-    // 1 : 4.5 us low, 1.5 us high
-    //  
-    //  
-    // No64 us = microseconds
-
-	// This operation takes approximately 100uS on 64bit gamecube messages
-	for (i=0; i<count; i++) {
-		t = *input; 
-		input++;
-
-		*output = t < *input;
-
-		input++;
-		output++;
-	}
+	GCN64_SENDBYTES_ASM
+	: "+w" (bits),						// %0
+	  "+z" (src)						// %1
+	: "I" (_SFR_IO_ADDR(GCN64_DATA_DDR)), // %2
+	  "I" (_SFR_IO_ADDR(GCN64_DATA_PIN)),	// %3
+	  "M" (TX_DLY_SHORT_1ST),				// %4
+	  "M" (TX_DLY_LARGE_1ST),				// %5
+	  "M" (TX_DLY_SHORT_2ND),				// %6
+	  "M" (TX_DLY_LARGE_2ND),				// %7
+	  "I" (bitnum),							// %8
+	  "r" (n_bytes)							// %9
+	: "r16", "r17", "r18", "r19");
 }
 
 void gcn64protocol_hwinit(void)
@@ -331,6 +172,11 @@ void gcn64protocol_hwinit(void)
 	// keep data low. By toggling the direction, we make the
 	// pin act as an open-drain output.
 	GCN64_DATA_PORT &= ~GCN64_DATA_BIT;
+
+#if GC_NUM_PADS > 1
+	GCN64_DATA_DDR &= ~(GCN64_DATA2_BIT);
+	GCN64_DATA_PORT &= ~GCN64_DATA2_BIT;
+#endif
 	
 	/* debug bit PORTB4 (MISO) */
 	DDRB |= 0x10;
@@ -339,41 +185,138 @@ void gcn64protocol_hwinit(void)
 
 
 
+volatile unsigned char gcn64_interrupted;
+Gcn64Stats gcn64_stats;
+
+static unsigned char gcn64_channel;
+
+/* Select the controller subsequent transactions are for
+ * (0 to GC_NUM_PADS-1). */
+void gcn64_setChannel(unsigned char channel)
+{
+	gcn64_channel = channel;
+}
+
+static unsigned char gcn64_channelBit(void)
+{
+#if GC_NUM_PADS > 1
+	if (gcn64_channel)
+		return GCN64_DATA2_BIT;
+#endif
+	return GCN64_DATA_BIT;
+}
+
+static unsigned char gcn64_transfer(unsigned char *data_out, int data_out_len, unsigned char max_bits)
+{
+#if GC_NUM_PADS > 1
+	if (gcn64_channel) {
+		gcn64_sendBytes(data_out, data_out_len, GCN64_DATA2_BITNUM);
+		return gcn64_receive(GCN64_DATA2_BITNUM, max_bits);
+	}
+#endif
+	gcn64_sendBytes(data_out, data_out_len, GCN64_DATA_BITNUM);
+	return gcn64_receive(GCN64_DATA_BITNUM, max_bits);
+}
+
+// How long the data line must stay high before retrying a transaction.
+// Longer than any high level within a command or reply, so a reply that
+// was still in progress when we were interrupted is over.
+#define GCN64_IDLE_US		10
+
+/* Wait until the data line is idle (high). Gives up after approximately
+ * 1ms in case the line is stuck low. */
+static void gcn64_waitIdle(void)
+{
+	unsigned int timeout = 1000;
+	unsigned char idle = 0, bit = gcn64_channelBit();
+
+	while (idle < GCN64_IDLE_US && --timeout) {
+		if (GCN64_DATA_PIN & bit)
+			idle++;
+		else
+			idle = 0;
+		_delay_us(1);
+	}
+}
+
+/* Set when the controller is still sending the end of a reply that
+ * gcn64_transactionPartial did not wait for. */
+static unsigned char gcn64_reply_left;
+
 /**
  * \brief Send n data bytes + stop bit, wait for answer.
- * \return The number of bits received, 0 on timeout/error.
+ * \return The number of bits received, 0 on timeout/error,
+ *         GCN64_PREEMPTED when interrupted too many times.
  *
- * The result is in gcn64_workbuf, where each byte represents
- * a bit.
+ * The result is packed in gcn64_rxbuf (MSb first). Use
+ * gcn64_protocol_getByte(s) to access it.
+ *
+ * Interrupts are left enabled, as serving the NES has priority. An
+ * interrupt handler running during the transfer stretches the levels
+ * and corrupts it, so handlers set gcn64_interrupted. The transaction
+ * is then retried once the line is idle, up to GCN64_MAX_RETRIES times.
+ * The time lost is added to gcn64_stats.lost_time, so the poll
+ * scheduler only counts the attempts which succeeded.
  */
 int gcn64_transaction(unsigned char *data_out, int data_out_len)
+{
+	return gcn64_transactionPartial(data_out, data_out_len, GCN64_RX_MAX_BITS + 1);
+}
+
+/**
+ * \brief Like gcn64_transaction, but only receive the first reply_bits
+ *        bits of the reply.
+ * \return reply_bits on success, otherwise like gcn64_transaction.
+ *
+ * The command phase and the part of the reply phase we wait for are
+ * shorter than a full transaction, so they fit in shorter gaps between
+ * NES latches. The controller sends the rest of its reply meanwhile,
+ * which the next transaction waits for.
+ */
+int gcn64_transactionPartial(unsigned char *data_out, int data_out_len, unsigned char reply_bits)
 {
 	int count;
+	unsigned char retries = 0;
+	unsigned int start;
+
+	if (gcn64_reply_left) {
+		gcn64_waitIdle();
+		gcn64_reply_left = 0;
+	}
+
+	while (1) {
+		start = TCNT1;
+		gcn64_interrupted = 0;
+		count = gcn64_transfer(data_out, data_out_len, reply_bits);
+		if (!gcn64_interrupted)
+			break;
+
+		gcn64_stats.preempted++;
+		if (retries == GCN64_MAX_RETRIES) {
+			gcn64_stats.dropped++;
+			gcn64_stats.lost_time += TCNT1 - start;
+			return GCN64_PREEMPTED;
+		}
+		retries++;
+		gcn64_waitIdle();
+		gcn64_stats.lost_time += TCNT1 - start;
+	}
+
+	if (retries)
+		gcn64_stats.retried++;
 
-	gcn64_sendBytes(data_out, data_out_len);
-	count = gcn64_receive();
 	if (!count)
 		return 0;
 
-	if (!(count & 0x01)) {
-		// If we don't get an odd number of level lengths from gcn64_receive
-		// something is wrong. 
-		//
-		// The stop bit is a short (~1us) low state followed by an "infinite"
-		// high state, which timeouts and lets the function return. This
-		// is why we should receive and odd number of lengths.
-		return 0;
-	}
+	if (count == reply_bits)
+		gcn64_reply_left = 1;
 
-	gcn64_decodeWorkbuf(count);
-	
 	/* this delay is required on N64 controllers. Otherwise, after sending
 	 * a rumble-on or rumble-off command (probably init too), the following
 	 * get status fails. This starts to work at 2us. 5 should be safe. */
 	_delay_us(5);
 	
-	/* return the number of full bits received. */
-	return (count-1) / 2;
+	return count;
 }
 
 
@@ -387,6 +330,10 @@ int gcn64_detectController(void)
 	unsigned short id;
 
 	count = gcn64_transaction(&tmp, 1);
+	if (count == GCN64_PREEMPTED) {
+		// Says nothing about what is connected
+		return GCN64_PREEMPTED;
+	}
 	if (count == 0) {
 		return CONTROLLER_IS_ABSENT;
 	}
@@ -18,6 +18,9 @@
 /* Returns button states and axis values */
 #define N64_GET_STATUS				0x01
 #define N64_GET_STATUS_REPLY_LENGTH	32
+/* The buttons are the first 16 bits of the status of both controllers.
+ * See gcn64_transactionPartial. */
+#define GCN64_BUTTONS_REPLY_LENGTH	16
 
 /* Read from the expansion bus. */
 #define N64_EXPANSION_READ			0x02
@@ -36,6 +39,11 @@
 #define GC_GETSTATUS3(rumbling)		((rumbling) ? 0x01 : 0x00)
 #define GC_GETSTATUS_REPLY_LENGTH	64
 
+/* Returns the stick and trigger values at rest (origin), in bytes 2 to
+ * 7. Acknowledges the get origin bit of the status. */
+#define GC_GETORIGIN				0x41
+#define GC_GETORIGIN_REPLY_LENGTH	80
+
 /* 3-byte poll keyboard command.
  * Source: http://hitmen.c02.at/files/yagcd/yagcd/chap9.html#sec9.3.3
  * */
@@ -158,9 +166,30 @@
 
 #define GC_KEY_ENTER			0x61
 
+/* Returned by gcn64_transaction when interrupts kept disturbing it */
+#define GCN64_PREEMPTED				(-1)
+#define GCN64_MAX_RETRIES			2
+
+typedef struct {
+	unsigned int preempted; // transfers disturbed by an interrupt
+	unsigned int retried; // transactions which succeeded after retrying
+	unsigned int dropped; // transactions given up (GCN64_PREEMPTED)
+	// Timer1 ticks spent in disturbed transfers and waiting to retry
+	// them. Wraps, compare two readings.
+	unsigned int lost_time;
+} Gcn64Stats;
+
+extern Gcn64Stats gcn64_stats;
+
+/* Interrupt handlers which may run during a transaction must set this. */
+extern volatile unsigned char gcn64_interrupted;
+
 void gcn64protocol_hwinit(void);
+void gcn64_setChannel(unsigned char channel);
+// CONTROLLER_IS_*, or GCN64_PREEMPTED if the NES disturbed the request
 int gcn64_detectController(void);
 int gcn64_transaction(unsigned char *data_out, int data_out_len);
+int gcn64_transactionPartial(unsigned char *data_out, int data_out_len, unsigned char reply_bits);
 
 unsigned char gcn64_protocol_getByte(int offset);
 void gcn64_protocol_getBytes(int offset, int n_bytes, unsigned char *dstbuf);
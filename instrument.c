@@ -0,0 +1,164 @@
+/*  GC to NES : Gamecube controller to NES adapter
+    Copyright (C) 2012-2016  Raphael Assenat <raph@raphnet.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/delay.h>
+#include "instrument.h"
+#include "gcn64_protocol.h"
+
+#ifdef INSTRUMENTATION
+
+/* The dump is sent on the debug pin. PB5 is the NES clock input when
+ * the SPI peripheral is used, so those builds have no instrumentation
+ * (see main.c). */
+#define INSTR_DUMP_PORT	PORTB
+#define INSTR_DUMP_DDR	DDRB
+#define INSTR_DUMP_BIT	5
+
+#define BIT_US			(1000000.0 / INSTR_BAUD)
+
+/* Bin width of each histogram (as a shift). At 12MHz, a tick is 5.33us */
+static const unsigned char bin_shift[INSTR_NUM_HISTOGRAMS] = {
+	[INSTR_SAMPLE_AGE] = 6,		// 341us bins
+	[INSTR_FRAME_INTERVAL] = 8,	// 1.37ms bins
+	[INSTR_INT0_TIME] = 3,		// 43us bins
+	[INSTR_POLL_TIME] = 3,
+};
+
+static unsigned int histograms[INSTR_NUM_HISTOGRAMS][INSTR_NUM_BINS];
+static unsigned int counters[INSTR_NUM_COUNTERS];
+
+/* Time of the last sample and whether the NES has read it yet. */
+static unsigned int sample_time;
+static unsigned char sample_fresh;
+
+void instr_init(void)
+{
+	INSTR_DUMP_PORT |= (1<<INSTR_DUMP_BIT); // idle
+	INSTR_DUMP_DDR |= (1<<INSTR_DUMP_BIT);
+}
+
+void instr_record(unsigned char id, unsigned int ticks)
+{
+	unsigned int bin;
+
+	bin = ticks >> bin_shift[id];
+	if (bin >= INSTR_NUM_BINS)
+		bin = INSTR_NUM_BINS - 1;
+
+	if (histograms[id][bin] != 0xffff)
+		histograms[id][bin]++;
+}
+
+void instr_count(unsigned char id)
+{
+	if (counters[id] != 0xffff)
+		counters[id]++;
+}
+
+/* A new gamecube sample is ready (now in sync_time() units) */
+void instr_sample(unsigned int now)
+{
+	if (sample_fresh)
+		instr_count(INSTR_MISSED);
+
+	sample_time = now;
+	sample_fresh = 1;
+}
+
+/* The NES latched at 'now' (in sync_time() units). A sample completed
+ * after the latch was not available to it. */
+void instr_latch(unsigned int now)
+{
+	unsigned int age = now - sample_time;
+
+	if (sample_fresh && age < 0x8000) {
+		instr_record(INSTR_SAMPLE_AGE, age);
+		sample_fresh = 0;
+	} else {
+		instr_count(INSTR_REUSED);
+	}
+}
+
+/* 8N1. Interrupts are only disabled for the duration of a byte so the
+ * NES keeps being served between bytes. */
+static unsigned char putByte(unsigned char c)
+{
+	unsigned char i, b = c;
+
+	cli();
+	INSTR_DUMP_PORT &= ~(1<<INSTR_DUMP_BIT); // start bit
+	_delay_us(BIT_US);
+	for (i=0; i<8; i++) {
+		if (b & 1)
+			INSTR_DUMP_PORT |= (1<<INSTR_DUMP_BIT);
+		else
+			INSTR_DUMP_PORT &= ~(1<<INSTR_DUMP_BIT);
+		b >>= 1;
+		_delay_us(BIT_US);
+	}
+	INSTR_DUMP_PORT |= (1<<INSTR_DUMP_BIT); // stop bit
+	sei();
+	_delay_us(BIT_US);
+
+	return c;
+}
+
+static unsigned char putWord(unsigned int w)
+{
+	unsigned char sum;
+
+	sum = putByte(w & 0xff);
+	sum += putByte(w >> 8);
+
+	return sum;
+}
+
+void instr_dump(void)
+{
+	unsigned char i, j, sum;
+
+	// Joybus counters are kept by gcn64_protocol.c (16 bit, wrapping)
+	counters[INSTR_JOYBUS_PREEMPTED] = gcn64_stats.preempted;
+	counters[INSTR_JOYBUS_RETRIED] = gcn64_stats.retried;
+	counters[INSTR_JOYBUS_DROPPED] = gcn64_stats.dropped;
+
+	putByte(INSTR_SYNC1);
+	putByte(INSTR_SYNC2);
+
+	sum = putByte(INSTR_VERSION);
+	sum += putWord(F_CPU / 1000);
+	sum += putByte(64);
+	sum += putByte(INSTR_NUM_HISTOGRAMS);
+	sum += putByte(INSTR_NUM_BINS);
+	sum += putByte(INSTR_NUM_COUNTERS);
+
+	for (i=0; i<INSTR_NUM_HISTOGRAMS; i++) {
+		sum += putByte(bin_shift[i]);
+		for (j=0; j<INSTR_NUM_BINS; j++) {
+			sum += putWord(histograms[i][j]);
+		}
+	}
+
+	for (i=0; i<INSTR_NUM_COUNTERS; i++) {
+		sum += putWord(counters[i]);
+	}
+
+	putByte(sum);
+}
+
+#endif // INSTRUMENTATION
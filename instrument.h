@@ -0,0 +1,61 @@
+#ifndef _instrument_h__
+#define _instrument_h__
+
+/* Build the instrumentation: timing histograms kept in RAM and
+ * dumped on the debug pin on request (hold R and Z, then press
+ * Start). Decode the captured pin with tools/instrdecode. */
+//#define INSTRUMENTATION
+
+/* Histograms. Values are Timer1 ticks (F_CPU/64) */
+#define INSTR_SAMPLE_AGE		0 // Gamecube sample to the NES latch reading it
+#define INSTR_FRAME_INTERVAL	1 // Time between NES frames
+#define INSTR_INT0_TIME			2 // Time spent in the latch interrupt
+#define INSTR_POLL_TIME			3 // Gamecube poll (Joybus transactions)
+#define INSTR_NUM_HISTOGRAMS	4
+
+#define INSTR_NUM_BINS			16
+
+/* Counters */
+#define INSTR_MISSED			0 // Samples replaced before the NES read them
+#define INSTR_REUSED			1 // Latches served with an already read sample
+#define INSTR_POLL_FAILED		2 // Polls without a valid reply from any controller
+#define INSTR_JOYBUS_PREEMPTED	3 // Joybus transfers disturbed by an interrupt
+#define INSTR_JOYBUS_RETRIED	4 // Transactions which succeeded after retrying
+#define INSTR_JOYBUS_DROPPED	5 // Transactions given up after too many retries
+#define INSTR_NUM_COUNTERS		6
+
+/* Dump frame format (sent 8N1, LSb first, at INSTR_BAUD on the debug pin):
+ *
+ *  INSTR_SYNC1 INSTR_SYNC2
+ *  version (INSTR_VERSION)
+ *  F_CPU in kHz (16 bit)
+ *  Timer prescaler
+ *  Number of histograms, Number of bins, Number of counters
+ *  For each histogram: bin shift (bin = ticks >> shift), bins (16 bit each)
+ *  Counters (16 bit each)
+ *  Checksum: Sum of the bytes from version to the last counter, mod 256.
+ *
+ * 16 bit values are little endian.
+ */
+#define INSTR_SYNC1				0xA5
+#define INSTR_SYNC2				0x5A
+#define INSTR_VERSION			1
+#define INSTR_BAUD				19200
+
+#ifdef INSTRUMENTATION
+void instr_init(void);
+void instr_record(unsigned char id, unsigned int ticks);
+void instr_sample(unsigned int now);
+void instr_latch(unsigned int now);
+void instr_count(unsigned char id);
+void instr_dump(void);
+#else
+#define instr_init()
+#define instr_record(id, ticks)
+#define instr_sample(now)
+#define instr_latch(now)
+#define instr_count(id)
+#define instr_dump()
+#endif
+
+#endif // _instrument_h__
@@ -21,31 +21,48 @@
 #include <avr/interrupt.h>
 
 #include "gcn64_protocol.h"
-#include "gamecube.h"
+#include "gamepad.h"
 #include "boarddef.h"
 #include "sync.h"
 #include "atmega168compat.h"
+#include "instrument.h"
+#include "nes.h"
+#include "profile.h"
+#include "mapping.h"
+#include "mainloop.h"
+
+/* Use the SPI peripheral (slave mode, clocked by the NES) to shift
+ * the data out instead of polling the clock in the latch interrupt.
+ * This requires different wiring. See README.md */
+//#define NES_SPI_OUTPUT
+
+#if defined(FOUR_SCORE) && defined(NES_SPI_OUTPUT)
+#error FOUR_SCORE uses the SPI peripheral for the second NES port
+#endif
+#if defined(SNES_OUTPUT) && (defined(FOUR_SCORE) || defined(NES_SPI_OUTPUT))
+#error SNES_OUTPUT is only supported by the default output code
+#endif
+#if defined(INSTRUMENTATION) && (defined(NES_SPI_OUTPUT) || defined(FOUR_SCORE))
+#error The instrumentation dump pin (PB5) is the SPI clock (SCK), an input driven by the NES
+#endif
 
+#if defined(NES_SPI_OUTPUT) || defined(FOUR_SCORE)
+// PB5 is the SPI clock input.
+#define DEBUG_LOW()
+#define DEBUG_HIGH()
+#else
 #define DEBUG_LOW()		PORTB &= ~(1<<5);
 #define DEBUG_HIGH()	PORTB |= (1<<5);
+#endif
 
 #ifdef AT168_COMPATIBLE
 	#define COMPAT_GIFR	EIFR
+	#define COMPAT_GICR	EIMSK
 #else
 	#define COMPAT_GIFR	GIFR
+	#define COMPAT_GICR	GICR
 #endif
 
-
-Gamepad *gcpad;
-unsigned char gc_report[GCN64_REPORT_SIZE];
-
-static volatile unsigned char g_nes_polled = 0;
-static volatile unsigned char g_turbo_on = 0;
-static volatile unsigned char int_counter = 0;
-
-static volatile unsigned char nesbyte = 0xff;
-static volatile unsigned char reuse;
-
 #define NES_DATA_PORT 	PORTC
 #define NES_DATA_BIT	0
 #define NES_CLOCK_BIT	1
@@ -53,61 +70,124 @@ static volatile unsigned char reuse;
 #define NES_LATCH_PIN	PIND
 #define NES_LATCH_BIT	2
 
-#define NES_BIT_A		0
-#define NES_BIT_B		1
-#define NES_BIT_SELECT	2
-#define NES_BIT_START	3
-#define NES_BIT_UP		4
-#define NES_BIT_DOWN	5
-#define NES_BIT_LEFT	6
-#define NES_BIT_RIGHT	7
+/* NES_SPI_OUTPUT wiring. The latch goes to both INT0 and SS. */
+#define NES_SPI_DDR		DDRB
+#define NES_SPI_PORT	PORTB
+#define NES_SPI_SS_BIT		2 // Latch
+#define NES_SPI_MOSI_BIT	3 // Shifted out after the 8 bits. See nes_spi_init.
+#define NES_SPI_MISO_BIT	4 // Data
+#define NES_SPI_SCK_BIT		5 // Clock
+
+
+#if defined(NES_SPI_OUTPUT) || defined(FOUR_SCORE)
+/* The latch is also connected to SS, so the SPI shift logic is held
+ * in reset while the latch is high. When the latch falls, the first
+ * bit (A) appears on MISO and the following bits are shifted out on
+ * each rising clock edge (CPOL=1, CPHA=0). Once the 8 bits are out,
+ * the bits received on MOSI follow. With NES_SPI_OUTPUT, MOSI has an
+ * external pull-down (the internal pull-up is off), so the data line
+ * stays low and further reads return 1 like an original controller.
+ * FOUR_SCORE keeps the pull-up instead: the bits of player 4 (nothing
+ * pressed) are high.
+ *
+ * All that is left for the interrupt is to load the byte, so a game
+ * latching continuously (eg: Paperboy pause screen) does not prevent
+ * the main loop from polling the gamecube controller.
+ */
+static void nes_spi_init(void)
+{
+	NES_SPI_DDR |= (1<<NES_SPI_MISO_BIT);
+	NES_SPI_DDR &= ~((1<<NES_SPI_SS_BIT) | (1<<NES_SPI_MOSI_BIT) | (1<<NES_SPI_SCK_BIT));
+#ifdef FOUR_SCORE
+	NES_SPI_PORT |= (1<<NES_SPI_MOSI_BIT);
+#else
+	NES_SPI_PORT &= ~(1<<NES_SPI_MOSI_BIT);
+#endif
 
+#ifdef FOUR_SCORE
+	SPCR = (1<<SPIE) | (1<<SPE) | (1<<CPOL);
+#else
+	SPCR = (1<<SPE) | (1<<CPOL);
+#endif
+	SPDR = 0xff;
+}
+#endif
+
+#ifdef FOUR_SCORE
+/* Bytes shifted out on NES port 2 since the latch */
+static volatile unsigned char port2_bytes;
+
+/* Called after each byte shifted out on port 2, with SPIF set. Accessing
+ * SPDR clears it. */
+static inline void port2Done(void)
+{
+	port2_bytes++;
+	if (port2_bytes == 2) {
+		SPDR = FOUR_SCORE_SIG2;
+	} else {
+		(void)SPDR;
+	}
+}
+
+/* Port 2 bytes completing while the latch interrupt is running are
+ * handled there (see dobit1). */
+ISR(SPI_STC_vect)
+{
+	port2Done();
+	gcn64_interrupted = 1;
+}
+#endif
+
+#ifdef NES_SPI_OUTPUT
 
 ISR(INT0_vect)
 {
-	unsigned char bit, dat;
+	unsigned char dat;
 
-	//DEBUG_HIGH();
+	dat = out_bytes[out_buf][0];
+
+	SPDR = dat;
+	latch_tcnt = TCNT1;
+
+	if (nes_reuse != 0xff)
+		nes_reuse++;
+
+	/* Let the main loop know about this interrupt occuring. */
+	g_nes_polled = 1;
+	gcn64_interrupted = 1;
+}
 
-	if (g_turbo_on) {
-		int_counter++;
-	}
-#if 1
-	// This is to detect 'continuously in handler' conditions.
-	// eg: Paperboy pause screen is continuously latching and reading the controller. 
-	// Many times per frame without delay. How can we read the gamecube controller to
-	// detect the 'start' button being pressed to exit the pause screen??	
-	//
-	// Unfortunately, in paperboy, unconnecting the controller exits the pause screen...
-	// I think no pause is better than no-exit pause? Ah if I had a shift register
-	// on board it would be easier.
-	//
-	reuse++;
-	if (reuse==0xff) {
-		// reuse is cleared each time we perform a read from the gamecube controller.
-#ifdef AT168_COMPATIBLE
-		EIMSK &= ~(1<<INT0);
 #else
-		GICR &= ~(1<<INT0);
-#endif
-		
-		// let the data line be high, so it looks as no buttons are pressed.
-		// This also looks like no controller to the game.
-		NES_DATA_PORT |= (1<<NES_DATA_BIT);
 
-		return;
-	}
+ISR(INT0_vect)
+{
+	unsigned char bit;
+	unsigned int dat;
+	volatile unsigned char *src;
+
+#ifdef INSTRUMENTATION
+	isr_entry = TCNT1;
 #endif
+	//DEBUG_HIGH();
+
+	if (nes_reuse != 0xff)
+		nes_reuse++;
 
 relatch:
 	COMPAT_GIFR |= (1<<INTF0);
-	dat = nesbyte;
+	src = out_bytes[out_buf];
 
-	if (g_turbo_on) {
-		if (int_counter&0x4) {
-			dat |= 0xc0;
-		}
-	}
+#ifdef FOUR_SCORE
+	// SS is high (latch), the byte goes straight to the shift register
+	(void)SPSR;
+	SPDR = src[OUT_PORT2];
+	port2_bytes = 0;
+#endif
+	// The bit to send is the MSb. The low byte holds the next byte.
+	dat = src[0] << 8;
+#if OUT_PORT1_BYTES > 1
+	dat |= src[1];
+#endif
 	
 	/**           __
 	 * Latch ____|  |________________________________________
@@ -118,16 +198,18 @@ relatch:
 	 *           A       B   Sel St  U   D   L   R      
 	 */
 	
-	if (dat & 0x80) {
+	if (dat & 0x8000) {
 		NES_DATA_PORT |= (1<<NES_DATA_BIT);
 	} else {
 		NES_DATA_PORT &= ~(1<<NES_DATA_BIT);
 	}
+	latch_tcnt = TCNT1;
 
 
 
-	dat <<= 1;
-	for (bit=0x80; bit; bit>>=1) 
+	// After the last byte, 0s are shifted in (line low) so further
+	// reads return 1 like an original controller.
+	for (bit=1; bit<=OUT_PORT1_BYTES*8; bit++) 
 	{
 
 		/* The big unrolled polling loop here is necessary. Otherwise,
@@ -1554,11 +1636,23 @@ relatch:
 		goto int0_done;
 
 dobit1:
-		if (dat & bit) {
+		dat <<= 1;
+		if (dat & 0x8000) {
 			NES_DATA_PORT |= (1<<NES_DATA_BIT);
 		} else {
 			NES_DATA_PORT &= ~(1<<NES_DATA_BIT);
 		}
+
+#if OUT_PORT1_BYTES > 1
+		if (!(bit & 7) && (bit >> 3) + 1 < OUT_PORT1_BYTES) {
+			dat |= src[(bit >> 3) + 1];
+		}
+#endif
+#ifdef FOUR_SCORE
+		if (SPSR & (1<<SPIF)) {
+			port2Done();
+		}
+#endif
 	}	
 	
 
@@ -1566,8 +1660,35 @@ int0_done:
 
 	/* Let the main loop know about this interrupt occuring. */
 	g_nes_polled = 1;
+	gcn64_interrupted = 1;
+#ifdef INSTRUMENTATION
+	isr_exit = TCNT1;
+#endif
 	//DEBUG_LOW();
 }
+#endif // NES_SPI_OUTPUT
+
+/* See mainloop.h. With the latch interrupt masked, the data line is
+ * left high: the NES reads nothing pressed, like no controller. With
+ * FOUR_SCORE, port 2 sends what the shift register received from MOSI
+ * (pull-up, nothing pressed) once its current byte is out. */
+char nes_latch_mask(void)
+{
+#ifdef NES_SPI_OUTPUT
+	return 0;
+#else
+	COMPAT_GICR &= ~(1<<INT0);
+	NES_DATA_PORT |= (1<<NES_DATA_BIT);
+	return 1;
+#endif
+}
+
+void nes_latch_unmask(void)
+{
+	// The latches seen while masked are not answered late
+	COMPAT_GIFR |= (1<<INTF0);
+	COMPAT_GICR |= (1<<INT0);
+}
 
 
 void byteTo8Bytes(unsigned char val, unsigned char volatile *dst)
@@ -1586,116 +1707,8 @@ unsigned char scaleValue(unsigned char raw)
 	return ((char)raw) * 24000L / 32767L;
 }
 
-void toNes(int pressed, int nes_btn_id)
-{
-	if (pressed)
-		nesbyte &= ~(0x80 >> nes_btn_id);
-	else
-		nesbyte |= (0x80 >> nes_btn_id);
-
-}
-
-void axisToNes(unsigned char val, int nes_btn_low, int nes_btn_high, unsigned char thres)
-{
-	if (val < (0x80 - thres)) {
-		toNes(1, nes_btn_low);
-	} 
-
-	if (val > (0x80 + thres)) {
-		toNes(1, nes_btn_high);
-	}
-}
-
-void axisToNes_mario(unsigned char val, int nes_btn_low, int nes_btn_high, int nes_run_button, unsigned char walk_thres, unsigned char run_thres)
-{
-	if (val < (0x80 - walk_thres)) {
-		toNes(1, nes_btn_low);
-		if (val < (0x80 - run_thres)) {
-			toNes(1, nes_run_button);
-		}
-	} 
-
-	if (val > (0x80 + walk_thres)) {
-		toNes(1, nes_btn_high);
-		if (val > (0x80 + run_thres)) {
-			toNes(1, nes_run_button);
-		}
-	}
-}
-
-#define MAPPING_DEFAULT			0
-#define MAPPING_LOWER_THRESHOLD	1
-#define MAPPING_AUTORUN			2
-
-
-#define AXIS_ON_OFF_THRESHOLD	56
-
-#define AXIS_ON_OFF_THRESHOLD2	32
-
-static int cur_mapping = MAPPING_DEFAULT;
-
-void doMapping()
-{
-	switch(cur_mapping) {
-		case MAPPING_DEFAULT:
-			toNes(GC_GET_A(gc_report), 			NES_BIT_A);	
-			toNes(GC_GET_B(gc_report), 			NES_BIT_B);	
-			toNes(GC_GET_Z(gc_report), 			NES_BIT_SELECT);
-			toNes(GC_GET_START(gc_report), 		NES_BIT_START);
-			toNes(GC_GET_DPAD_UP(gc_report), 	NES_BIT_UP);
-			toNes(GC_GET_DPAD_DOWN(gc_report), 	NES_BIT_DOWN);
-			toNes(GC_GET_DPAD_LEFT(gc_report), 	NES_BIT_LEFT);
-			toNes(GC_GET_DPAD_RIGHT(gc_report), NES_BIT_RIGHT);
-
-			axisToNes(gc_report[0], NES_BIT_LEFT, NES_BIT_RIGHT, AXIS_ON_OFF_THRESHOLD);
-			axisToNes(gc_report[1], NES_BIT_UP, NES_BIT_DOWN, AXIS_ON_OFF_THRESHOLD);
-			break;
-
-		case MAPPING_LOWER_THRESHOLD:
-			toNes(GC_GET_A(gc_report), 			NES_BIT_A);	
-			toNes(GC_GET_B(gc_report), 			NES_BIT_B);	
-			toNes(GC_GET_Z(gc_report), 			NES_BIT_SELECT);
-			toNes(GC_GET_START(gc_report), 		NES_BIT_START);
-			toNes(GC_GET_DPAD_UP(gc_report), 	NES_BIT_UP);
-			toNes(GC_GET_DPAD_DOWN(gc_report), 	NES_BIT_DOWN);
-			toNes(GC_GET_DPAD_LEFT(gc_report), 	NES_BIT_LEFT);
-			toNes(GC_GET_DPAD_RIGHT(gc_report), NES_BIT_RIGHT);
-
-			axisToNes(gc_report[0], NES_BIT_LEFT, NES_BIT_RIGHT, AXIS_ON_OFF_THRESHOLD2);
-			axisToNes(gc_report[1], NES_BIT_UP, NES_BIT_DOWN, AXIS_ON_OFF_THRESHOLD2);
-			break;
-
-		case MAPPING_AUTORUN:
-			toNes(GC_GET_A(gc_report), 			NES_BIT_A);	
-			toNes(GC_GET_B(gc_report), 			NES_BIT_B);	
-			toNes(GC_GET_Z(gc_report), 			NES_BIT_SELECT);
-			toNes(GC_GET_START(gc_report), 		NES_BIT_START);
-			toNes(GC_GET_DPAD_UP(gc_report), 	NES_BIT_UP);
-			toNes(GC_GET_DPAD_DOWN(gc_report), 	NES_BIT_DOWN);
-			toNes(GC_GET_DPAD_LEFT(gc_report), 	NES_BIT_LEFT);
-			toNes(GC_GET_DPAD_RIGHT(gc_report), NES_BIT_RIGHT);
-
-			axisToNes_mario(gc_report[0], NES_BIT_LEFT, NES_BIT_RIGHT, NES_BIT_B, 32, 64);
-
-			// This is not useful in mario, but as it does not appear to cause
-			// any problems, I do it anyway since it might be good for other games.
-			// (e.g. 2D view from above, with B button to run)
-			axisToNes_mario(gc_report[1], NES_BIT_UP, NES_BIT_DOWN, NES_BIT_B, 32, 64);
-
-			break;
-	}
-
-	if (GC_GET_L(gc_report)) {
-		g_turbo_on = 1;
-	} else {
-		g_turbo_on = 0;
-	}
-}
-
 int main(void)
 {
-	
-	gcpad = gamecubeGetGamepad();
 
 	/* PORTD
 	 * 2: NES Latch interrupt
@@ -1705,8 +1718,11 @@ int main(void)
 
 	DDRB = 0;
 	PORTB = 0xff;
+#if !defined(NES_SPI_OUTPUT) && !defined(FOUR_SCORE)
 	DDRB = 1<<5;
+#endif
 	DEBUG_LOW();
+	instr_init();
 
 	/* PORTC
 	 * 0: Data (output) 
@@ -1727,62 +1743,30 @@ int main(void)
 #endif
 
 	gcn64protocol_hwinit();
-	gcpad->init();
+#if defined(NES_SPI_OUTPUT) || defined(FOUR_SCORE)
+	nes_spi_init();
+#endif
+	gamepadInit();
 
 	_delay_ms(500);
 
 	/* Read from Gamecube controller */
-	gcpad->update();
-	gcpad->buildReport(gc_report, 0);
-
+	gamepadUpdate();
+	gamepadReport(0, gc_report[0]);
+	profile_init(gc_report[0]);
 
-	if (GC_GET_A(gc_report)) {
-		cur_mapping = MAPPING_AUTORUN;
-	}
-	if (GC_GET_B(gc_report)) {
-		cur_mapping = MAPPING_LOWER_THRESHOLD;
-	}
+	// Nothing pressed until the first poll
+	publishOutput();
 
 
 	sync_init();
+	mainloop_init();
 
 	sei();
 
 	while(1)
 	{
-		if (g_nes_polled) {
-			//DEBUG_HIGH();
-			g_nes_polled = 0;
-			sync_master_polled_us();
-//			DEBUG_LOW();
-		}
-
-		if (sync_may_poll() || (reuse == 0xff)) {	
-
-//			DEBUG_HIGH();
-			gcpad->update();
-//			DEBUG_LOW();
-
-
-			if (gcpad->changed(0)) {
-				// Read the gamepad
-				gcpad->buildReport(gc_report, 0);
-				// prepare the controller data byte
-				doMapping();
-			}
-
-			// It does not matter if the data changed or not. What matters
-			// is that it is a fresh read.
-			if (reuse == 0xff) {
-				// reenable int
-#ifdef AT168_COMPATIBLE
-				EIMSK |= (1<<INT0);
-#else
-				GICR |= (1<<INT0);
-#endif
-			}
-			reuse = 0;
-		}
+		mainloop_step();
 	}
 }
 
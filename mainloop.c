@@ -0,0 +1,169 @@
+/*  GC to NES : Gamecube controller to NES adapter
+    Copyright (C) 2012-2016  Raphael Assenat <raph@raphnet.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "port.h"
+#include "gcn64_protocol.h"
+#include "gamepad.h"
+#include "sync.h"
+#include "instrument.h"
+#include "mapping.h"
+#include "mainloop.h"
+
+volatile unsigned char g_nes_polled;
+volatile unsigned char nes_reuse;
+volatile unsigned int latch_tcnt;
+#ifdef INSTRUMENTATION
+volatile unsigned int isr_entry, isr_exit;
+#endif
+
+/* The game latches continuously (see CONTINUOUS_LATCHES) */
+static unsigned char continuous;
+
+/* Quick polls in a row given up because the latches kept disturbing
+ * them. With the polling output, the latch interrupt takes most of
+ * the time between the latches of a game latching in a loop (eg:
+ * Paperboy pause screen), so not even the buttons can be read. After
+ * QUICK_POLL_DROPS, one poll is made with the latches masked. */
+#define QUICK_POLL_DROPS	2
+static unsigned char quick_drops;
+static unsigned char switch_requested;
+#ifdef INSTRUMENTATION
+static unsigned char dump_requested;
+#endif
+
+void mainloop_init(void)
+{
+	continuous = 0;
+	quick_drops = 0;
+	switch_requested = 0;
+#ifdef INSTRUMENTATION
+	dump_requested = 0;
+#endif
+}
+
+void mainloop_step(void)
+{
+	unsigned char quick = 0, masked = 0;
+	char res;
+	unsigned int lost_time, t_latch, dropped;
+#ifdef INSTRUMENTATION
+	unsigned int t_entry, t_exit;
+#endif
+
+	if (g_nes_polled) {
+		g_nes_polled = 0;
+#ifdef INSTRUMENTATION
+		irq_disable();
+		t_entry = isr_entry;
+		t_exit = isr_exit;
+		irq_enable();
+		instr_latch(sync_time(t_entry));
+		instr_record(INSTR_INT0_TIME, t_exit - t_entry);
+#endif
+		irq_disable();
+		t_latch = latch_tcnt;
+		irq_enable();
+		if (sync_master_polled_us(timer_now() - t_latch)) {
+			mapNextFrame();
+		}
+
+		if (nes_reuse >= CONTINUOUS_LATCHES) {
+			continuous = 1;
+		}
+		quick = continuous;
+	}
+
+	if (quick || sync_may_poll()) {
+		if (quick && quick_drops >= QUICK_POLL_DROPS && nes_latch_mask()) {
+			quick_drops = 0;
+			quick = 0;
+			masked = 1;
+		}
+
+		if (quick) {
+			/* The game latches continuously, there is no time
+			 * for a full poll. Right after the latch, send the
+			 * status command and receive only the buttons, which
+			 * fits in a shorter gap. The latch interrupt stays
+			 * enabled and answers with out_bytes. A latch
+			 * disturbing the read makes it retry. */
+			dropped = gcn64_stats.dropped;
+			res = gamepadUpdateButtons();
+			if (gcn64_stats.dropped != dropped) {
+				quick_drops++;
+			} else {
+				quick_drops = 0;
+			}
+		} else {
+			sync_poll_started();
+			lost_time = gcn64_stats.lost_time;
+			res = gamepadUpdate();
+			if (masked) {
+				// Still latching continuously
+				nes_latch_unmask();
+			} else if (0 == res) {
+				continuous = 0;
+			}
+			if (0 == res) {
+				sync_poll_done(gcn64_stats.lost_time - lost_time);
+			}
+		}
+		if (res) {
+			instr_count(INSTR_POLL_FAILED);
+		}
+
+		// prepare the controller data bytes
+		mapPads();
+		publishOutput();
+
+		// R + Z + D-Pad right/left: Next/previous profile
+		if (GC_GET_R(gc_report[0]) && GC_GET_Z(gc_report[0]) &&
+				(GC_GET_DPAD_RIGHT(gc_report[0]) || GC_GET_DPAD_LEFT(gc_report[0]))) {
+			if (!switch_requested) {
+				switch_requested = 1;
+				switchProfile(GC_GET_DPAD_RIGHT(gc_report[0]));
+			}
+		} else {
+			switch_requested = 0;
+		}
+
+#ifdef INSTRUMENTATION
+		// R + Z + Start: Dump the measurements
+		if (GC_GET_R(gc_report[0]) && GC_GET_Z(gc_report[0]) && GC_GET_START(gc_report[0])) {
+			if (!dump_requested) {
+				dump_requested = 1;
+				instr_dump();
+			}
+		} else {
+			dump_requested = 0;
+		}
+#endif
+
+		// It does not matter if the data changed or not. What matters
+		// is that it is a fresh read.
+		nes_reuse = 0;
+	}
+#ifdef OVERSAMPLING
+	else if (sync_may_oversample()) {
+		// Extra poll. Only its presses matter, the published byte
+		// still comes from the poll right before the latch.
+		if (0 == gamepadUpdate()) {
+			mapPads();
+			mapOversample();
+		}
+	}
+#endif
+}
@@ -0,0 +1,41 @@
+#ifndef _mainloop_h__
+#define _mainloop_h__
+
+/* The main loop body: what follows a latch, the controller polls and
+ * the profile switch. main.c only keeps the hardware setup and the
+ * latch interrupt, so the host tools (tools/syncsim.c,
+ * tools/padtest.c) run this same code against simulated latches. */
+
+/* Set by the latch interrupt, cleared by mainloop_step() */
+extern volatile unsigned char g_nes_polled;
+
+/* Latches served since the last gamecube read. Saturates at 0xff. */
+extern volatile unsigned char nes_reuse;
+
+/* Timer1 when the last latch was answered (first bit out). The main
+ * loop only sees the latch once the interrupt is over, which takes
+ * the whole read with the polling output. */
+extern volatile unsigned int latch_tcnt;
+
+#ifdef INSTRUMENTATION
+/* Timer1 at latch interrupt entry and exit */
+extern volatile unsigned int isr_entry, isr_exit;
+#endif
+
+/* Implemented by main.c (and the host tools): stop answering the
+ * latches, for a poll which the latch interrupt would keep disturbing.
+ * Returns 0 if the output does not need it (NES_SPI_OUTPUT: the
+ * interrupt only loads SPDR). Meanwhile, the NES reads nothing
+ * pressed. */
+char nes_latch_mask(void);
+void nes_latch_unmask(void);
+
+/* Forget the state kept between iterations (continuous latching,
+ * profile switch requests). */
+void mainloop_init(void);
+
+/* One main loop iteration. Called forever with interrupts enabled,
+ * after sync_init(). */
+void mainloop_step(void);
+
+#endif // _mainloop_h__
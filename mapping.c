@@ -0,0 +1,219 @@
+/*  GC to NES : Gamecube controller to NES adapter
+    Copyright (C) 2012-2016  Raphael Assenat <raph@raphnet.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "port.h"
+#include "gamepad.h"
+#include "mapping.h"
+#include "profile.h"
+
+/* From the controller reports to the bytes shifted out to the NES:
+ * button and joystick mapping (current profile), turbo and
+ * oversampling. Runs in the main loop, the latch interrupt only reads
+ * the published bytes. */
+
+unsigned char gc_report[GC_NUM_PADS][GCN64_REPORT_SIZE];
+
+volatile unsigned char out_bytes[2][OUT_BYTES];
+volatile unsigned char out_buf;
+
+/* NES buttons pressed according to the latest gamecube reports */
+static PadMask pressed[GC_NUM_PADS];
+static unsigned char turbo_on[GC_NUM_PADS];
+/* Joystick directions currently pressed (GATE_* bits), and on which
+ * side of each axis (GATE_SIDE_*) */
+static unsigned char gate_state[GC_NUM_PADS];
+
+#define GATE_SIDE_LEFT	0x40
+#define GATE_SIDE_UP	0x80
+
+/* Directions which may stay pressed, by side changes since the last
+ * report ((gate_state ^ side) >> 6): a direction is only held on the
+ * side it was pressed on. */
+static const unsigned char gate_keep[4] = {
+	0xff, (unsigned char)~GATE_HORIZ, (unsigned char)~GATE_VERT,
+	(unsigned char)~(GATE_HORIZ | GATE_VERT)
+};
+
+/* Position of each turbo button in its cycle, in frames */
+static unsigned char turbo_pos[PAD_BITS];
+/* Turbo buttons to release during the next frame */
+static PadMask turbo_released;
+
+#ifdef OVERSAMPLING
+/* Buttons seen pressed by the extra polls, and those of them already
+ * part of the published byte (read by the NES at the next frame) */
+static PadMask sticky[GC_NUM_PADS], sticky_published[GC_NUM_PADS];
+#endif
+
+/* Called when the NES starts a new frame. Turbo advances per frame
+ * rather than per latch, so its rate does not depend on how many
+ * times the game reads the controller. */
+static void turboNextFrame(void)
+{
+	unsigned char i;
+	PadMask released = 0;
+
+	for (i=0; i<PAD_BITS; i++) {
+		if (!turbo_period[i])
+			continue;
+
+		turbo_pos[i]++;
+		if (turbo_pos[i] >= turbo_period[i])
+			turbo_pos[i] = 0;
+		if (turbo_pos[i] >= turbo_pressed[i])
+			released |= PAD_MASK(i);
+	}
+
+	turbo_released = released;
+}
+
+/* The NES (or SNES) bits for a controller (active low) */
+static PadMask padOutput(unsigned char pad)
+{
+	PadMask dat = pressed[pad];
+
+#ifdef OVERSAMPLING
+	dat |= sticky[pad];
+	sticky_published[pad] = sticky[pad];
+#endif
+
+	if (turbo_on[pad])
+		dat &= ~turbo_released;
+
+	return ~dat;
+}
+
+/* Make the NES bytes for the next frame available to the latch
+ * interrupt. Called after each gamecube poll, which is scheduled
+ * before the first latch of the next frame, so all the latches of
+ * a frame see the same bytes. */
+void publishOutput(void)
+{
+	unsigned char buf;
+#ifdef SNES_OUTPUT
+	PadMask dat;
+#endif
+
+	buf = out_buf ^ 1;
+#ifdef SNES_OUTPUT
+	dat = padOutput(0);
+	out_bytes[buf][0] = dat >> 8;
+	out_bytes[buf][1] = dat;
+#else
+	out_bytes[buf][0] = padOutput(0);
+#endif
+#ifdef FOUR_SCORE
+	out_bytes[buf][1] = 0xff; // Player 3, not connected
+	out_bytes[buf][2] = FOUR_SCORE_SIG1;
+	out_bytes[buf][OUT_PORT2] = padOutput(1);
+#endif
+	out_buf = buf;
+}
+
+/* Find the NES buttons pressed in a controller report using the tables
+ * of the current profile (see profile.c): a few loads, ORs and compares whatever
+ * is pressed. The joystick offsets from the origin (0x80, see
+ * gamecube.c) index the gate table. */
+void doMapping(unsigned char pad)
+{
+	const unsigned char *report = gc_report[pad];
+	unsigned char btns = report[6];
+	signed char dx = report[0] ^ 0x80, dy = report[1] ^ 0x80;
+	unsigned char ax, ay, gate, side, held;
+	PadMask mask;
+
+	mask = btn1_lo_table[btns & 0x0f] | btn1_hi_table[btns >> 4] |
+				btn2_table[report[7] & 0x0f];
+
+	// One's complement, so each side has 128 positions (0-127)
+	ax = dx < 0 ? ~dx : dx;
+	ay = dy < 0 ? ~dy : dy;
+	gate = profile_gate[ay >> GATE_SHIFT][ax >> GATE_SHIFT];
+	// Directions already pressed, on the same side, use the hysteresis
+	// thresholds
+	side = (dx < 0 ? GATE_SIDE_LEFT : 0) | (dy < 0 ? GATE_SIDE_UP : 0);
+	held = gate_state[pad] & gate_keep[(gate_state[pad] ^ side) >> 6];
+	gate = (gate & ((1<<GATE_HOLD_SHIFT)-1)) | ((gate >> GATE_HOLD_SHIFT) & held);
+	gate_state[pad] = gate | side;
+
+	if (gate & GATE_HORIZ)
+		mask |= dx < 0 ? PAD_LEFT : PAD_RIGHT;
+	if (gate & GATE_VERT)
+		mask |= dy < 0 ? PAD_UP : PAD_DOWN;
+	if (gate & GATE_RUN)
+		mask |= PAD_RUN;
+
+	pressed[pad] = mask;
+	turbo_on[pad] = GC_GET_L(report);
+}
+
+/* Map the reports of the controllers which changed. Call after a
+ * successful gamepadUpdate() */
+void mapPads(void)
+{
+	unsigned char pad;
+
+	for (pad=0; pad<GC_NUM_PADS; pad++) {
+		if (gamepadReport(pad, gc_report[pad])) {
+			doMapping(pad);
+		}
+	}
+}
+
+/* Select the next (or previous) profile. It applies to the current
+ * reports right away, not only once they change. */
+void switchProfile(char next)
+{
+	unsigned char pad;
+
+	if (next) {
+		profile_next();
+	} else {
+		profile_previous();
+	}
+
+	for (pad=0; pad<GC_NUM_PADS; pad++) {
+		doMapping(pad);
+	}
+}
+
+/* Called when the NES starts a new frame */
+void mapNextFrame(void)
+{
+#ifdef OVERSAMPLING
+	unsigned char pad;
+
+	for (pad=0; pad<GC_NUM_PADS; pad++) {
+		sticky[pad] &= ~sticky_published[pad];
+		sticky_published[pad] = 0;
+	}
+#endif
+
+	turboNextFrame();
+}
+
+#ifdef OVERSAMPLING
+/* After an extra poll, keep what it found pressed until the NES has
+ * read it once. Call after mapPads() */
+void mapOversample(void)
+{
+	unsigned char pad;
+
+	for (pad=0; pad<GC_NUM_PADS; pad++) {
+		sticky[pad] |= pressed[pad];
+	}
+}
+#endif
@@ -0,0 +1,49 @@
+#ifndef _mapping_h__
+#define _mapping_h__
+
+#include "boarddef.h"
+#include "gamecube.h"
+#include "nes.h"
+
+/* Poll the controller several times per frame when the schedule leaves
+ * time for it, and keep the buttons pressed during those extra polls
+ * until the NES has read them once. Quick taps falling between two
+ * frames are then not lost. */
+//#define OVERSAMPLING
+
+#ifdef FOUR_SCORE
+/* NES port 1 sends player 1, player 3 and the Four Score signature.
+ * Port 2 sends player 2, player 4 and its own signature, but player 4
+ * (nothing pressed) is what the SPI shift register receives from MOSI
+ * while player 2 is sent, and the signature is loaded by port2Done().
+ * Bits are active low, read order MSb first. */
+#define OUT_PORT1_BYTES		3
+#define OUT_PORT2			OUT_PORT1_BYTES
+#define OUT_BYTES			(OUT_PORT1_BYTES + 1)
+#define FOUR_SCORE_SIG1		0xef // 0 0 0 1 0 0 0 0
+#define FOUR_SCORE_SIG2		0xdf // 0 0 1 0 0 0 0 0
+#else
+#define OUT_PORT1_BYTES		(PAD_BITS / 8)
+#define OUT_BYTES			OUT_PORT1_BYTES
+#endif
+
+/* Reports of the controllers, as last mapped */
+extern unsigned char gc_report[GC_NUM_PADS][GCN64_REPORT_SIZE];
+
+/* NES output bytes, double buffered. publishOutput() fills the buffer
+ * not designated by out_buf and then switches to it by updating out_buf,
+ * a single byte store, so the latch interrupt always sees complete
+ * data. */
+extern volatile unsigned char out_bytes[2][OUT_BYTES];
+extern volatile unsigned char out_buf;
+
+void doMapping(unsigned char pad);
+void mapPads(void);
+void mapNextFrame(void);
+void publishOutput(void);
+void switchProfile(char next);
+#ifdef OVERSAMPLING
+void mapOversample(void);
+#endif
+
+#endif // _mapping_h__
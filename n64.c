@@ -0,0 +1,126 @@
+/*	GC to NES : Gamecube controller to NES adapter
+    Copyright (C) 2012-2016  Raphael Assenat <raph@raphnet.net>
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "boarddef.h"
+#include "gamecube.h"
+#include "gcn64_protocol.h"
+#include "n64.h"
+
+#ifdef N64_SUPPORT
+
+/* The N64 stick reaches about +/-80 (it is zeroed by the controller
+ * at power up, or when L+R+Start is pressed). It is scaled by 5/4 to
+ * about +/-100, the range of a gamecube stick, so the thresholds of
+ * mappings.def have the same effect with both. */
+static unsigned char n64Axis(signed char v)
+{
+	int scaled = v + (v >> 2);
+
+	if (scaled < -128)
+		scaled = -128;
+	if (scaled > 127)
+		scaled = 127;
+
+	return scaled + 0x80;
+}
+
+/*
+	Bit		Function
+	0		A
+	1		B
+	2		Z
+	3		Start
+	4-7		Up,Down,Left,Right
+	8		Reset (L+R+Start pressed, stick zeroed)
+	9		Always 0
+	10		L
+	11		R
+	12-15	C-Up,C-Down,C-Left,C-Right
+	16-23	Joy X (signed)
+	24-31	Joy Y (signed)
+ */
+static void n64Buttons(unsigned char *report)
+{
+	unsigned char btns1, btns2, rb1, rb2, cx, cy;
+
+	btns1 = gcn64_protocol_getByte(0);
+	btns2 = gcn64_protocol_getByte(8);
+
+	/* Gamecube report bits. C-Left and C-Down are also Y and X, the
+	 * gamecube buttons at the same place. */
+	rb1 = rb2 = 0;
+	if (btns1 & 0x10) rb1 |= 0x01; // Start
+	if (btns2 & 0x02) rb1 |= 0x02; // C-Left (Y)
+	if (btns2 & 0x04) rb1 |= 0x04; // C-Down (X)
+	if (btns1 & 0x40) rb1 |= 0x08; // B
+	if (btns1 & 0x80) rb1 |= 0x10; // A
+	if (btns2 & 0x20) rb1 |= 0x20; // L
+	if (btns2 & 0x10) rb1 |= 0x40; // R
+	if (btns1 & 0x20) rb1 |= 0x80; // Z
+	if (btns1 & 0x08) rb2 |= 0x01; // Up
+	if (btns1 & 0x04) rb2 |= 0x02; // Down
+	if (btns1 & 0x01) rb2 |= 0x04; // Right
+	if (btns1 & 0x02) rb2 |= 0x08; // Left
+
+	// C buttons as a digital C stick
+	cx = cy = 0x80;
+	if (btns2 & 0x02) cx = 0x00;
+	if (btns2 & 0x01) cx = 0xff;
+	if (btns2 & 0x04) cy = 0x00;
+	if (btns2 & 0x08) cy = 0xff;
+
+	report[2] = cx;
+	report[3] = cy ^ 0xff;
+	// Digital L and R, as fully pressed or released analog triggers
+	report[4] = (btns2 & 0x20) ? 0x00 : 0xff;
+	report[5] = (btns2 & 0x10) ? 0x00 : 0xff;
+	report[6] = rb1;
+	report[7] = rb2;
+}
+
+char n64UpdatePad(unsigned char *report)
+{
+	unsigned char tmp = N64_GET_STATUS;
+	int count;
+
+	count = gcn64_transaction(&tmp, 1);
+	if (count != N64_GET_STATUS_REPLY_LENGTH) {
+		return count == GCN64_PREEMPTED ? GCN64_PREEMPTED : 1;
+	}
+
+	n64Buttons(report);
+	report[0] = n64Axis(gcn64_protocol_getByte(16));
+	report[1] = n64Axis(gcn64_protocol_getByte(24)) ^ 0xff;
+
+	return 0;
+}
+
+char n64UpdateButtons(unsigned char *report)
+{
+	unsigned char tmp = N64_GET_STATUS;
+	int count;
+
+	count = gcn64_transactionPartial(&tmp, 1, GCN64_BUTTONS_REPLY_LENGTH);
+	if (count != GCN64_BUTTONS_REPLY_LENGTH) {
+		return count == GCN64_PREEMPTED ? GCN64_PREEMPTED : 1;
+	}
+
+	n64Buttons(report);
+
+	return 0;
+}
+
+#endif // N64_SUPPORT
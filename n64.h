@@ -0,0 +1,17 @@
+#ifndef _n64_h__
+#define _n64_h__
+
+/* N64 controller driver, used for the ports where
+ * gcn64_detectController() finds an N64 controller (see gamecube.c).
+ * The report is built in the gamecube format (gamecube.h) so the
+ * mappings apply unchanged.
+ *
+ * Returns 0 on success, GCN64_PREEMPTED if the transaction was
+ * disturbed, 1 otherwise (controller gone). */
+char n64UpdatePad(unsigned char *report);
+
+/* Same, but only the buttons (bytes 2 to 7 of the report) are read.
+ * See gamecubeUpdateButtons(). */
+char n64UpdateButtons(unsigned char *report);
+
+#endif // _n64_h__
@@ -0,0 +1,62 @@
+#ifndef _nes_h__
+#define _nes_h__
+
+/* Drive a SNES controller port instead: 16 bits per read (12 buttons
+ * and a 4 bit controller ID). The mapping comes from the SNES_ entries
+ * of mappings.def. See README.md */
+//#define SNES_OUTPUT
+
+/* Bit positions in the byte shifted out to the NES, counted from
+ * the most significant bit (the first one read). */
+#define NES_BIT_A		0
+#define NES_BIT_B		1
+#define NES_BIT_SELECT	2
+#define NES_BIT_START	3
+#define NES_BIT_UP		4
+#define NES_BIT_DOWN	5
+#define NES_BIT_LEFT	6
+#define NES_BIT_RIGHT	7
+
+#define NES_MASK(nes_btn_id)	(0x80 >> (nes_btn_id))
+
+/* Same for the 16 bits shifted out to the SNES. The last 4 bits are
+ * the controller ID, which is 0 (never pressed) for a standard
+ * controller. */
+#define SNES_BIT_B		0
+#define SNES_BIT_Y		1
+#define SNES_BIT_SELECT	2
+#define SNES_BIT_START	3
+#define SNES_BIT_UP		4
+#define SNES_BIT_DOWN	5
+#define SNES_BIT_LEFT	6
+#define SNES_BIT_RIGHT	7
+#define SNES_BIT_A		8
+#define SNES_BIT_X		9
+#define SNES_BIT_L		10
+#define SNES_BIT_R		11
+
+#define SNES_MASK(snes_btn_id)	(0x8000 >> (snes_btn_id))
+
+/* Masks of buttons as shifted out by this build, and the buttons
+ * the firmware presses itself (joystick directions, auto run). */
+#ifdef SNES_OUTPUT
+typedef unsigned int PadMask;
+#define PAD_BITS		16
+#define PAD_MASK(id)	SNES_MASK(id)
+#define PAD_UP			SNES_MASK(SNES_BIT_UP)
+#define PAD_DOWN		SNES_MASK(SNES_BIT_DOWN)
+#define PAD_LEFT		SNES_MASK(SNES_BIT_LEFT)
+#define PAD_RIGHT		SNES_MASK(SNES_BIT_RIGHT)
+#define PAD_RUN			SNES_MASK(SNES_BIT_Y)
+#else
+typedef unsigned char PadMask;
+#define PAD_BITS		8
+#define PAD_MASK(id)	NES_MASK(id)
+#define PAD_UP			NES_MASK(NES_BIT_UP)
+#define PAD_DOWN		NES_MASK(NES_BIT_DOWN)
+#define PAD_LEFT		NES_MASK(NES_BIT_LEFT)
+#define PAD_RIGHT		NES_MASK(NES_BIT_RIGHT)
+#define PAD_RUN			NES_MASK(NES_BIT_B)
+#endif
+
+#endif // _nes_h__
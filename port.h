@@ -0,0 +1,142 @@
+#ifndef _port_h__
+#define _port_h__
+
+/* Hardware access of the modules which are not timing critical
+ * (sync.c, mainloop.c, profile.c, mapping.c, gamecube.c), so they also
+ * build for a host when PORT_HOST is defined. The host side is
+ * implemented by the tool using them (see tools/syncsim.c and
+ * tools/padtest.c). The NES and Joybus code (main.c, gcn64_protocol.c)
+ * is cycle counted and keeps using the registers directly.
+ *
+ * Timer1 counts at F_CPU/64, it is the time base of sync.c:
+ *
+ *  timer_init()       Start counting from 0
+ *  timer_now()        Ticks counted since the last restart
+ *  timer_restart()    Count from 0 again and clear the overflow flag
+ *  timer_overflowed() Whether the timer overflowed since the last
+ *                     restart. Clears the flag.
+ *
+ * What the latch interrupt leaves for the main loop (mainloop.c) is
+ * read with interrupts disabled:
+ *
+ *  irq_disable()      cli()
+ *  irq_enable()       sei()
+ *
+ * Constant tables are kept in flash (PROGMEM) and the profiles in the
+ * EEPROM:
+ *
+ *  flash_read_byte(addr)          Byte of a PROGMEM variable
+ *  flash_read_block(dst, src, n)  Copy n bytes of a PROGMEM variable
+ *  eeprom_get_byte(addr)          Byte at an EEPROM address
+ *  eeprom_get_block(dst, addr, n) Copy n bytes from an EEPROM address
+ *
+ * On the host, PROGMEM variables are ordinary ones and the EEPROM is
+ * the port_eeprom array, erased (0xff) until the tool fills it.
+ */
+#define PORT_EEPROM_SIZE	512
+
+#ifdef PORT_HOST
+
+void timer_init(void);
+unsigned int timer_now(void);
+void timer_restart(void);
+char timer_overflowed(void);
+
+// The simulated latches only happen between main loop iterations
+#define irq_disable()
+#define irq_enable()
+
+#include <string.h>
+
+#define PROGMEM
+
+extern unsigned char port_eeprom[PORT_EEPROM_SIZE];
+
+static inline unsigned char flash_read_byte(const void *addr)
+{
+	return *(const unsigned char *)addr;
+}
+
+static inline void flash_read_block(void *dst, const void *src, unsigned int n)
+{
+	memcpy(dst, src, n);
+}
+
+static inline unsigned char eeprom_get_byte(unsigned int addr)
+{
+	return port_eeprom[addr];
+}
+
+static inline void eeprom_get_block(void *dst, unsigned int addr, unsigned int n)
+{
+	memcpy(dst, port_eeprom + addr, n);
+}
+
+#else
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include "atmega168compat.h"
+
+#ifdef AT168_COMPATIBLE
+#define PORT_TIFR	TIFR1
+#else
+#define PORT_TIFR	TIFR
+#endif
+
+static inline void timer_init(void)
+{
+	TCCR1A = 0;
+	TCCR1B = (1<<CS11) | (1<<CS10); // /64
+	TCNT1 = 0;
+}
+
+static inline unsigned int timer_now(void)
+{
+	return TCNT1;
+}
+
+static inline void timer_restart(void)
+{
+	TCNT1 = 0;
+	PORT_TIFR |= (1<<TOV1);
+}
+
+static inline char timer_overflowed(void)
+{
+	if (PORT_TIFR & (1<<TOV1)) {
+		PORT_TIFR |= (1<<TOV1);
+		return 1;
+	}
+
+	return 0;
+}
+
+#define irq_disable()	cli()
+#define irq_enable()	sei()
+
+static inline unsigned char flash_read_byte(const void *addr)
+{
+	return pgm_read_byte(addr);
+}
+
+static inline void flash_read_block(void *dst, const void *src, unsigned int n)
+{
+	memcpy_P(dst, src, n);
+}
+
+static inline unsigned char eeprom_get_byte(unsigned int addr)
+{
+	return eeprom_read_byte((const uint8_t *)addr);
+}
+
+static inline void eeprom_get_block(void *dst, unsigned int addr, unsigned int n)
+{
+	eeprom_read_block(dst, (const void *)addr, n);
+}
+
+#endif // PORT_HOST
+
+#endif // _port_h__
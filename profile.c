@@ -0,0 +1,193 @@
+/*  GC to NES : Gamecube controller to NES adapter
+    Copyright (C) 2012-2016  Raphael Assenat <raph@raphnet.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include "port.h"
+#include "gamecube.h"
+#include "profile.h"
+#include "maptables.h"
+
+/* Profiles are stored in a compact form (see profile.h). Selecting one
+ * expands it into the tables doMapping() uses, so the EEPROM is only
+ * read when switching profiles. */
+PadMask btn1_lo_table[16], btn1_hi_table[16], btn2_table[16];
+unsigned char turbo_period[PAD_BITS], turbo_pressed[PAD_BITS];
+unsigned char profile_gate[GATE_CELLS][GATE_CELLS];
+
+#ifdef SNES_OUTPUT
+#define PROFILE_FLAGS	PROFILE_FLAG_SNES
+#else
+#define PROFILE_FLAGS	0
+#endif
+
+static unsigned char eeprom_profiles; // 0: using the built-in profiles
+static unsigned char cur_profile;
+
+/* Returns the number of profiles in the EEPROM image, 0 if there is no
+ * valid image for this build. */
+static unsigned char eepromProfiles(void)
+{
+	unsigned char hdr[PROFILE_HEADER_SIZE];
+	unsigned int addr, end;
+	unsigned char sum, n;
+
+	eeprom_get_block(hdr, 0, PROFILE_HEADER_SIZE);
+	if (hdr[0] != PROFILE_MAGIC1 || hdr[1] != PROFILE_MAGIC2 ||
+			hdr[2] != PROFILE_VERSION || hdr[3] != PROFILE_FLAGS)
+		return 0;
+
+	n = hdr[4];
+	if (n < 1 || n > PROFILE_MAX)
+		return 0;
+
+	sum = hdr[2] + hdr[3] + hdr[4];
+	end = PROFILE_IMAGE_SIZE(n) - 1;
+	for (addr = PROFILE_HEADER_SIZE; addr < end; addr++)
+		sum += eeprom_get_byte(addr);
+	if (sum != eeprom_get_byte(end))
+		return 0;
+
+	return n;
+}
+
+/* Directions pressed at a position (first quadrant, in half positions)
+ * beyond the walk and run radius (squared, 0: never), within the
+ * diagonal zone edges at this slope (see profile.h). */
+static unsigned char gateDirs(unsigned char cx, unsigned char cy, unsigned long r2,
+								unsigned long walk2, unsigned long run2, unsigned int slope)
+{
+	unsigned char dirs = 0;
+
+	if (r2 > walk2) {
+		if (((unsigned long)cx << 15) >= (unsigned long)cy * slope)
+			dirs |= GATE_HORIZ;
+		if (((unsigned long)cy << 15) >= (unsigned long)cx * slope)
+			dirs |= GATE_VERT;
+	}
+	if (run2 && r2 > run2)
+		dirs |= GATE_RUN;
+
+	return dirs;
+}
+
+/* Build the gate table of the joystick parameters, deciding each cell
+ * at its center like tools/gate.c does in floating point. This takes a
+ * few milliseconds, so it is only done when a profile is selected. */
+static void buildGate(const struct profile_stick *s)
+{
+	unsigned char hold_walk = s->walk > s->hysteresis ? s->walk - s->hysteresis : 0;
+	unsigned char hold_run = s->run > s->hysteresis ? s->run - s->hysteresis : 1;
+	unsigned long walk2 = 4UL * s->walk * s->walk;
+	unsigned long run2 = 4UL * s->run * s->run;
+	unsigned long hold_walk2 = 4UL * hold_walk * hold_walk;
+	unsigned long hold_run2 = s->run ? 4UL * hold_run * hold_run : 0;
+	unsigned int slope = s->slope[0][0] | (unsigned int)s->slope[0][1] << 8;
+	unsigned int hold_slope = s->slope[1][0] | (unsigned int)s->slope[1][1] << 8;
+	unsigned char x, y, cx, cy;
+	unsigned long r2;
+
+	for (y=0; y<GATE_CELLS; y++) {
+		cy = (y << (GATE_SHIFT + 1)) + (1 << GATE_SHIFT) - 1;
+		for (x=0; x<GATE_CELLS; x++) {
+			cx = (x << (GATE_SHIFT + 1)) + (1 << GATE_SHIFT) - 1;
+			r2 = (unsigned long)cx * cx + (unsigned int)cy * cy;
+			profile_gate[y][x] = gateDirs(cx, cy, r2, walk2, run2, slope) |
+				gateDirs(cx, cy, r2, hold_walk2, hold_run2, hold_slope) << GATE_HOLD_SHIFT;
+		}
+	}
+}
+
+static unsigned char numProfiles(void)
+{
+	return eeprom_profiles ? eeprom_profiles : NUM_MAPPINGS;
+}
+
+static void loadProfile(unsigned char n)
+{
+	struct profile p;
+	PadMask masks[PROFILE_GC_BUTTONS];
+	PadMask lo, hi, b2;
+	unsigned char i, b;
+
+	if (eeprom_profiles) {
+		eeprom_get_block(&p, PROFILE_HEADER_SIZE + n * sizeof(struct profile),
+							sizeof(struct profile));
+	} else {
+		flash_read_block(&p, &builtin_profiles[n], sizeof(struct profile));
+	}
+
+	for (b=0; b<PROFILE_GC_BUTTONS; b++) {
+		masks[b] = 0;
+		for (i=0; i<PAD_BITS; i++) {
+			if (p.buttons[b][i >> 3] & (1 << (i & 7)))
+				masks[b] |= PAD_MASK(i);
+		}
+	}
+
+	// The tables are indexed by report nibbles (buttons 0-3, 4-7, 8-11)
+	for (i=0; i<16; i++) {
+		lo = hi = b2 = 0;
+		for (b=0; b<4; b++) {
+			if (i & (1 << b)) {
+				lo |= masks[b];
+				hi |= masks[b + 4];
+				b2 |= masks[b + 8];
+			}
+		}
+		btn1_lo_table[i] = lo;
+		btn1_hi_table[i] = hi;
+		btn2_table[i] = b2;
+	}
+
+	for (i=0; i<PAD_BITS; i++) {
+		turbo_period[i] = p.turbo[i];
+		turbo_pressed[i] = (p.turbo[i] + 1) / 2;
+	}
+
+	buildGate(&p.stick);
+
+	cur_profile = n;
+}
+
+void profile_init(const unsigned char *report)
+{
+	unsigned char n = 0;
+
+	eeprom_profiles = eepromProfiles();
+
+	// Holding A or B at power on selects the auto run or lower
+	// threshold mapping, or the profile at the same position.
+	if (GC_GET_A(report)) {
+		n = MAPPING_AUTORUN;
+	}
+	if (GC_GET_B(report)) {
+		n = MAPPING_LOWER_THRESHOLD;
+	}
+	if (n >= numProfiles())
+		n = 0;
+
+	loadProfile(n);
+}
+
+void profile_next(void)
+{
+	loadProfile(cur_profile + 1 < numProfiles() ? cur_profile + 1 : 0);
+}
+
+void profile_previous(void)
+{
+	loadProfile(cur_profile ? cur_profile - 1 : numProfiles() - 1);
+}
@@ -0,0 +1,84 @@
+#ifndef _profile_h__
+#define _profile_h__
+
+#include "nes.h"
+
+/* Mapping profiles: button mapping, turbo and joystick mapping. The
+ * built-in profiles come from mappings.def (one per MAPPING entry).
+ * A set of profiles can also be written to the EEPROM, it then
+ * replaces the built-in ones. Build the EEPROM image from a text
+ * file with tools/mkprofile (see profiles.txt).
+ *
+ * The current profile is expanded into the tables below when it is
+ * selected. Hold R and Z, then press D-Pad right (or left) to select
+ * the next (or previous) profile. */
+
+/* Gate table entries (built from the joystick parameters of the
+ * profile, see profile.c). The low bits are the directions to press,
+ * the high bits those which stay pressed if they already were. */
+#define GATE_SHIFT		3
+#define GATE_CELLS		(128 >> GATE_SHIFT)
+#define GATE_HORIZ		0x01
+#define GATE_VERT		0x02
+#define GATE_RUN		0x04
+#define GATE_HOLD_SHIFT	4
+
+/* EEPROM image format (at address 0):
+ *
+ *  PROFILE_MAGIC1 PROFILE_MAGIC2
+ *  version (PROFILE_VERSION)
+ *  flags (PROFILE_FLAG_*)
+ *  Number of profiles (1 to PROFILE_MAX)
+ *  Profiles (struct profile)
+ *  Checksum: Sum of the bytes from version to the end of the last
+ *  profile, mod 256.
+ *
+ * Buttons and turbo are by NES bit (nes.h), or by SNES bit when
+ * PROFILE_FLAG_SNES is set. An image is ignored by a firmware built
+ * for the other console.
+ */
+#define PROFILE_MAGIC1			0x47 // 'G'
+#define PROFILE_MAGIC2			0x50 // 'P'
+#define PROFILE_VERSION			2
+#define PROFILE_FLAG_SNES		0x01
+#define PROFILE_HEADER_SIZE		5
+#define PROFILE_MAX				8
+
+/* Gamecube buttons, numbered from the report bits: byte 6 bit 0
+ * (Start) is 0, byte 7 bit 3 (D-Pad left) is 11. See gamecube.h */
+#define PROFILE_GC_BUTTONS		12
+#define PROFILE_BITS			16
+
+/* Joystick parameters, as the MAPPING entries of mappings.def */
+struct profile_stick {
+	unsigned char walk, run, diagonal, hysteresis;
+	// Slopes (tangent, 1.15 fixed point, little endian) of the edges of
+	// the diagonal zone, measured from the axes: 45 degrees minus half
+	// the diagonal angle, then minus the hysteresis angle too. 0 if
+	// negative. Computed by the host tools (tools/gate.c).
+	unsigned char slope[2][2];
+};
+
+struct profile {
+	struct profile_stick stick;
+	// NES/SNES bits pressed by each gamecube button. Bit n is NES/SNES
+	// bit n, little endian.
+	unsigned char buttons[PROFILE_GC_BUTTONS][2];
+	// Turbo period in frames by NES/SNES bit (0: no turbo)
+	unsigned char turbo[PROFILE_BITS];
+};
+
+#define PROFILE_IMAGE_SIZE(n)	(PROFILE_HEADER_SIZE + (n) * sizeof(struct profile) + 1)
+
+/* The current profile, expanded for main.c */
+extern PadMask btn1_lo_table[16], btn1_hi_table[16], btn2_table[16];
+extern unsigned char turbo_period[PAD_BITS], turbo_pressed[PAD_BITS];
+extern unsigned char profile_gate[GATE_CELLS][GATE_CELLS];
+
+/* Find the profiles and select the first one, or another one
+ * according to the buttons held at power on. */
+void profile_init(const unsigned char *report);
+void profile_next(void);
+void profile_previous(void);
+
+#endif // _profile_h__
@@ -20,6 +20,7 @@
 
 #include "support.h"
 #include "boarddef.h"
+#include "cycles.h"
 
 // used to send a 8 bit command..
 int _n64Update(unsigned char tmp)
@@ -36,8 +37,8 @@ int _n64Update(unsigned char tmp)
 	 *
 	 * Edit sbi/cbi/andi instructions to use the right bit!
 	 * 
-	 * 3 us == 36 cycles
-	 * 1 us == 12 cycles
+	 * Delays were tuned at 12MHz (3 us == 36 cycles, 1 us == 12 cycles)
+	 * and are now derived from F_CPU. See the operands below.
 	 */
 	asm volatile(
 "			push r30				\n"
@@ -54,12 +55,9 @@ int _n64Update(unsigned char tmp)
 "rjmp end\n"			
 "send1:								\n"
 "			sbi %1, 5				\n" // 2
-"				nop\nnop\nnop\nnop	\n" // 4
-"				nop\nnop\nnop\nnop	\n" // 4
-"				nop\nnop\nnop\nnop	\n" // 4
-"				nop\nnop	\n" // 4
+			ASM_NOPS("%6")						// 14 at 12MHz
 "			cbi %1, 5				\n" // 2
-"				ldi r19, 12			\n"	// 1 
+"				ldi r19, %7			\n"	// 1 (12 at 12MHz)
 "lp1:			dec r19				\n"	// 1 
 "				brne lp1			\n"	// 2
 "				nop\nnop			\n" // 2
@@ -69,13 +67,13 @@ int _n64Update(unsigned char tmp)
 		
 /* Send a 0: 3us Low, 1us High */
 "send0:		sbi %1, 5				\n"	// 2
-"				ldi r19, 15			\n"	// 1
+"				ldi r19, %8			\n"	// 1 (15 at 12MHz)
 "lp0:			dec r19				\n"	// 1
 "				brne lp0			\n"	// 2
 "				nop					\n" // 1
 
 "          	cbi %1, 5				\n" // 2
-"				nop\nnop\nnop\nnop\nnop\nnop				\n" // 2
+			ASM_NOPS("%9")						// 6 at 12MHz
 
 "			lsr r16					\n" // 1
 "			breq done				\n" // 1
@@ -83,16 +81,12 @@ int _n64Update(unsigned char tmp)
 
 "done:								\n"
 "			cbi %1, 5				\n"
-"			nop\nnop\nnop\nnop		\n"	// 4
-"			nop\nnop\nnop\nnop		\n"	// 2
+			ASM_NOPS("%10")						// 8 at 12MHz
 
 
 // Stop bit (1us low, 3us high)
 "          	sbi %1, 5				\n" // 2
-"			nop\nnop\nnop\nnop		\n" // 4
-"			nop\nnop\nnop\nnop		\n" // 4
-"			nop\nnop\nnop\nnop		\n" // 4
-"			nop\nnop		\n" // 4
+			ASM_NOPS("%6")						// 14 at 12MHz
 "			cbi %1, 5				\n" 
 
 
@@ -122,14 +116,10 @@ int _n64Update(unsigned char tmp)
 //  high:  0     1     1     1
 //	 low:  0     0     0     1
 //
-// I check the pin on the 24th cycle which is the safest place.
+// I check the pin on the 24th cycle (2us) which is the safest place.
 
 //"			cbi %5, 5\n"				// DEBUG
-"			nop\nnop\n	" // 2
-"			nop\nnop\nnop\nnop\n	" // 4
-"			nop\nnop\nnop\nnop\n	" // 4
-"			nop\nnop\nnop\nnop\n	" // 4
-"			nop\n"
+			ASM_NOPS("%11")						// 17 at 12MHz
 			
 			// We are now more or less aligned on the 24th cycle.			
 "			in r18, %4\n			" // 1  Read from the port
@@ -169,7 +159,13 @@ int _n64Update(unsigned char tmp)
 			: "=&r" (count)
 			: "I" (_SFR_IO_ADDR(GC_DATA_DDR)), "r"(tmp), 
 				"z"(results), "I" (_SFR_IO_ADDR(GC_DATA_PIN)),
-				"I" (_SFR_IO_ADDR(PORTB))
+				"I" (_SFR_IO_ADDR(PORTB)),
+				"M" (CYCLES_PER_US + 2),			// %6
+				"M" (CYCLES_PER_US),				// %7
+				"M" (CYCLES_PER_US * 5 / 4),		// %8
+				"M" (CYCLES_PER_US - 6),			// %9
+				"M" (CYCLES_PER_US - 4),			// %10
+				"M" (NS_TO_CYCLES(2000) - 7)		// %11
 			: "r16","r17","r18","r19"
 			);
 
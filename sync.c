@@ -14,8 +14,10 @@
     You should have received a copy of the GNU General Public License
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
-#include <avr/io.h>
-#include "atmega168compat.h"
+#include <string.h>
+#include "port.h"
+#include "sync.h"
+#include "instrument.h"
 
 /* Forces the old behaviour which means a stable time distance 
  * between N64 poll and our Gamecube * poll. Sometimes useful
@@ -65,92 +67,267 @@
 
 /* The time required to poll a gamecube controller is 300uS. 
  * The extra 150uS is a safety margin against jitter.
+ *
+ * This is only used until real polls have been timed (see
+ * sync_poll_done).
  * */
 #define TIME_TO_POLL				333	// 450uS
-#define MARGIN						666
 
 #define MIN_IDLE					1700 // 5ms
 
 #define DEFAULT_THRESHOLD			2333	// approx 7ms at /64 prescaler
 
+/* Timer1 runs at F_CPU/64 */
+#define US_TO_TICKS(us)				((unsigned int)((F_CPU / 64 / 1000) * (us) / 1000))
+
+/* How long before the predicted NES latch the poll should complete,
+ * in addition to the observed latch jitter. Lower means fresher data,
+ * but less tolerance to unexpected delays. */
+#ifndef SYNC_TARGET_LEAD_US
+#define SYNC_TARGET_LEAD_US			250
+#endif
+#define TARGET_LEAD					US_TO_TICKS(SYNC_TARGET_LEAD_US)
+
+/* Number of frame intervals the frame period is the median of. Odd. */
+#define HISTORY_SIZE				5
+
+/* The poll duration is the worst of the current and previous windows
+ * of this many polls, so it follows slower or faster controllers. */
+#define POLL_WINDOW					64
+
+/* Minimum time between the start of extra polls (see
+ * sync_may_oversample). Short enough to catch 1ms taps, with some
+ * margin for the timer resolution and the main loop latency. */
+#define OVERSAMPLE_INTERVAL			US_TO_TICKS(900)
+
 #define STATE_WAIT_THRES			0
 #define STATE_THRESHOLD_REACHED		1
 
 static unsigned int poll_threshold;
 static unsigned char state;
+static unsigned int next_oversample;
+/* Ticks from the latch starting the current frame to Timer1 0 */
+static unsigned int frame_late;
 
-#ifdef AT168_COMPATIBLE
-#define TIFR TIFR1
-#endif
+/* Frame interval history (Timer1 ticks) */
+static unsigned int intervals[HISTORY_SIZE];
+static unsigned char n_intervals, interval_pos;
+
+/* Poll duration measurement */
+static unsigned int poll_start, window_max;
+static unsigned char window_count;
+
+SyncStats sync_stats;
+
+/* Accumulates the time elapsed before each Timer1 reset. See sync_time */
+static unsigned int time_base;
 
 void sync_init(void)
 {
-	TCCR1A = 0;
-	TCCR1B = (1<<CS11) | (1<<CS10);
-	TCNT1 = 0;
-
 	/* /64 divisor. Overflows every 262ms */
+	timer_init();
+
 	state = STATE_WAIT_THRES;
 	poll_threshold = DEFAULT_THRESHOLD;
+	n_intervals = 0;
+	interval_pos = 0;
 
+	window_max = 0;
+	window_count = 0;
+	memset(&sync_stats, 0, sizeof(sync_stats));
+	sync_stats.poll_time = TIME_TO_POLL;
 }
 
-void sync_master_polled_us(void)
+/* Frame period and latch jitter from the recorded frame intervals.
+ *
+ * The period is the median, so lag frames (a frame without latch) and
+ * odd intervals are ignored as long as they are a minority. The jitter
+ * is the spread of the intervals once the extremes are dropped. */
+static void filterIntervals(void)
 {
-	unsigned int elapsed;
-	int ignore_elapsed = 0;
+	unsigned int sorted[HISTORY_SIZE], v;
+	unsigned char i, j;
+
+	for (i=0; i<n_intervals; i++) {
+		v = intervals[i];
+		for (j=i; j>0 && sorted[j-1] > v; j--) {
+			sorted[j] = sorted[j-1];
+		}
+		sorted[j] = v;
+	}
+
+	sync_stats.frame_period = sorted[n_intervals / 2];
+	if (n_intervals >= 3) {
+		sync_stats.latch_jitter = sorted[n_intervals - 2] - sorted[1];
+	} else {
+		sync_stats.latch_jitter = 0;
+	}
+}
 
-	if (TIFR & (1<<TOV1)) {
-		TIFR |= 1<<TOV1; // clear overflow
+/*
+ * Called after each NES latch.
+ *
+ * Games may latch several times per frame (eg: Metroid). Only latches
+ * occuring at least MIN_IDLE after the previous frame boundary start a
+ * new frame. Timer1 therefore counts the time since the first latch of
+ * the current frame, and the poll is scheduled before the next frame is
+ * expected, leaving time for the measured poll duration, the latch
+ * jitter and TARGET_LEAD.
+ *
+ * late is the time from the latch to this call (Timer1 ticks): the
+ * latch interrupt, which lasts the whole read with the polling output
+ * (about 300us for the 24 bits of the Four Score), and the main loop.
+ * Timer1 restarts at the call, so the poll is scheduled that much
+ * earlier.
+ *
+ * Returns non-zero when the latch started a new frame.
+ */
+char sync_master_polled_us(unsigned int late)
+{
+	unsigned int elapsed;
 
-		/* The N64 is probably not polling. Revert to default
-		 * threshold instead of calculating an invalid one. */
+	if (timer_overflowed()) {
+		/* The NES is probably not polling. Revert to default
+		 * threshold and forget the frame period. */
 		poll_threshold = DEFAULT_THRESHOLD;
-		ignore_elapsed = 1;
+		sync_stats.frame_period = 0;
+		n_intervals = 0;
 	}
+	else {
+		// From the previous frame start
+		elapsed = timer_now() + frame_late - late;
+
+		if (elapsed <= MIN_IDLE) {
+			// Additional latch within the same frame.
+			return 0;
+		}
 
-	if (!ignore_elapsed) {
-		elapsed = TCNT1;
 #ifdef OLD_MODE
-		if (elapsed > MIN_IDLE)
-			poll_threshold = 2; //MARGIN;
+		poll_threshold = 2; //MARGIN;
 #else
-		if (elapsed > MIN_IDLE)
-		{
-			if (elapsed > TIME_TO_POLL + MIN_IDLE + MARGIN) {
-				// Program the next GC poll at the last moment before the
-				// expected N64 poll.
-				poll_threshold = elapsed - TIME_TO_POLL - MARGIN;
-			} else {
-				poll_threshold = DEFAULT_THRESHOLD;
-			}
-		
-			if (poll_threshold < MIN_IDLE) {
-				poll_threshold = DEFAULT_THRESHOLD;
-			}
+		intervals[interval_pos] = elapsed;
+		interval_pos++;
+		if (interval_pos >= HISTORY_SIZE)
+			interval_pos = 0;
+		if (n_intervals < HISTORY_SIZE)
+			n_intervals++;
+
+		instr_record(INSTR_FRAME_INTERVAL, elapsed);
+		filterIntervals();
+
+		sync_stats.lead = sync_stats.poll_time + sync_stats.latch_jitter + TARGET_LEAD;
+
+		if (sync_stats.frame_period > sync_stats.lead + late + MIN_IDLE) {
+			// Program the next GC poll at the last moment before the
+			// expected NES latch.
+			poll_threshold = sync_stats.frame_period - sync_stats.lead - late;
+		} else {
+			poll_threshold = DEFAULT_THRESHOLD;
 		}
-#endif
 
+		if (poll_threshold < MIN_IDLE) {
+			poll_threshold = DEFAULT_THRESHOLD;
+		}
+#endif
 	}
 
 	/* Reset counter */
-	TCNT1 = 0;
-	TIFR |= (1<<TOV1); // clear overflow
+	time_base += timer_now();
+	timer_restart();
+	frame_late = late;
 	state = STATE_WAIT_THRES;
+	next_oversample = 0;
+
+	return 1;
 }
 
 char sync_may_poll(void)
 {
 	if (state == STATE_WAIT_THRES)
 	{
-		if (TCNT1 >= poll_threshold) {
+		if (timer_now() >= poll_threshold) {
 			state = STATE_THRESHOLD_REACHED;
 			return 1;
 		}
 	}
+	else if (sync_stats.frame_period && poll_threshold < 0xffff - sync_stats.frame_period)
+	{
+		/* The expected latch did not come (lag frame). Stay in phase
+		 * by polling again before the next one. */
+		if (timer_now() >= poll_threshold + sync_stats.frame_period) {
+			poll_threshold += sync_stats.frame_period;
+			return 1;
+		}
+	}
 
-		
 	return 0;
 }
 
+/* Whether an extra poll may start now. It must be over before the
+ * scheduled poll (sync_may_poll), which therefore is not delayed. */
+char sync_may_oversample(void)
+{
+	unsigned int now = timer_now();
+
+	if (state != STATE_WAIT_THRES)
+		return 0;
+
+	if (now < next_oversample)
+		return 0;
+
+	if (now + sync_stats.poll_time >= poll_threshold)
+		return 0;
+
+	next_oversample = now + OVERSAMPLE_INTERVAL;
+
+	/* When the next extra poll would not fit, the scheduled poll comes
+	 * more than an interval after this one. Allow one at the last
+	 * moment instead. */
+	if (next_oversample + sync_stats.poll_time >= poll_threshold) {
+		next_oversample = poll_threshold - sync_stats.poll_time - 1;
+	}
+
+	return 1;
+}
+
+void sync_poll_started(void)
+{
+	poll_start = timer_now();
+}
+
+/* Call after a successful poll started by sync_poll_started. excluded
+ * is the time spent in transactions disturbed by the NES meanwhile
+ * (see gcn64_stats.lost_time): it depends on when the NES latched, not
+ * on the controller, so it is not part of the poll duration. */
+void sync_poll_done(unsigned int excluded)
+{
+	unsigned int duration;
+
+	duration = timer_now() - poll_start - excluded;
+	sync_stats.last_poll_time = duration;
+
+	instr_record(INSTR_POLL_TIME, duration);
+	instr_sample(sync_time(timer_now()));
+
+	if (duration > window_max)
+		window_max = duration;
+
+	// Grow immediately, shrink only after a full window.
+	if (duration > sync_stats.poll_time)
+		sync_stats.poll_time = duration;
+
+	window_count++;
+	if (window_count >= POLL_WINDOW) {
+		sync_stats.poll_time = window_max;
+		window_max = 0;
+		window_count = 0;
+	}
+}
+
+/* Convert a Timer1 value to a time base which is not reset at each
+ * frame, for measurements spanning frames. Wraps every 65536 ticks. */
+unsigned int sync_time(unsigned int tcnt)
+{
+	return time_base + tcnt;
+}
 
@@ -1,9 +1,33 @@
 #ifndef _sync_h__
 #define _sync_h__
 
+/* All times in Timer1 ticks (F_CPU/64) */
+typedef struct {
+	unsigned int poll_time; // worst recent poll duration
+	unsigned int last_poll_time;
+	unsigned int frame_period; // filtered NES frame period
+	unsigned int latch_jitter; // spread of recent frame periods
+	unsigned int lead; // poll scheduled this long before the expected latch
+} SyncStats;
+
+extern SyncStats sync_stats;
+
+/* After this many latches without a gamecube read, the game is assumed
+ * to be latching continuously (eg: Paperboy pause screen). The
+ * scheduled poll, always preempted, is then completed by reading the
+ * buttons right after each latch (mainloop.c), until a scheduled poll
+ * succeeds. */
+#define CONTINUOUS_LATCHES	16
+
 void sync_init(void);
-void sync_master_polled_us(void);
+char sync_master_polled_us(unsigned int late);
 char sync_may_poll(void);
+char sync_may_oversample(void);
+
+void sync_poll_started(void);
+void sync_poll_done(unsigned int excluded);
+
+unsigned int sync_time(unsigned int tcnt);
 
 #endif // _sync_h__
 
@@ -0,0 +1,559 @@
+/*  GC to NES : Gamecube controller to NES adapter
+    Copyright (C) 2012-2016  Raphael Assenat <raph@raphnet.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Cycle counting AVR core for the host tools. See avrsim.h
+ *
+ * Instruction timings are those of the classic core (AVR instruction
+ * set manual, ATmega8/ATmega168 column). */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <elf.h>
+#include "avrsim.h"
+
+#ifndef EM_AVR
+#define EM_AVR		83
+#endif
+#define R_AVR_7_PCREL	2
+#define R_AVR_13_PCREL	3
+
+#define SREG_C	0x01
+#define SREG_Z	0x02
+#define SREG_N	0x04
+#define SREG_V	0x08
+#define SREG_S	0x10
+#define SREG_H	0x20
+
+/******** Object file loading **************/
+
+static unsigned char *readFile(const char *filename, long *size)
+{
+	FILE *fp;
+	unsigned char *buf;
+
+	fp = fopen(filename, "rb");
+	if (!fp) {
+		perror(filename);
+		return NULL;
+	}
+	fseek(fp, 0, SEEK_END);
+	*size = ftell(fp);
+	rewind(fp);
+	buf = malloc(*size);
+	if (!buf || fread(buf, 1, *size, fp) != *size) {
+		fprintf(stderr, "%s: read error\n", filename);
+		free(buf);
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+	return buf;
+}
+
+/* Patch the branch or jump at byte offset 'at' to reach byte address
+ * 'target' */
+static int relocate(struct avr *avr, unsigned int type, unsigned int at, long target)
+{
+	long k = (target - (long)(at + 2)) / 2;
+	unsigned short *op = &avr->flash[at / 2];
+
+	switch (type) {
+		case R_AVR_7_PCREL:
+			if (k < -64 || k > 63)
+				return -1;
+			*op = (*op & ~0x03f8) | ((k & 0x7f) << 3);
+			return 0;
+		case R_AVR_13_PCREL:
+			if (k < -2048 || k > 2047)
+				return -1;
+			*op = (*op & ~0x0fff) | (k & 0x0fff);
+			return 0;
+	}
+	return -1;
+}
+
+int avrLoad(struct avr *avr, const char *filename)
+{
+	unsigned char *buf;
+	long size;
+	Elf32_Ehdr *eh;
+	Elf32_Shdr *sh;
+	Elf32_Sym *syms = NULL;
+	const char *strtab = NULL;
+	int i, text = -1, n_syms = 0, ret = -1;
+
+	buf = readFile(filename, &size);
+	if (!buf)
+		return -1;
+
+	eh = (Elf32_Ehdr *)buf;
+	if (size < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+		eh->e_ident[EI_CLASS] != ELFCLASS32 || eh->e_machine != EM_AVR) {
+		fprintf(stderr, "%s: not an AVR object file\n", filename);
+		goto out;
+	}
+	sh = (Elf32_Shdr *)(buf + eh->e_shoff);
+
+	for (i = 0; i < eh->e_shnum; i++) {
+		const char *name = (char *)buf + sh[eh->e_shstrndx].sh_offset + sh[i].sh_name;
+
+		if (sh[i].sh_type == SHT_PROGBITS && !strcmp(name, ".text"))
+			text = i;
+		if (sh[i].sh_type == SHT_SYMTAB) {
+			syms = (Elf32_Sym *)(buf + sh[i].sh_offset);
+			n_syms = sh[i].sh_size / sizeof(Elf32_Sym);
+			strtab = (char *)buf + sh[sh[i].sh_link].sh_offset;
+		}
+	}
+	if (text < 0 || !syms || sh[text].sh_size > sizeof(avr->flash)) {
+		fprintf(stderr, "%s: no .text or symbols, or too large\n", filename);
+		goto out;
+	}
+
+	memset(avr->flash, 0, sizeof(avr->flash));
+	memcpy(avr->flash, buf + sh[text].sh_offset, sh[text].sh_size);
+	avr->n_words = sh[text].sh_size / 2;
+
+	avr->n_symbols = 0;
+	for (i = 0; i < n_syms; i++) {
+		struct avr_symbol *s = &avr->symbols[avr->n_symbols];
+
+		if (syms[i].st_shndx != text || ELF32_ST_TYPE(syms[i].st_info) == STT_SECTION)
+			continue;
+		if (avr->n_symbols == AVR_MAX_SYMBOLS) {
+			fprintf(stderr, "%s: too many symbols\n", filename);
+			goto out;
+		}
+		snprintf(s->name, sizeof(s->name), "%s", strtab + syms[i].st_name);
+		s->addr = syms[i].st_value / 2;
+		avr->n_symbols++;
+	}
+
+	for (i = 0; i < eh->e_shnum; i++) {
+		Elf32_Rela *rela = (Elf32_Rela *)(buf + sh[i].sh_offset);
+		int j, n = sh[i].sh_size / sizeof(Elf32_Rela);
+
+		if (sh[i].sh_type == SHT_REL) {
+			fprintf(stderr, "%s: REL relocations are not supported\n", filename);
+			goto out;
+		}
+		if (sh[i].sh_type != SHT_RELA || sh[i].sh_info != text)
+			continue;
+
+		for (j = 0; j < n; j++) {
+			Elf32_Sym *sym = &syms[ELF32_R_SYM(rela[j].r_info)];
+
+			if (sym->st_shndx != text ||
+				relocate(avr, ELF32_R_TYPE(rela[j].r_info), rela[j].r_offset,
+							(long)sym->st_value + rela[j].r_addend)) {
+				fprintf(stderr, "%s: unsupported relocation at 0x%x\n",
+							filename, rela[j].r_offset);
+				goto out;
+			}
+		}
+	}
+	ret = 0;
+
+out:
+	free(buf);
+	return ret;
+}
+
+int avrSymbol(struct avr *avr, const char *name)
+{
+	int i;
+
+	for (i = 0; i < avr->n_symbols; i++) {
+		if (!strcmp(avr->symbols[i].name, name))
+			return avr->symbols[i].addr;
+	}
+	return -1;
+}
+
+void avrReset(struct avr *avr)
+{
+	memset(avr->data, 0, 0x20);
+	avr->sreg = 0;
+	avr->sp = AVR_RAMEND;
+	avr->faults = 0;
+}
+
+/******** Data space **************/
+
+static unsigned char ioRead(struct avr *avr, unsigned char addr)
+{
+	if (avr->io_read)
+		return avr->io_read(avr, addr);
+	return avr->data[AVR_IO(addr)];
+}
+
+static void ioWrite(struct avr *avr, unsigned char addr, unsigned char value)
+{
+	avr->data[AVR_IO(addr)] = value;
+	if (avr->io_write)
+		avr->io_write(avr, addr, value);
+}
+
+static unsigned char load(struct avr *avr, unsigned int addr)
+{
+	addr &= 0xffff;
+	if (addr >= 0x20 && addr < 0x60)
+		return ioRead(avr, addr - 0x20);
+	if (addr > AVR_RAMEND) {
+		fprintf(stderr, "avrsim: read outside the SRAM (0x%04x)\n", addr);
+		avr->faults++;
+		return 0;
+	}
+	return avr->data[addr];
+}
+
+static void store(struct avr *avr, unsigned int addr, unsigned char value)
+{
+	addr &= 0xffff;
+	if (addr >= 0x20 && addr < 0x60) {
+		ioWrite(avr, addr - 0x20, value);
+		return;
+	}
+	if (addr > AVR_RAMEND) {
+		fprintf(stderr, "avrsim: write outside the SRAM (0x%04x)\n", addr);
+		avr->faults++;
+		return;
+	}
+	avr->data[addr] = value;
+}
+
+static void push(struct avr *avr, unsigned char value)
+{
+	store(avr, avr->sp, value);
+	avr->sp--;
+}
+
+static unsigned char pop(struct avr *avr)
+{
+	avr->sp++;
+	return load(avr, avr->sp);
+}
+
+/******** Flags **************/
+
+static void setFlag(struct avr *avr, unsigned char flag, int set)
+{
+	if (set)
+		avr->sreg |= flag;
+	else
+		avr->sreg &= ~flag;
+}
+
+/* N, Z and S from a result, V given */
+static void setNZS(struct avr *avr, unsigned char res, int v)
+{
+	setFlag(avr, SREG_V, v);
+	setFlag(avr, SREG_N, res & 0x80);
+	setFlag(avr, SREG_Z, res == 0);
+	setFlag(avr, SREG_S, !!(res & 0x80) != !!v);
+}
+
+static unsigned char add(struct avr *avr, unsigned char d, unsigned char r, int carry)
+{
+	unsigned char res = d + r + carry;
+
+	setFlag(avr, SREG_C, (d + r + carry) > 0xff);
+	setFlag(avr, SREG_H, ((d & 0xf) + (r & 0xf) + carry) > 0xf);
+	setNZS(avr, res, (~(d ^ r) & (d ^ res)) & 0x80);
+	return res;
+}
+
+/* keep_z: cpc/sbc/sbci only clear Z, they never set it */
+static unsigned char sub(struct avr *avr, unsigned char d, unsigned char r, int carry, int keep_z)
+{
+	unsigned char res = d - r - carry;
+	int z = avr->sreg & SREG_Z;
+
+	setFlag(avr, SREG_C, (r + carry) > d);
+	setFlag(avr, SREG_H, ((r & 0xf) + carry) > (d & 0xf));
+	setNZS(avr, res, ((d ^ r) & (d ^ res)) & 0x80);
+	if (keep_z)
+		setFlag(avr, SREG_Z, res == 0 && z);
+	return res;
+}
+
+static unsigned char logic(struct avr *avr, unsigned char res)
+{
+	setNZS(avr, res, 0);
+	return res;
+}
+
+/* Flags of the right shifts, the carry being the bit shifted out */
+static unsigned char shiftRight(struct avr *avr, unsigned char d, unsigned char res)
+{
+	setFlag(avr, SREG_C, d & 1);
+	setNZS(avr, res, !!(res & 0x80) != (d & 1));
+	return res;
+}
+
+/******** Execution **************/
+
+/* Whether the instruction at this word address takes two words (skips
+ * jump over both) */
+static int twoWords(struct avr *avr, unsigned int pc)
+{
+	unsigned short op = avr->flash[pc % AVR_FLASH_WORDS];
+
+	return (op & 0xfc0f) == 0x9000 || // lds, sts
+			(op & 0xfe0c) == 0x940c; // jmp, call
+}
+
+/* Skip the next instruction when cond is true. Returns the extra cycles */
+static int skip(struct avr *avr, int cond)
+{
+	if (!cond)
+		return 0;
+	if (twoWords(avr, avr->pc)) {
+		avr->pc += 2;
+		return 2;
+	}
+	avr->pc++;
+	return 1;
+}
+
+static unsigned int pointer(struct avr *avr, int reg)
+{
+	return avr->data[reg] | (avr->data[reg + 1] << 8);
+}
+
+static void setPointer(struct avr *avr, int reg, unsigned int value)
+{
+	avr->data[reg] = value;
+	avr->data[reg + 1] = value >> 8;
+}
+
+/* ld/st through X (26), Y (28) or Z (30). mode: 0 unchanged,
+ * 1 post-increment, 2 pre-decrement */
+static void loadStore(struct avr *avr, int st, int d, int reg, int mode, int q)
+{
+	unsigned int addr = pointer(avr, reg);
+
+	if (mode == 2)
+		addr--;
+	if (st)
+		store(avr, addr + q, avr->data[d]);
+	else
+		avr->data[d] = load(avr, addr + q);
+	if (mode == 1)
+		addr++;
+	if (mode)
+		setPointer(avr, reg, addr);
+}
+
+/* Execute one instruction. Returns its cycles, 0 on sleep, -1 if not
+ * supported. */
+static int step(struct avr *avr)
+{
+	unsigned short op = avr->flash[avr->pc % AVR_FLASH_WORDS];
+	int d = (op >> 4) & 0x1f;
+	int r = (op & 0x0f) | ((op >> 5) & 0x10);
+	int k8 = (op & 0x0f) | ((op >> 4) & 0xf0);
+	int dh = 16 + ((op >> 4) & 0x0f); // upper register of immediates
+	int io = (op & 0x0f) | ((op >> 5) & 0x30);
+	int a5 = (op >> 3) & 0x1f, b = op & 7;
+	unsigned char *R = avr->data;
+	unsigned int w;
+	int k;
+
+	avr->pc++;
+
+	if (op == 0x0000) // nop
+		return 1;
+	if (op == 0x9588) // sleep
+		return 0;
+	if (op == 0x9508) { // ret
+		w = pop(avr) << 8;
+		w |= pop(avr);
+		avr->pc = w;
+		return 4;
+	}
+
+	switch (op & 0xfc00) {
+		case 0x0400: sub(avr, R[d], R[r], avr->sreg & SREG_C, 1); return 1; // cpc
+		case 0x0800: R[d] = sub(avr, R[d], R[r], avr->sreg & SREG_C, 1); return 1; // sbc
+		case 0x0c00: R[d] = add(avr, R[d], R[r], 0); return 1; // add, lsl
+		case 0x1000: return 1 + skip(avr, R[d] == R[r]); // cpse
+		case 0x1400: sub(avr, R[d], R[r], 0, 0); return 1; // cp
+		case 0x1800: R[d] = sub(avr, R[d], R[r], 0, 0); return 1; // sub
+		case 0x1c00: R[d] = add(avr, R[d], R[r], avr->sreg & SREG_C); return 1; // adc, rol
+		case 0x2000: R[d] = logic(avr, R[d] & R[r]); return 1; // and, tst
+		case 0x2400: R[d] = logic(avr, R[d] ^ R[r]); return 1; // eor, clr
+		case 0x2800: R[d] = logic(avr, R[d] | R[r]); return 1; // or
+		case 0x2c00: R[d] = R[r]; return 1; // mov
+	}
+
+	switch (op & 0xf000) {
+		case 0x3000: sub(avr, R[dh], k8, 0, 0); return 1; // cpi
+		case 0x4000: R[dh] = sub(avr, R[dh], k8, avr->sreg & SREG_C, 1); return 1; // sbci
+		case 0x5000: R[dh] = sub(avr, R[dh], k8, 0, 0); return 1; // subi
+		case 0x6000: R[dh] = logic(avr, R[dh] | k8); return 1; // ori
+		case 0x7000: R[dh] = logic(avr, R[dh] & k8); return 1; // andi
+		case 0xe000: R[dh] = k8; return 1; // ldi
+		case 0xc000: // rjmp
+			k = op & 0x0fff;
+			avr->pc += k & 0x800 ? k - 0x1000 : k;
+			return 2;
+		case 0xd000: // rcall
+			k = op & 0x0fff;
+			push(avr, avr->pc);
+			push(avr, avr->pc >> 8);
+			avr->pc += k & 0x800 ? k - 0x1000 : k;
+			return 3;
+	}
+
+	switch (op & 0xf800) {
+		case 0xb000: R[d] = ioRead(avr, io); return 1; // in
+		case 0xb800: // out
+			avr->cycles++;
+			ioWrite(avr, io, R[d]);
+			avr->cycles--;
+			return 1;
+		case 0xf800: // bld, bst, sbrc, sbrs
+			if ((op & 0xfe08) == 0xfc00) // sbrc
+				return 1 + skip(avr, !(R[d] & (1 << b)));
+			if ((op & 0xfe08) == 0xfe00) // sbrs
+				return 1 + skip(avr, R[d] & (1 << b));
+			return -1;
+		case 0xf000: // brbs, brbc
+			k = (op >> 3) & 0x7f;
+			if (!!(avr->sreg & (1 << b)) == !(op & 0x0400)) {
+				avr->pc += k & 0x40 ? k - 0x80 : k;
+				return 2;
+			}
+			return 1;
+	}
+
+	// ldd/std with displacement (ld/st Y and Z without one included)
+	if ((op & 0xd000) == 0x8000) {
+		int q = (op & 7) | ((op >> 7) & 0x18) | ((op >> 8) & 0x20);
+
+		loadStore(avr, op & 0x0200, d, op & 0x08 ? 28 : 30, 0, q);
+		return 2;
+	}
+
+	switch (op & 0xfe0f) {
+		case 0x9001: loadStore(avr, 0, d, 30, 1, 0); return 2; // ld Z+
+		case 0x9002: loadStore(avr, 0, d, 30, 2, 0); return 2; // ld -Z
+		case 0x9009: loadStore(avr, 0, d, 28, 1, 0); return 2; // ld Y+
+		case 0x900a: loadStore(avr, 0, d, 28, 2, 0); return 2; // ld -Y
+		case 0x900c: loadStore(avr, 0, d, 26, 0, 0); return 2; // ld X
+		case 0x900d: loadStore(avr, 0, d, 26, 1, 0); return 2; // ld X+
+		case 0x900e: loadStore(avr, 0, d, 26, 2, 0); return 2; // ld -X
+		case 0x9201: loadStore(avr, 1, d, 30, 1, 0); return 2; // st Z+
+		case 0x9202: loadStore(avr, 1, d, 30, 2, 0); return 2; // st -Z
+		case 0x9209: loadStore(avr, 1, d, 28, 1, 0); return 2; // st Y+
+		case 0x920a: loadStore(avr, 1, d, 28, 2, 0); return 2; // st -Y
+		case 0x920c: loadStore(avr, 1, d, 26, 0, 0); return 2; // st X
+		case 0x920d: loadStore(avr, 1, d, 26, 1, 0); return 2; // st X+
+		case 0x920e: loadStore(avr, 1, d, 26, 2, 0); return 2; // st -X
+		case 0x900f: R[d] = pop(avr); return 2; // pop
+		case 0x920f: push(avr, R[d]); return 2; // push
+		case 0x9400: // com
+			R[d] = logic(avr, ~R[d]);
+			setFlag(avr, SREG_C, 1);
+			return 1;
+		case 0x9401: // neg
+			R[d] = sub(avr, 0, R[d], 0, 0);
+			return 1;
+		case 0x9402: R[d] = (R[d] << 4) | (R[d] >> 4); return 1; // swap
+		case 0x9403: // inc
+			R[d]++;
+			setNZS(avr, R[d], R[d] == 0x80);
+			return 1;
+		case 0x9405: R[d] = shiftRight(avr, R[d], (R[d] >> 1) | (R[d] & 0x80)); return 1; // asr
+		case 0x9406: R[d] = shiftRight(avr, R[d], R[d] >> 1); return 1; // lsr
+		case 0x9407: // ror
+			R[d] = shiftRight(avr, R[d], (R[d] >> 1) | (avr->sreg & SREG_C ? 0x80 : 0));
+			return 1;
+		case 0x940a: // dec
+			R[d]--;
+			setNZS(avr, R[d], R[d] == 0x7f);
+			return 1;
+	}
+
+	switch (op & 0xff00) {
+		case 0x9600: // adiw
+		case 0x9700: // sbiw
+			d = 24 + ((op >> 3) & 6);
+			k = (op & 0x0f) | ((op >> 2) & 0x30);
+			w = pointer(avr, d);
+			if (op & 0x0100) {
+				setFlag(avr, SREG_C, k > w);
+				w = (w - k) & 0xffff;
+				setFlag(avr, SREG_V, (pointer(avr, d) & ~w) & 0x8000);
+			} else {
+				setFlag(avr, SREG_C, w + k > 0xffff);
+				w = (w + k) & 0xffff;
+				setFlag(avr, SREG_V, (~pointer(avr, d) & w) & 0x8000);
+			}
+			setFlag(avr, SREG_N, w & 0x8000);
+			setFlag(avr, SREG_Z, w == 0);
+			setFlag(avr, SREG_S, !!(avr->sreg & SREG_N) != !!(avr->sreg & SREG_V));
+			setPointer(avr, d, w);
+			return 2;
+		case 0x9800: // cbi
+		case 0x9a00: // sbi
+			w = avr->data[AVR_IO(a5)];
+			w = op & 0x0200 ? w | (1 << b) : w & ~(1 << b);
+			avr->cycles += 2;
+			ioWrite(avr, a5, w);
+			avr->cycles -= 2;
+			return 2;
+		case 0x9900: // sbic
+			return 1 + skip(avr, !(ioRead(avr, a5) & (1 << b)));
+		case 0x9b00: // sbis
+			return 1 + skip(avr, ioRead(avr, a5) & (1 << b));
+	}
+
+	if ((op & 0xff0f) == 0x9408) { // bset, bclr (sec, clc, sei...)
+		setFlag(avr, 1 << ((op >> 4) & 7), !(op & 0x80));
+		return 1;
+	}
+
+	return -1;
+}
+
+int avrRun(struct avr *avr, unsigned int addr, unsigned long long max_cycles)
+{
+	unsigned long long end = avr->cycles + max_cycles;
+	int c;
+
+	avr->pc = addr;
+	while (avr->cycles < end) {
+		unsigned int pc = avr->pc;
+
+		c = step(avr);
+		if (c == 0)
+			return 0;
+		if (c < 0) {
+			fprintf(stderr, "avrsim: unsupported instruction 0x%04x at 0x%04x\n",
+						avr->flash[pc % AVR_FLASH_WORDS], pc * 2);
+			return -1;
+		}
+		avr->cycles += c;
+		if (avr->faults)
+			return -1;
+	}
+	fprintf(stderr, "avrsim: no sleep after %llu cycles (pc 0x%04x)\n",
+				max_cycles, avr->pc * 2);
+	return -1;
+}
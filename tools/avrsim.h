@@ -0,0 +1,67 @@
+#ifndef _avrsim_h__
+#define _avrsim_h__
+
+/* A cycle counting AVR core (classic core timings, like the ATmega8 and
+ * ATmega168) running code assembled by llvm-mc. Only what the Joybus
+ * loops and similar hand written assembly use is implemented: ALU and
+ * immediate instructions, ld/st through X, Y and Z, push/pop,
+ * in/out/sbi/cbi/sbic/sbis, relative jumps, calls and branches. The
+ * run stops at a sleep instruction.
+ *
+ * The data space is laid out like on the chip: registers at 0, I/O
+ * registers at 0x20 and the SRAM from 0x60 up to AVR_RAMEND, where the
+ * stack starts. Reads and writes of I/O registers go through the
+ * io_read and io_write hooks when set, so a test can model the pins.
+ * io_read is called in the cycle the instruction starts, io_write once
+ * the instruction is over (the cycle the new value takes effect).
+ */
+
+#define AVR_FLASH_WORDS		4096
+#define AVR_RAMEND			0x45f
+#define AVR_MAX_SYMBOLS		64
+
+#define AVR_IO(addr)		((addr) + 0x20) /* data space address */
+
+struct avr_symbol {
+	char name[32];
+	unsigned int addr; // in words
+};
+
+struct avr {
+	unsigned short flash[AVR_FLASH_WORDS];
+	unsigned int n_words;
+	struct avr_symbol symbols[AVR_MAX_SYMBOLS];
+	int n_symbols;
+
+	unsigned char data[AVR_RAMEND + 1];
+	unsigned int pc; // in words
+	unsigned int sp;
+	unsigned char sreg;
+	unsigned long long cycles;
+	int faults; // accesses outside the SRAM, stop the run
+
+	/* I/O hooks. addr is the I/O address (0 to 0x3f). io_read returns
+	 * the value read. */
+	unsigned char (*io_read)(struct avr *avr, unsigned char addr);
+	void (*io_write)(struct avr *avr, unsigned char addr, unsigned char value);
+	void *user;
+};
+
+/* Load the .text section of an object file assembled by llvm-mc
+ * (-triple=avr -filetype=obj) and resolve its relative jumps and
+ * branches. Returns 0 on success, otherwise prints why and returns -1. */
+int avrLoad(struct avr *avr, const char *filename);
+
+/* Word address of a symbol of the loaded code, -1 if absent */
+int avrSymbol(struct avr *avr, const char *name);
+
+/* Reset the registers, SREG and SP (the cycle counter and memory are
+ * kept) */
+void avrReset(struct avr *avr);
+
+/* Run from a word address until a sleep instruction. Returns 0 on
+ * sleep, -1 on an unsupported instruction, a memory fault or after
+ * max_cycles. */
+int avrRun(struct avr *avr, unsigned int addr, unsigned long long max_cycles);
+
+#endif // _avrsim_h__
@@ -0,0 +1,104 @@
+/*  GC to NES : Gamecube controller to NES adapter
+    Copyright (C) 2012-2016  Raphael Assenat <raph@raphnet.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Joystick gate decisions in floating point, for tools/padtest (checks
+ * of the gate tables the firmware builds), and the profile joystick
+ * parameters for tools/genmap and tools/mkprofile. See gate.h */
+#include <math.h>
+#include "../profile.h"
+#include "gate.h"
+
+/* Directions pressed for a stick offset from the origin (first quadrant).
+ * The diagonal zone presses both directions. */
+int gateDecide(double ax, double ay, double walk, double run, double half_diagonal)
+{
+	double r = sqrt(ax * ax + ay * ay);
+	double angle = atan2(ay, ax) * 180.0 / M_PI; // 0: horizontal
+	int dirs = 0;
+
+	if (r > walk) {
+		if (angle <= 45.0 + half_diagonal)
+			dirs |= GATE_HORIZ;
+		if (angle >= 45.0 - half_diagonal)
+			dirs |= GATE_VERT;
+	}
+	if (run && r > run)
+		dirs |= GATE_RUN;
+
+	return dirs;
+}
+
+/* Angle of the hysteresis along the walk circle, in degrees */
+static double holdAngle(double walk, double hysteresis)
+{
+	return hysteresis / walk * 180.0 / M_PI;
+}
+
+/* Slope (see profile.h) of a diagonal zone edge at an angle from the
+ * axis, in 1.15 fixed point (1.0 at 45 degrees) */
+static long slope(double angle)
+{
+	return angle > 0 ? lround(tan(angle * M_PI / 180.0) * 32768) : 0;
+}
+
+/* Half the diagonal angle of the zone edge at this angle from the
+ * axis, once the slope is rounded as stored in a profile */
+static double halfDiagonal(double angle)
+{
+	return 45.0 - atan(slope(angle) / 32768.0) * 180.0 / M_PI;
+}
+
+/* Gate table entry. The low bits are the directions to press, the high
+ * bits (GATE_HOLD_SHIFT) those which stay pressed if they already were:
+ * the thresholds are lowered by the hysteresis and the diagonal zone
+ * widened by the same distance, measured along the walk circle. */
+int gateCell(double ax, double ay, double walk, double run, double diagonal,
+					double hysteresis)
+{
+	double hold_walk = walk > hysteresis ? walk - hysteresis : 0;
+	double hold_run = run > hysteresis ? run - hysteresis : 1;
+	double edge = 45.0 - diagonal / 2;
+
+	return gateDecide(ax, ay, walk, run, halfDiagonal(edge)) |
+			gateDecide(ax, ay, hold_walk, run ? hold_run : 0,
+						halfDiagonal(edge - holdAngle(walk, hysteresis))) << GATE_HOLD_SHIFT;
+}
+
+int gateCheck(int walk, int run, int diagonal, int hysteresis)
+{
+	return walk < 1 || walk > 127 || run < 0 || run > 127 || diagonal < 0 ||
+			diagonal > 90 || hysteresis < 0 || hysteresis > walk;
+}
+
+static void storeSlope(unsigned char *dst, double angle)
+{
+	long s = slope(angle);
+
+	dst[0] = s & 0xff;
+	dst[1] = s >> 8;
+}
+
+void gateStick(struct profile_stick *stick, int walk, int run, int diagonal,
+				int hysteresis)
+{
+	stick->walk = walk;
+	stick->run = run;
+	stick->diagonal = diagonal;
+	stick->hysteresis = hysteresis;
+	storeSlope(stick->slope[0], 45.0 - diagonal / 2.0);
+	storeSlope(stick->slope[1], 45.0 - diagonal / 2.0 - holdAngle(walk, hysteresis));
+}
@@ -0,0 +1,26 @@
+#ifndef _gate_h__
+#define _gate_h__
+
+/* Directions (GATE_* bits of profile.h) pressed for a stick offset from
+ * the origin, in the first quadrant (ax, ay >= 0), by the joystick
+ * parameters of a MAPPING (see mappings.def). half_diagonal is half the
+ * diagonal angle. */
+int gateDecide(double ax, double ay, double walk, double run, double half_diagonal);
+
+/* Gate table entry at a stick offset: directions to press, and those
+ * which stay pressed (<< GATE_HOLD_SHIFT), with the diagonal zone edges
+ * of the slopes stored in a profile (gateStick) */
+int gateCell(double ax, double ay, double walk, double run, double diagonal,
+				double hysteresis);
+
+/* Check joystick parameters (the ranges of mappings.def). Returns 0 if
+ * valid. */
+int gateCheck(int walk, int run, int diagonal, int hysteresis);
+
+/* Joystick parameters of a profile, with the slopes the firmware builds
+ * its gate table from (see profile.h) */
+struct profile_stick;
+void gateStick(struct profile_stick *stick, int walk, int run, int diagonal,
+				int hysteresis);
+
+#endif // _gate_h__
@@ -0,0 +1,168 @@
+/*  GC to NES : Gamecube controller to NES adapter
+    Copyright (C) 2012-2016  Raphael Assenat <raph@raphnet.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Generate maptables.h from mappings.def
+ *
+ * Each MAPPING becomes a built-in profile (see profile.h): the NES
+ * bits pressed by each gamecube button, the turbo periods and the
+ * joystick parameters, with the slopes of the diagonal zone edges
+ * computed here so the firmware builds its gate table with integers.
+ *
+ * The profiles are output for both the NES and the SNES, the build
+ * picks one with SNES_OUTPUT.
+ */
+#include <stdio.h>
+#include "../gamecube.h"
+#include "../nes.h"
+#include "../profile.h"
+#include "gate.h"
+
+/* NES (or SNES) bits pressed by a gamecube button (see profile.h) */
+static unsigned int buttonBits(int button, int snes)
+{
+	unsigned char report[GCN64_REPORT_SIZE] = { };
+	unsigned int bits = 0;
+
+	report[6 + button / 8] = 1 << (button % 8);
+
+#define BUTTON(gc_get, nes_bit)	if (!snes && gc_get(report)) bits |= 1 << (nes_bit);
+#define SNES_BUTTON(gc_get, snes_bit)	if (snes && gc_get(report)) bits |= 1 << (snes_bit);
+#define MAPPING(name, walk, run, diagonal, hysteresis)
+#define TURBO(nes_bit, period)
+#define SNES_TURBO(snes_bit, period)
+#include "../mappings.def"
+#undef BUTTON
+#undef SNES_BUTTON
+#undef MAPPING
+#undef TURBO
+#undef SNES_TURBO
+
+	return bits;
+}
+
+static int checkTurbo(const int *turbo_period, int bits, const char *what)
+{
+	int i;
+
+	for (i=0; i<bits; i++) {
+		if (turbo_period[i] && (turbo_period[i] < 2 || turbo_period[i] > 255)) {
+			fprintf(stderr, "Invalid turbo period %d for %s bit %d\n", turbo_period[i], what, i);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int printProfile(const char *name, int walk, int run, int diagonal, int hysteresis,
+							const int *turbo_period, int snes)
+{
+	struct profile_stick stick;
+	unsigned int bits;
+	int i;
+
+	if (gateCheck(walk, run, diagonal, hysteresis)) {
+		fprintf(stderr, "Invalid joystick parameters for mapping %s\n", name);
+		return 1;
+	}
+	gateStick(&stick, walk, run, diagonal, hysteresis);
+
+	printf("\t{ // %s\n", name);
+	printf("\t\t{ %d, %d, %d, %d, { { 0x%02x, 0x%02x }, { 0x%02x, 0x%02x } } },\n",
+			stick.walk, stick.run, stick.diagonal, stick.hysteresis,
+			stick.slope[0][0], stick.slope[0][1], stick.slope[1][0], stick.slope[1][1]);
+	printf("\t\t{");
+	for (i=0; i<PROFILE_GC_BUTTONS; i++) {
+		bits = buttonBits(i, snes);
+		printf(" { 0x%02x, 0x%02x },", bits & 0xff, bits >> 8);
+	}
+	printf(" },\n");
+	printf("\t\t{");
+	for (i=0; i<PROFILE_BITS; i++)
+		printf(" %d,", turbo_period[i]);
+	printf(" },\n");
+	printf("\t},\n");
+
+	return 0;
+}
+
+static int printProfiles(const int *turbo_period, int snes)
+{
+	printf("static const struct profile builtin_profiles[NUM_MAPPINGS] PROGMEM = {\n");
+#define BUTTON(gc_get, nes_bit)
+#define SNES_BUTTON(gc_get, snes_bit)
+#define TURBO(nes_bit, period)
+#define SNES_TURBO(snes_bit, period)
+#define MAPPING(name, walk, run, diagonal, hysteresis) \
+	if (printProfile(#name, walk, run, diagonal, hysteresis, turbo_period, snes)) return 1;
+#include "../mappings.def"
+#undef BUTTON
+#undef SNES_BUTTON
+#undef TURBO
+#undef SNES_TURBO
+#undef MAPPING
+	printf("};\n\n");
+
+	return 0;
+}
+
+int main(void)
+{
+	int n = 0;
+	int turbo_period[PROFILE_BITS] = { };
+	int snes_turbo_period[PROFILE_BITS] = { };
+
+	printf("/* Generated by tools/genmap from mappings.def. Do not edit. */\n");
+	printf("#ifndef _maptables_h__\n");
+	printf("#define _maptables_h__\n\n");
+
+#define BUTTON(gc_get, nes_bit)
+#define SNES_BUTTON(gc_get, snes_bit)
+#define TURBO(nes_bit, period)
+#define SNES_TURBO(snes_bit, period)
+#define MAPPING(name, walk, run, diagonal, hysteresis) printf("#define MAPPING_%s\t%d\n", #name, n++);
+#include "../mappings.def"
+#undef MAPPING
+	printf("#define NUM_MAPPINGS\t%d\n\n", n);
+#undef TURBO
+#undef SNES_TURBO
+
+#define MAPPING(name, walk, run, diagonal, hysteresis)
+#define TURBO(nes_bit, period)	turbo_period[nes_bit] = (period);
+#define SNES_TURBO(snes_bit, period)	snes_turbo_period[snes_bit] = (period);
+#include "../mappings.def"
+#undef MAPPING
+#undef TURBO
+#undef SNES_TURBO
+#undef BUTTON
+#undef SNES_BUTTON
+
+	if (checkTurbo(turbo_period, 8, "NES") || checkTurbo(snes_turbo_period, 16, "SNES"))
+		return 1;
+
+	printf("#ifdef SNES_OUTPUT\n\n");
+	if (printProfiles(snes_turbo_period, 1))
+		return 1;
+	printf("#else\n\n");
+	if (printProfiles(turbo_period, 0))
+		return 1;
+	printf("#endif\n\n");
+
+	printf("#endif // _maptables_h__\n");
+
+	return 0;
+}
@@ -0,0 +1,346 @@
+/*  GC to NES : Gamecube controller to NES adapter
+    Copyright (C) 2012-2016  Raphael Assenat <raph@raphnet.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Decode the instrumentation dump (see instrument.h) from a capture of
+ * the debug pin. Accepted inputs:
+ *
+ *  - VCD (logic analyzer or simulator). The signal is selected by name
+ *    with -s, otherwise the first 1-bit signal is used.
+ *  - CSV with one "time_in_seconds,level" transition per line, as
+ *    exported by most logic analyzer software.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../instrument.h"
+
+static const char *hist_names[INSTR_NUM_HISTOGRAMS] = {
+	[INSTR_SAMPLE_AGE] = "sample_age",
+	[INSTR_FRAME_INTERVAL] = "frame_interval",
+	[INSTR_INT0_TIME] = "int0_time",
+	[INSTR_POLL_TIME] = "poll_time",
+};
+
+static const char *counter_names[INSTR_NUM_COUNTERS] = {
+	[INSTR_MISSED] = "missed_samples",
+	[INSTR_REUSED] = "reused_samples",
+	[INSTR_POLL_FAILED] = "failed_polls",
+	[INSTR_JOYBUS_PREEMPTED] = "joybus_preempted",
+	[INSTR_JOYBUS_RETRIED] = "joybus_retried",
+	[INSTR_JOYBUS_DROPPED] = "joybus_dropped",
+};
+
+/* Level transitions */
+static double *t_time;
+static char *t_level;
+static int n_trans, cap_trans;
+
+static void addTransition(double time, int level)
+{
+	if (n_trans && t_level[n_trans-1] == level)
+		return;
+
+	if (n_trans == cap_trans) {
+		cap_trans = cap_trans ? cap_trans * 2 : 1024;
+		t_time = realloc(t_time, cap_trans * sizeof(double));
+		t_level = realloc(t_level, cap_trans);
+		if (!t_time || !t_level) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	t_time[n_trans] = time;
+	t_level[n_trans] = level;
+	n_trans++;
+}
+
+/* Level at a given time. Idle (high) before the first transition. */
+static int levelAt(double time)
+{
+	int lo = 0, hi = n_trans - 1, mid;
+
+	if (!n_trans || time < t_time[0])
+		return 1;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (t_time[mid] <= time)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return t_level[lo];
+}
+
+static double timescaleToSeconds(const char *s)
+{
+	double v = atof(s);
+
+	if (v == 0)
+		v = 1;
+	while (*s && (*s == ' ' || *s == '\t' || (*s >= '0' && *s <= '9')))
+		s++;
+
+	if (!strncmp(s, "fs", 2)) return v * 1e-15;
+	if (!strncmp(s, "ps", 2)) return v * 1e-12;
+	if (!strncmp(s, "ns", 2)) return v * 1e-9;
+	if (!strncmp(s, "us", 2)) return v * 1e-6;
+	if (!strncmp(s, "ms", 2)) return v * 1e-3;
+	return v;
+}
+
+static int loadVCD(FILE *fptr, const char *signal)
+{
+	char line[512], id[64] = "", name[128], ref[64];
+	char timescale[64] = "1ns";
+	double scale, now = 0;
+	int in_timescale = 0, size;
+	char *p;
+
+	while (fgets(line, sizeof(line), fptr)) {
+		p = line;
+		while (*p == ' ' || *p == '\t')
+			p++;
+
+		if (in_timescale) {
+			if (strncmp(p, "$end", 4))
+				snprintf(timescale, sizeof(timescale), "%.63s", p);
+			in_timescale = 0;
+			continue;
+		}
+
+		if (!strncmp(p, "$timescale", 10)) {
+			p += 10;
+			while (*p == ' ' || *p == '\t')
+				p++;
+			if (*p == '\n' || *p == 0)
+				in_timescale = 1;
+			else
+				snprintf(timescale, sizeof(timescale), "%.63s", p);
+			continue;
+		}
+
+		if (!strncmp(p, "$var", 4)) {
+			if (sscanf(p, "$var %*s %d %63s %127s", &size, ref, name) == 3 && size == 1) {
+				if (!id[0] && (!signal || !strcmp(signal, name)))
+					strcpy(id, ref);
+			}
+			continue;
+		}
+
+		if (!id[0] || *p == '$')
+			continue;
+
+		scale = timescaleToSeconds(timescale);
+
+		if (*p == '#') {
+			now = atof(p + 1) * scale;
+		} else if (*p == '0' || *p == '1') {
+			p[strcspn(p, "\r\n")] = 0;
+			if (!strcmp(p + 1, id))
+				addTransition(now, *p == '1');
+		} else if (*p == 'b') {
+			if (sscanf(p, "b%63s %63s", name, ref) == 2 && !strcmp(ref, id))
+				addTransition(now, name[strlen(name)-1] == '1');
+		}
+	}
+
+	if (!id[0]) {
+		fprintf(stderr, "Signal not found\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int loadCSV(FILE *fptr)
+{
+	char line[256];
+	double time;
+	int level;
+
+	while (fgets(line, sizeof(line), fptr)) {
+		if (sscanf(line, "%lf,%d", &time, &level) == 2)
+			addTransition(time, level != 0);
+	}
+
+	return 0;
+}
+
+/* UART 8N1 decoding, sampling in the middle of each bit. */
+static int decodeBytes(double baud, unsigned char **out)
+{
+	unsigned char *bytes = malloc(n_trans / 2 + 1);
+	int n = 0, i, b;
+	double bit = 1.0 / baud, start, after = -1;
+	unsigned char c;
+
+	if (!bytes)
+		return -1;
+
+	for (i=1; i<n_trans; i++) {
+		// falling edge while idle is a start bit
+		if (t_level[i] != 0 || t_time[i] < after)
+			continue;
+
+		start = t_time[i];
+		if (levelAt(start + bit * 0.5) != 0)
+			continue;
+
+		for (c=0, b=0; b<8; b++) {
+			if (levelAt(start + bit * (1.5 + b)))
+				c |= 1 << b;
+		}
+
+		if (!levelAt(start + bit * 9.5)) {
+			fprintf(stderr, "Framing error at %f s\n", start);
+		} else {
+			bytes[n++] = c;
+		}
+		after = start + bit * 9.5;
+	}
+
+	*out = bytes;
+	return n;
+}
+
+static int parseDump(const unsigned char *buf, int len)
+{
+	int i, j, pos, size;
+	int n_hist, n_bins, n_counters, khz, prescaler, shift;
+	unsigned char sum = 0;
+	double tick_us, lo, hi;
+
+	for (i=0; i<len-1; i++) {
+		if (buf[i] == INSTR_SYNC1 && buf[i+1] == INSTR_SYNC2)
+			break;
+	}
+	if (i >= len - 1) {
+		fprintf(stderr, "No dump found\n");
+		return -1;
+	}
+	buf += i + 2;
+	len -= i + 2;
+
+	if (len < 7 || buf[0] != INSTR_VERSION) {
+		fprintf(stderr, "Unsupported or truncated dump\n");
+		return -1;
+	}
+
+	khz = buf[1] | buf[2] << 8;
+	prescaler = buf[3];
+	n_hist = buf[4];
+	n_bins = buf[5];
+	n_counters = buf[6];
+
+	size = 7 + n_hist * (1 + n_bins * 2) + n_counters * 2;
+	if (len < size + 1) {
+		fprintf(stderr, "Truncated dump (%d of %d bytes)\n", len, size + 1);
+		return -1;
+	}
+	for (i=0; i<size; i++)
+		sum += buf[i];
+	if (sum != buf[size]) {
+		fprintf(stderr, "Checksum error\n");
+		return -1;
+	}
+
+	tick_us = prescaler * 1000.0 / khz;
+	printf("# F_CPU %d kHz, tick %.3f us\n", khz, tick_us);
+	printf("# histogram bin from_us to_us count\n");
+
+	pos = 7;
+	for (i=0; i<n_hist; i++) {
+		shift = buf[pos++];
+		for (j=0; j<n_bins; j++, pos+=2) {
+			lo = (j << shift) * tick_us;
+			hi = j == n_bins-1 ? -1 : ((j+1) << shift) * tick_us;
+			printf("%s %d %.1f %.1f %d\n",
+					i < INSTR_NUM_HISTOGRAMS ? hist_names[i] : "unknown",
+					j, lo, hi, buf[pos] | buf[pos+1] << 8);
+		}
+	}
+
+	printf("# counter value\n");
+	for (i=0; i<n_counters; i++, pos+=2) {
+		printf("%s %d\n",
+				i < INSTR_NUM_COUNTERS ? counter_names[i] : "unknown",
+				buf[pos] | buf[pos+1] << 8);
+	}
+
+	return 0;
+}
+
+static void printUsage(void)
+{
+	printf("Usage: instrdecode [options] capture.vcd|capture.csv\n");
+	printf("\n");
+	printf("Options:\n");
+	printf("  -b baud     Baud rate (default %d)\n", INSTR_BAUD);
+	printf("  -s signal   VCD signal name (default: first 1-bit signal)\n");
+	printf("\n");
+	printf("The last histogram bin (to_us -1) also counts larger values.\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *signal = NULL;
+	double baud = INSTR_BAUD;
+	unsigned char *bytes;
+	FILE *fptr;
+	int opt, n, res;
+	const char *ext;
+
+	while ((opt = getopt(argc, argv, "b:s:h")) != -1) {
+		switch (opt) {
+			case 'b': baud = atof(optarg); break;
+			case 's': signal = optarg; break;
+			default: printUsage(); return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		printUsage();
+		return 1;
+	}
+
+	fptr = fopen(argv[optind], "r");
+	if (!fptr) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	ext = strrchr(argv[optind], '.');
+	if (ext && !strcmp(ext, ".csv")) {
+		res = loadCSV(fptr);
+	} else {
+		res = loadVCD(fptr, signal);
+	}
+	fclose(fptr);
+	if (res)
+		return 1;
+
+	n = decodeBytes(baud, &bytes);
+	if (n < 0)
+		return 1;
+
+	res = parseDump(bytes, n);
+	free(bytes);
+
+	return res ? 1 : 0;
+}
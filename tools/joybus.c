@@ -0,0 +1,1060 @@
+/*  GC to NES : Gamecube controller to NES adapter
+    Copyright (C) 2012-2016  Raphael Assenat <raph@raphnet.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Run the Joybus send and receive loops of the firmware (gcn64_asm.h)
+ * in a simulated AVR against a virtual controller on PC5, cycle by
+ * cycle ('make -C tools joybus-check').
+ *
+ * The loops are inline assembly, so this is done in two steps:
+ *
+ *  joybus -S       Prints the loops with their operands filled in
+ *                  as gcn64_protocol.c gives them, for F_CPU and
+ *                  GAMECUBE_TIMINGS as this tool was built with.
+ *  joybus file.o   Runs the tests on that assembly, assembled by
+ *                  llvm-mc (avr-gcc is not needed).
+ *
+ * The core (avrsim.c) counts the cycles of each instruction like an
+ * ATmega8. The data line is high unless the AVR pulls it low (DDRC)
+ * or the virtual controller does, and is read through PINC one cycle
+ * late, like through the input synchronizer of the chip. The
+ * controller decodes the command from the low time of each bit, and
+ * answers after the stop bit with a reply whose bit timing is set by
+ * the test: 1/3us like a real controller, 1.5/4.5us like a HORI pad.
+ *
+ * The transfer test runs gcn64_sendBytes followed by gcn64_receive
+ * like gcn64_transfer, and checks the command the controller decoded,
+ * the number of bits received and the reply buffer. Each transaction
+ * is printed with its result.
+ *
+ * The receive tests compare gcn64_receive with the loop it replaced,
+ * which stored the duration of each level for gcn64_decodeWorkbuf:
+ * replies with random bits and level durations must give the same
+ * bits, and the low time from which a bit is a 0 must be the same
+ * within one timing loop.
+ *
+ * The send test checks that each level of the commands sent lasts the
+ * short or long level of the timings, within TX_TOLERANCE.
+ *
+ * Built for 12MHz, the send test also runs the send loop gcn64_sendBytes
+ * replaced, which sent one work buffer byte per bit, on the same
+ * commands. Each level must last as long as before, or be closer to
+ * the short or long level of the timings.
+ *
+ * The NES side (latch interrupt) is C code and would need avr-gcc,
+ * so it is not covered here: tools/syncsim models it instead.
+ *
+ * Prints each failed check and exits with a non-zero status if any
+ * failed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include "../gcn64_asm.h"
+#include "../gcn64_protocol.h"
+#include "avrsim.h"
+
+/* ATmega8 registers of the data line (see gcn64_protocol.c) */
+#define PINC_IO			0x13
+#define DDRC_IO			0x14
+#define PORTC_IO		0x15
+#define DATA_BITNUM		5
+#define DATA_BIT		(1 << DATA_BITNUM)
+
+/* The reply buffer of gcn64_protocol.c (GCN64_RX_MAX_BITS) */
+#define RX_MAX_BITS		80
+#define RXBUF			0x100
+/* The command is placed at the end of the SRAM, so reading past it
+ * stops the run. The stack is below. */
+#define STACK			0x3ff
+
+#define PIN_SYNC_CYCLES	1
+
+static double cyclesToNs(unsigned long long cycles)
+{
+	return cycles * 1e9 / F_CPU;
+}
+
+/**** Assembly ****/
+
+/* Print an asm template, replacing %N by operand N and %= by id, as
+ * gcc does */
+static void expand(const char *tmpl, const char **ops, int id)
+{
+	const char *p;
+
+	for (p = tmpl; *p; p++) {
+		if (*p != '%') {
+			putchar(*p);
+			continue;
+		}
+		p++;
+		if (*p == '=') {
+			printf("%d", id);
+		} else if (*p >= '0' && *p <= '9') {
+			int n = 0;
+
+			while (p[0] >= '0' && p[0] <= '9') {
+				n = n * 10 + *p - '0';
+				p++;
+			}
+			p--;
+			printf("%s", ops[n]);
+		} else {
+			putchar(*p);
+		}
+	}
+	printf("\n");
+}
+
+static char ops_buf[16][16];
+
+static const char **operands(int n, ...)
+{
+	static const char *ops[16];
+	va_list ap;
+	int i;
+
+	va_start(ap, n);
+	for (i = 0; i < n; i++) {
+		const char *s = va_arg(ap, const char *);
+
+		if (!s) // a number follows
+			snprintf(ops_buf[i], sizeof(ops_buf[i]), "%d", va_arg(ap, int));
+		else
+			snprintf(ops_buf[i], sizeof(ops_buf[i]), "%s", s);
+		ops[i] = ops_buf[i];
+	}
+	va_end(ap);
+
+	return ops;
+}
+
+#define NUM(x)	NULL, (int)(x)
+
+/* Operands of gcn64_sendBytes: bits in r25:r24, the command in Z,
+ * n_bytes in r22 */
+static const char **txOperands(void)
+{
+	return operands(10, "r24", "r30", NUM(DDRC_IO), NUM(PINC_IO),
+					NUM(TX_DLY_SHORT_1ST), NUM(TX_DLY_LARGE_1ST),
+					NUM(TX_DLY_SHORT_2ND), NUM(TX_DLY_LARGE_2ND),
+					NUM(DATA_BITNUM), "r22");
+}
+
+/* Operands of gcn64_receive: count in r24, the buffer in Z, max_bits
+ * in r20 */
+static const char **rxOperands(void)
+{
+	return operands(7, "r24", "r30", NUM(PINC_IO),
+					NUM(TIMING_OFFSET + LOW_COMPENSATION), NUM(TIMING_OFFSET),
+					"r20", NUM(DATA_BITNUM));
+}
+
+/* The receive loop before the bits were packed on the fly (baseline
+ * gcn64_receive): it stores the duration of each level in a work
+ * buffer, which oldDecode then turns into bits like
+ * gcn64_decodeWorkbuf did. */
+#define OLD_TIMING_OFFSET	100
+#define OLD_RECEIVE_ASM \
+		"	push r30				\n"	/* save Z */ \
+		"	push r31				\n"	/* save Z */ \
+\
+		"	clr %0					\n" \
+		"	clr r16					\n" \
+"initial_wait_low:\n" \
+		"	inc r16					\n" \
+		"	breq timeout			\n" /* overflow to 0 */ \
+		"	sbic %2, 5				\n" \
+		"	rjmp initial_wait_low	\n" \
+\
+		/* the next transition is to a high bit */ \
+		"	rjmp waithigh			\n" \
+\
+"waitlow:\n" \
+		"	ldi r16, %4				\n" \
+"waitlow_lp:\n" \
+		"	inc r16					\n" \
+		"	brmi timeout			\n" /* > 127 (approx 50uS timeout) */ \
+		"	sbic %2, 5				\n" \
+		"	rjmp waitlow_lp			\n" \
+\
+		"	inc %0					\n" /* count this timed low level */ \
+		"	breq overflow			\n" /* > 255 */ \
+		"	st z+,r16				\n" \
+\
+"waithigh:\n" \
+		"	ldi r16, %4				\n" \
+"waithigh_lp:\n" \
+		"	inc r16					\n" \
+		"	brmi timeout			\n" /* > 127 */ \
+		"	sbis %2, 5				\n" \
+		"	rjmp waithigh_lp		\n" \
+\
+		"	inc %0					\n" /* count this timed high level */ \
+		"	breq overflow			\n" /* > 255 */ \
+		"	st z+,r16				\n" \
+\
+		"	rjmp waitlow			\n" \
+\
+"overflow:  \n" \
+"timeout:	\n" \
+"			pop r31				\n" /* restore z */ \
+"			pop r30				\n" /* restore z */
+
+#define WORKBUF			0x200
+#define WORKBUF_SIZE	300
+
+/* Operands of the old gcn64_receive: count in r24, the work buffer in
+ * Z */
+static const char **oldRxOperands(void)
+{
+	return operands(5, "r24", "r30", NUM(PINC_IO), NUM(0), NUM(OLD_TIMING_OFFSET));
+}
+
+/* The send loop before the bits were shifted straight out of the
+ * command (baseline gcn64_sendBytes). bitsToWorkbufBytes first stored
+ * each bit in a byte of the work buffer. The delays were tuned for
+ * 12MHz. */
+#ifdef GAMECUBE_TIMINGS // (3.6/1.5us)
+#define OLD_DLY_SHORT_1ST	"ldi r17, 2\n rcall sb_dly%=\nnop\nnop\n "
+#define OLD_DLY_LARGE_1ST	"ldi r17, 11\n rcall sb_dly%=\nnop\n"
+#define OLD_DLY_SHORT_2ND	"nop\nnop\nnop\nnop\nnop\n"
+#define OLD_DLY_LARGE_2ND	"ldi r17, 7\n rcall sb_dly%=\n nop\nnop\n"
+#else // N64 timings (3/1us)
+#define OLD_DLY_SHORT_1ST	"ldi r17, 1\n rcall sb_dly%=\n "
+#define OLD_DLY_LARGE_1ST	"ldi r17, 9\n rcall sb_dly%=\n"
+#define OLD_DLY_SHORT_2ND	"\n"
+#define OLD_DLY_LARGE_2ND	"ldi r17, 5\n rcall sb_dly%=\n nop\nnop\n"
+#endif
+#define OLD_PULL_DATA		"	sbi %0, 5               \n"
+#define OLD_RELEASE_DATA	"	cbi %0, 5               \n"
+#define OLD_SENDBYTES_ASM \
+	/* Save the modified input operands */ \
+	"	push r28			\n" /* y */ \
+	"	push r29			\n" \
+	"	push r30			\n" /* z */ \
+	"	push r31			\n" \
+\
+	"sb_loop%=:				\n" \
+	"	ld r16, z+			\n" \
+	"	tst r16				\n" \
+	"	breq sb_send0%=		\n" \
+	"	brne sb_send1%=		\n" \
+\
+	"	rjmp sb_end%=		\n" /* not reached */ \
+\
+\
+	"sb_send0%=:			\n" \
+	"	nop					\n" \
+	OLD_PULL_DATA \
+	OLD_DLY_LARGE_1ST \
+	OLD_RELEASE_DATA \
+	OLD_DLY_SHORT_2ND \
+	"	sbiw	%1, 1		\n" \
+	"	brne sb_loop%=		\n" \
+	"	rjmp sb_end%=		\n" \
+\
+	"sb_send1%=:			\n" \
+	OLD_PULL_DATA \
+	OLD_DLY_SHORT_1ST \
+	OLD_RELEASE_DATA \
+	OLD_DLY_LARGE_2ND \
+	"	sbiw	%1, 1		\n" \
+	"	brne sb_loop%=		\n" \
+	"	rjmp sb_end%=		\n" \
+\
+/* delay sub (arg r17) */ \
+	"sb_dly%=:				\n" \
+	"	dec r17				\n" \
+	"	brne sb_dly%=		\n" \
+	"	ret					\n" \
+\
+\
+	"sb_end%=:\n" \
+	/* going here is fast so we need to extend the last */ \
+	/* delay by 500nS */ \
+	"	nop\n " \
+	"	pop r31				\n" \
+	"	pop r30				\n" \
+	"	pop r29				\n" \
+	"	pop r28				\n" \
+	OLD_PULL_DATA \
+	OLD_DLY_SHORT_1ST \
+	OLD_RELEASE_DATA \
+\
+	/* Now, we need to loop until the wire is high to */ \
+	/* prevent the reception code from thinking this is */ \
+	/* the beginning of the first reply bit. */ \
+\
+	"	ldi r16, 0xff		\n" /* setup a timeout */ \
+	"sb_waitHigh%=:			\n" \
+	"	dec r16				\n" /* decrement timeout */ \
+	"	breq sb_wait_high_done%=		\n" /* handle timeout condition */ \
+	"	sbis %3, 5			\n" /* Read the port */ \
+	"	rjmp sb_waitHigh%=	\n" \
+"sb_wait_high_done%=:\n"
+
+/* Operands of the old gcn64_sendBytes: the number of bits in r25:r24,
+ * the work buffer in Z */
+static const char **oldTxOperands(void)
+{
+	return operands(4, NUM(DDRC_IO), "r24", "r30", NUM(PINC_IO));
+}
+
+static void printAsm(void)
+{
+	printf("\t.text\n");
+
+	printf("sendbytes:\n");
+	expand(GCN64_SENDBYTES_ASM, txOperands(), 1);
+	printf("\tsleep\n");
+
+	printf("receive:\n");
+	expand(GCN64_RECEIVE_ASM, rxOperands(), 2);
+	printf("\tsleep\n");
+
+	printf("sendbytes_old:\n");
+	expand(OLD_SENDBYTES_ASM, oldTxOperands(), 6);
+	printf("\tsleep\n");
+
+	printf("receive_old:\n");
+	expand(OLD_RECEIVE_ASM, oldRxOperands(), 5);
+	printf("\tsleep\n");
+
+	// gcn64_transfer
+	printf("transfer:\n");
+	expand(GCN64_SENDBYTES_ASM, txOperands(), 3);
+	printf("\tldi r30, %d\n\tldi r31, %d\n", RXBUF & 0xff, RXBUF >> 8);
+	expand(GCN64_RECEIVE_ASM, rxOperands(), 4);
+	printf("\tsleep\n");
+}
+
+/**** Checks ****/
+
+static int failures;
+static const char *cur_test;
+
+static void check(int ok, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (ok)
+		return;
+
+	failures++;
+	printf("FAIL %s: ", cur_test);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+}
+
+/**** Data line ****/
+
+static struct avr avr;
+
+/* Levels driven by the AVR, in cycles */
+#define MAX_EDGES	512
+static struct {
+	unsigned long long cycle;
+	int low;
+} mcu_edges[MAX_EDGES];
+static int n_mcu_edges;
+
+/**** Virtual controller ****/
+
+struct pad_timing {
+	const char *name;
+	int low_1_ns; // low time of a 1 bit
+	int low_0_ns; // low time of a 0 bit
+	int period_ns;
+	int stop_ns; // low time of the stop bit
+};
+
+static const struct pad_timing pad_timings[] = {
+	{ "pad", 1000, 3000, 4000, 2000 },
+	{ "HORI", 1500, 4500, 6000, 3000 },
+};
+
+#define N_PAD_TIMINGS	(sizeof(pad_timings) / sizeof(pad_timings[0]))
+
+/* Delay from the end of the command stop bit to the reply */
+#define PAD_REPLY_DELAY_NS	3000
+
+static struct {
+	const struct pad_timing *timing;
+	unsigned char reply[RX_MAX_BITS / 8];
+	int reply_bits; // 0: absent
+	int stuck_low;
+
+	// The command, as decoded from the low time of each bit
+	unsigned char cmd[4];
+	int cmd_bits;
+	int stop_bit;
+	double fall_ns;
+
+	// Low levels of the reply, [start, end) in ns
+	double low_start[RX_MAX_BITS + 1], low_end[RX_MAX_BITS + 1];
+	int n_low;
+} vpad;
+
+static void padSet(const struct pad_timing *timing, const unsigned char *reply, int reply_bits)
+{
+	memset(&vpad, 0, sizeof(vpad));
+	vpad.timing = timing;
+	if (reply)
+		memcpy(vpad.reply, reply, (reply_bits + 7) / 8);
+	vpad.reply_bits = reply_bits;
+}
+
+static int padLow(double ns)
+{
+	int i;
+
+	if (vpad.stuck_low)
+		return 1;
+	for (i = 0; i < vpad.n_low; i++) {
+		if (ns >= vpad.low_start[i] && ns < vpad.low_end[i])
+			return 1;
+	}
+	return 0;
+}
+
+/* Drive a reply: each bit is low for low[i], then high until period[i]
+ * is over. The stop bit follows. */
+static void padWaveform(double ns, const double *low, const double *period, int n_bits,
+						double stop_ns)
+{
+	int i;
+
+	for (i = 0; i < n_bits; i++) {
+		vpad.low_start[i] = ns;
+		vpad.low_end[i] = ns + low[i];
+		ns += period[i];
+	}
+	vpad.low_start[i] = ns;
+	vpad.low_end[i] = ns + stop_ns;
+	vpad.n_low = i + 1;
+}
+
+static void padReply(double ns)
+{
+	const struct pad_timing *t = vpad.timing;
+	double low[RX_MAX_BITS], period[RX_MAX_BITS];
+	int i;
+
+	if (!vpad.reply_bits)
+		return;
+
+	for (i = 0; i < vpad.reply_bits; i++) {
+		int bit = vpad.reply[i / 8] & (0x80 >> (i % 8));
+
+		low[i] = bit ? t->low_1_ns : t->low_0_ns;
+		period[i] = t->period_ns;
+	}
+	padWaveform(ns, low, period, vpad.reply_bits, t->stop_ns);
+}
+
+/* Length of a command, from its first byte */
+static int cmdBytes(unsigned char cmd)
+{
+	switch (cmd) {
+		case GC_GETSTATUS1:
+		case GC_POLL_KB1:
+			return 3;
+	}
+	return 1;
+}
+
+/* The AVR released or pulled the line. The controller times the low
+ * level: under 2us is a 1. */
+static void padEdge(double ns, int low)
+{
+	int bit;
+
+	if (!vpad.timing) // no controller
+		return;
+	if (low) {
+		vpad.fall_ns = ns;
+		return;
+	}
+
+	bit = ns - vpad.fall_ns < 2000;
+	if (vpad.cmd_bits >= 8 && vpad.cmd_bits == cmdBytes(vpad.cmd[0]) * 8) {
+		check(bit && !vpad.stop_bit, "stop bit (low for %.0fns)", ns - vpad.fall_ns);
+		vpad.stop_bit = 1;
+		padReply(ns + PAD_REPLY_DELAY_NS);
+		return;
+	}
+	if (vpad.cmd_bits < sizeof(vpad.cmd) * 8) {
+		if (bit)
+			vpad.cmd[vpad.cmd_bits / 8] |= 0x80 >> (vpad.cmd_bits % 8);
+		vpad.cmd_bits++;
+	}
+}
+
+/**** AVR I/O ****/
+
+static int mcuLow(unsigned long long cycle)
+{
+	int i;
+
+	for (i = n_mcu_edges - 1; i >= 0; i--) {
+		if (mcu_edges[i].cycle <= cycle)
+			return mcu_edges[i].low;
+	}
+	return 0;
+}
+
+static int lineHigh(unsigned long long cycle)
+{
+	return !mcuLow(cycle) && !padLow(cyclesToNs(cycle));
+}
+
+static unsigned char ioRead(struct avr *avr, unsigned char addr)
+{
+	if (addr == PINC_IO)
+		return lineHigh(avr->cycles - PIN_SYNC_CYCLES) ? DATA_BIT : 0;
+	return avr->data[AVR_IO(addr)];
+}
+
+static void ioWrite(struct avr *avr, unsigned char addr, unsigned char value)
+{
+	int low = (avr->data[AVR_IO(DDRC_IO)] & DATA_BIT) &&
+				!(avr->data[AVR_IO(PORTC_IO)] & DATA_BIT);
+
+	if (addr != DDRC_IO && addr != PORTC_IO)
+		return;
+	if (low == mcuLow(avr->cycles))
+		return;
+	if (n_mcu_edges == MAX_EDGES) {
+		check(0, "too many edges");
+		return;
+	}
+	mcu_edges[n_mcu_edges].cycle = avr->cycles;
+	mcu_edges[n_mcu_edges].low = low;
+	n_mcu_edges++;
+	padEdge(cyclesToNs(avr->cycles), low);
+}
+
+/* Run a routine of the assembly, with the registers set by the caller
+ * after avrReset(). Returns 0 if it reached its end. */
+static int run(const char *name)
+{
+	int addr = avrSymbol(&avr, name);
+
+	if (addr < 0) {
+		check(0, "no %s in the assembly", name);
+		return -1;
+	}
+	avr.sp = STACK;
+	avr.data[AVR_IO(PORTC_IO)] = 0;
+	avr.data[AVR_IO(DDRC_IO)] = 0;
+	n_mcu_edges = 0;
+
+	// 1ms, much more than any transaction
+	if (avrRun(&avr, addr, F_CPU / 1000)) {
+		check(0, "%s did not finish", name);
+		return -1;
+	}
+	return 0;
+}
+
+/* Put the command at the end of the SRAM and set the registers of
+ * gcn64_sendBytes, after avrReset() */
+static void setCommand(const unsigned char *cmd, int n_bytes)
+{
+	unsigned int addr = AVR_RAMEND + 1 - n_bytes;
+
+	memcpy(&avr.data[addr], cmd, n_bytes);
+	avr.data[24] = n_bytes * 8;
+	avr.data[25] = 0;
+	avr.data[30] = addr;
+	avr.data[31] = addr >> 8;
+	avr.data[22] = n_bytes;
+}
+
+/* gcn64_transfer: the command, then the reply up to max_bits. Returns
+ * what gcn64_receive returns, -1 if the run failed. */
+static int transfer(const unsigned char *cmd, int n_bytes, int max_bits)
+{
+	int count;
+
+	// Guard bytes after the reply buffer
+	memset(&avr.data[RXBUF], 0xa5, RX_MAX_BITS / 8 + 2);
+
+	avrReset(&avr);
+	setCommand(cmd, n_bytes);
+	avr.data[20] = max_bits;
+	if (run("transfer"))
+		return -1;
+
+	count = avr.data[24];
+	// Longer than the buffer
+	if (count > RX_MAX_BITS)
+		return 0;
+
+	check(avr.data[RXBUF + RX_MAX_BITS / 8] == 0xa5, "wrote past the reply buffer");
+	return count;
+}
+
+/* gcn64_receive, the controller starting its reply (set by the caller
+ * with padWaveform) when it starts. Returns what gcn64_receive returns,
+ * -1 if the run failed. The bits are at RXBUF. */
+static int receive(void)
+{
+	int count;
+
+	avrReset(&avr);
+	avr.data[30] = RXBUF & 0xff;
+	avr.data[31] = RXBUF >> 8;
+	avr.data[20] = RX_MAX_BITS + 1;
+	if (run("receive"))
+		return -1;
+
+	count = avr.data[24];
+	if (count > RX_MAX_BITS)
+		return 0;
+	return count;
+}
+
+/* The old gcn64_receive, followed by gcn64_decodeWorkbuf and
+ * gcn64_protocol_getByte, packing the bits in buf. Returns the number
+ * of bits like the old gcn64_transaction, -1 if the run failed. */
+static int receiveOld(unsigned char *buf, int size)
+{
+	int count, i;
+
+	avrReset(&avr);
+	avr.data[30] = WORKBUF & 0xff;
+	avr.data[31] = WORKBUF >> 8;
+	if (run("receive_old"))
+		return -1;
+
+	// Each bit is a low and a high level, then the stop bit low level
+	count = avr.data[24];
+	if (!count || !(count & 0x01))
+		return 0;
+
+	memset(buf, 0, size);
+	for (i = 0; i < (count - 1) / 2 && i < size * 8; i++) {
+		if (avr.data[WORKBUF + i * 2] < avr.data[WORKBUF + i * 2 + 1])
+			buf[i / 8] |= 0x80 >> (i % 8);
+	}
+	return (count - 1) / 2;
+}
+
+/* Send a command with gcn64_sendBytes, or with the previous loop
+ * (old), the bits exploded to the work buffer like bitsToWorkbufBytes
+ * did. Returns the number of edges, -1 if the run failed. Their times
+ * from the first edge, in cycles, are stored in edges (the line is low
+ * after the even ones, high after the odd ones). */
+static int sendEdges(const unsigned char *cmd, int n_bytes, int old, unsigned long long *edges)
+{
+	int i;
+
+	padSet(NULL, NULL, 0);
+	avrReset(&avr);
+	if (old) {
+		for (i = 0; i < n_bytes * 8; i++)
+			avr.data[WORKBUF + i] = cmd[i / 8] & (0x80 >> (i % 8));
+		avr.data[24] = n_bytes * 8;
+		avr.data[25] = 0;
+		avr.data[30] = WORKBUF & 0xff;
+		avr.data[31] = WORKBUF >> 8;
+	} else {
+		setCommand(cmd, n_bytes);
+	}
+	if (run(old ? "sendbytes_old" : "sendbytes"))
+		return -1;
+
+	for (i = 0; i < n_mcu_edges; i++)
+		edges[i] = mcu_edges[i].cycle - mcu_edges[0].cycle;
+	return n_mcu_edges;
+}
+
+/**** Tests ****/
+
+static void printBytes(const unsigned char *buf, int bits)
+{
+	int i;
+
+	for (i = 0; i < (bits + 7) / 8; i++)
+		printf("%02x", buf[i]);
+}
+
+/* Send a command to the virtual controller answering reply, and check
+ * what each side received */
+static void testCommand(const struct pad_timing *timing, const unsigned char *cmd, int n_bytes,
+						const unsigned char *reply, int reply_bits, int max_bits)
+{
+	int count, expect = reply_bits < max_bits ? reply_bits : max_bits;
+
+	padSet(timing, reply, reply_bits);
+	count = transfer(cmd, n_bytes, max_bits);
+
+	printf("%s timing, command ", timing->name);
+	printBytes(cmd, n_bytes * 8);
+	printf(": %d bits ", count);
+	printBytes(&avr.data[RXBUF], count > 0 ? count : 0);
+	printf("\n");
+
+	check(vpad.cmd_bits == n_bytes * 8 && !memcmp(vpad.cmd, cmd, n_bytes) && vpad.stop_bit,
+			"the controller received %d bits (%02x %02x %02x)", vpad.cmd_bits,
+			vpad.cmd[0], vpad.cmd[1], vpad.cmd[2]);
+	check(count == expect, "%d bits received, %d expected", count, expect);
+	if (count == expect && count > 0) {
+		check(!memcmp(&avr.data[RXBUF], reply, expect / 8),
+				"reply differs");
+	}
+}
+
+static void testTransfer(void)
+{
+	static const unsigned char getid[] = { GC_GETID };
+	static const unsigned char getstatus[] = { GC_GETSTATUS1, GC_GETSTATUS2, GC_GETSTATUS3(0) };
+	static const unsigned char getorigin[] = { GC_GETORIGIN };
+	static const unsigned char n64status[] = { N64_GET_STATUS };
+	static const unsigned char id[] = { 0x09, 0x00, 0x03 };
+	static const unsigned char status[] = { 0x01, 0x80, 0x81, 0x7e, 0x00, 0xff, 0x12, 0x34 };
+	static const unsigned char origin[] = { 0x00, 0x80, 0x80, 0x80, 0x80, 0x80, 0x1f, 0x1f, 0x00, 0x00 };
+	static const unsigned char n64[] = { 0xa5, 0x5a, 0xf0, 0x0f };
+	int i;
+
+	cur_test = "transfer";
+
+	for (i = 0; i < N_PAD_TIMINGS; i++) {
+		const struct pad_timing *t = &pad_timings[i];
+
+		testCommand(t, getid, 1, id, GC_GETID_REPLY_LENGTH, RX_MAX_BITS + 1);
+		testCommand(t, getstatus, 3, status, GC_GETSTATUS_REPLY_LENGTH, RX_MAX_BITS + 1);
+		testCommand(t, getorigin, 1, origin, GC_GETORIGIN_REPLY_LENGTH, RX_MAX_BITS + 1);
+		testCommand(t, n64status, 1, n64, N64_GET_STATUS_REPLY_LENGTH, RX_MAX_BITS + 1);
+		// gcn64_transactionPartial
+		testCommand(t, getstatus, 3, status, GC_GETSTATUS_REPLY_LENGTH, GCN64_BUTTONS_REPLY_LENGTH);
+	}
+}
+
+/* Pseudo random level durations, the same on each run */
+static unsigned long rng = 1;
+
+static double jitter(double max)
+{
+	rng = rng * 1103515245 + 12345;
+	return ((long)((rng >> 16) % 2001) - 1000) / 1000.0 * max;
+}
+
+/* Receive the same reply with the loop and with the previous loop and
+ * decoder. Returns the number of bits where they differ, and checks
+ * that the other bits and the bit counts are right. */
+static int receiveBoth(const struct pad_timing *t, const unsigned char *reply, int n_bits,
+						const double *low, const double *period, unsigned char *bits,
+						unsigned char *old_bits)
+{
+	int count, old_count, i, differ = 0;
+
+	padSet(t, NULL, 0);
+	padWaveform(cyclesToNs(avr.cycles) + PAD_REPLY_DELAY_NS, low, period, n_bits, t->stop_ns);
+	count = receive();
+	memcpy(bits, &avr.data[RXBUF], (n_bits + 7) / 8);
+
+	padSet(t, NULL, 0);
+	padWaveform(cyclesToNs(avr.cycles) + PAD_REPLY_DELAY_NS, low, period, n_bits, t->stop_ns);
+	old_count = receiveOld(old_bits, (n_bits + 7) / 8);
+
+	check(count == n_bits && old_count == n_bits, "%d bits received, %d with the previous loop, %d sent",
+			count, old_count, n_bits);
+	for (i = 0; i < n_bits; i++) {
+		unsigned char mask = 0x80 >> (i % 8);
+
+		if ((bits[i / 8] ^ old_bits[i / 8]) & mask)
+			differ++;
+	}
+	return differ;
+}
+
+/* Replies with the level durations off by up to 25% of the short level
+ * (each level on its own): the bits must be right, and the same as
+ * with the previous receive loop and gcn64_decodeWorkbuf */
+static void testReceiveJitter(void)
+{
+	unsigned char reply[8], bits[8], old_bits[8];
+	double low[64], period[64];
+	int i, j, n, differ, wrong;
+
+	cur_test = "receive jitter";
+
+	for (i = 0; i < N_PAD_TIMINGS; i++) {
+		const struct pad_timing *t = &pad_timings[i];
+		double max = t->low_1_ns / 4.0;
+
+		differ = wrong = 0;
+		for (n = 0; n < 200; n++) {
+			for (j = 0; j < 8; j++) {
+				rng = rng * 1103515245 + 12345;
+				reply[j] = rng >> 16;
+			}
+			for (j = 0; j < 64; j++) {
+				int bit = reply[j / 8] & (0x80 >> (j % 8));
+
+				low[j] = (bit ? t->low_1_ns : t->low_0_ns) + jitter(max);
+				period[j] = t->period_ns - (bit ? t->low_1_ns : t->low_0_ns) +
+								jitter(max) + low[j];
+			}
+			differ += receiveBoth(t, reply, 64, low, period, bits, old_bits);
+			if (memcmp(bits, reply, 8))
+				wrong++;
+		}
+		printf("%s timing, levels +/-%.0fns: 200 replies, %d wrong, %d bits differ from the previous decoder\n",
+				t->name, max, wrong, differ);
+		check(!wrong && !differ, "%s timing: %d wrong replies, %d bits differ", t->name, wrong, differ);
+	}
+}
+
+/* A bit with a growing low time, the period staying the same, at the
+ * start of the reply, at the end and start of a byte and at the end:
+ * from which low time it is received as a 0, with both loops. The
+ * loops sample the line at different cycles, so this may differ by up
+ * to one loop iteration. */
+static void testReceiveThreshold(void)
+{
+	static const unsigned char reply[2] = { 0xa5, 0x5a };
+	static const int positions[] = { 0, 7, 8, 15 };
+	unsigned char bits[2], old_bits[2];
+	double low[16], period[16];
+	double step = 1e9 / F_CPU / 4, loop = 5e9 / F_CPU;
+	int i, j, p;
+
+	cur_test = "receive threshold";
+
+	for (i = 0; i < N_PAD_TIMINGS; i++) {
+		const struct pad_timing *t = &pad_timings[i];
+
+		for (p = 0; p < sizeof(positions) / sizeof(positions[0]); p++) {
+			int k = positions[p];
+			double l, flip = 0, old_flip = 0;
+			int differ = 0;
+
+			for (l = t->period_ns * 0.25; l <= t->period_ns * 0.75; l += step) {
+				for (j = 0; j < 16; j++) {
+					int bit = reply[j / 8] & (0x80 >> (j % 8));
+
+					low[j] = j == k ? l : bit ? t->low_1_ns : t->low_0_ns;
+					period[j] = t->period_ns;
+				}
+				differ += receiveBoth(t, reply, 16, low, period, bits, old_bits);
+				if (!flip && !(bits[k / 8] & (0x80 >> (k % 8))))
+					flip = l;
+				if (!old_flip && !(old_bits[k / 8] & (0x80 >> (k % 8))))
+					old_flip = l;
+			}
+			printf("%s timing, bit %d: a 0 from %.0fns low, %.0fns with the previous decoder, %d decisions differ\n",
+					t->name, k, flip, old_flip, differ);
+			// The levels are timed by 5 cycle loops
+			check(flip - old_flip <= loop && old_flip - flip <= loop,
+					"%s timing, bit %d: a 0 from %.0fns low instead of %.0fns", t->name, k,
+					flip, old_flip);
+		}
+	}
+}
+
+/* Commands sent by the send tests, and patterns with 1 and 0 bits at
+ * the start and end of a byte */
+static const unsigned char send_cmds[][3] = {
+	{ GC_GETID }, { N64_GET_STATUS }, { GC_GETORIGIN }, { 0xff }, { 0x80, 0x01 },
+	{ GC_GETSTATUS1, GC_GETSTATUS2, GC_GETSTATUS3(0) },
+	{ GC_GETSTATUS1, GC_GETSTATUS2, GC_GETSTATUS3(1) },
+	{ GC_POLL_KB1, GC_POLL_KB2, GC_POLL_KB3 }, { 0xa5, 0x5a, 0xc3 },
+};
+static const int send_lengths[] = { 1, 1, 1, 1, 2, 3, 3, 3, 3 };
+
+#define N_SEND_CMDS	(sizeof(send_lengths) / sizeof(send_lengths[0]))
+
+/* The high level before the stop bit is longer (see sb_end in
+ * gcn64_asm.h) */
+#define STOP_HIGH_EXTRA	4
+
+/* Each bit of each command must be low for the short level and high
+ * for the long one (a 1) or the reverse (a 0), and the stop bit low for
+ * the short level, within TX_TOLERANCE. */
+static void testSendTimings(void)
+{
+	unsigned long long edges[MAX_EDGES];
+	double max_off = 0, tolerance = cyclesToNs(TX_TOLERANCE);
+	int i, k, n, n_bits;
+
+	cur_test = "send timings";
+
+	for (i = 0; i < N_SEND_CMDS; i++) {
+		n_bits = send_lengths[i] * 8;
+		n = sendEdges(send_cmds[i], send_lengths[i], 0, edges);
+		if (n != n_bits * 2 + 2) {
+			check(0, "%d edges for %d bits", n, n_bits);
+			continue;
+		}
+		for (k = 0; k <= n_bits; k++) {
+			int bit = k == n_bits || (send_cmds[i][k / 8] & (0x80 >> (k % 8)));
+			double off[2];
+			int j;
+
+			off[0] = cyclesToNs(edges[k * 2 + 1] - edges[k * 2]) - (bit ? TX_SHORT_NS : TX_LONG_NS);
+			off[1] = 0;
+			if (k < n_bits - 1)
+				off[1] = cyclesToNs(edges[k * 2 + 2] - edges[k * 2 + 1]);
+			else if (k == n_bits - 1)
+				off[1] = cyclesToNs(edges[k * 2 + 2] - edges[k * 2 + 1] - STOP_HIGH_EXTRA);
+			if (k < n_bits)
+				off[1] -= bit ? TX_LONG_NS : TX_SHORT_NS;
+
+			for (j = 0; j < 2; j++) {
+				if (off[j] < 0)
+					off[j] = -off[j];
+				if (off[j] > max_off)
+					max_off = off[j];
+				check(off[j] <= tolerance, "command %02x..., bit %d: %s level %.0fns off",
+						send_cmds[i][0], k, j ? "high" : "low", off[j]);
+			}
+		}
+	}
+	printf("%d commands sent, levels at most %.0fns off %d/%dns (%.0fns allowed)\n",
+			(int)N_SEND_CMDS, max_off, TX_SHORT_NS, TX_LONG_NS, tolerance);
+}
+
+#if F_CPU == 12000000L
+/* Distance in ns from a level to the nearest of the short and long
+ * Joybus levels, once extra_ns is taken off */
+static double txLevelError(unsigned long long cycles, double extra_ns)
+{
+	double ns = cyclesToNs(cycles) - extra_ns;
+	double e_short = ns > TX_SHORT_NS ? ns - TX_SHORT_NS : TX_SHORT_NS - ns;
+	double e_long = ns > TX_LONG_NS ? ns - TX_LONG_NS : TX_LONG_NS - ns;
+
+	return e_short < e_long ? e_short : e_long;
+}
+
+/* Each command must have the edges of the previous send loop. Its
+ * delays were written for 12MHz only, so this is done at 12MHz. A
+ * level may only differ if it is now closer to the short or long level
+ * (the previous GAMECUBE_TIMINGS delays made the high level of a 1 bit
+ * one cycle short). Both loops extend the high level before the stop
+ * bit by about 500ns. */
+static void testSendEdges(void)
+{
+	unsigned long long edges[MAX_EDGES], old_edges[MAX_EDGES];
+	int i, j, n, n_old, n_differ, worse;
+
+	cur_test = "send edges";
+
+	for (i = 0; i < N_SEND_CMDS; i++) {
+		n = sendEdges(send_cmds[i], send_lengths[i], 0, edges);
+		n_old = sendEdges(send_cmds[i], send_lengths[i], 1, old_edges);
+
+		printf("command ");
+		printBytes(send_cmds[i], send_lengths[i] * 8);
+		if (n != n_old) {
+			printf(": %d edges, %d with the previous loop\n", n, n_old);
+			check(0, "%d edges, %d with the previous loop", n, n_old);
+			continue;
+		}
+
+		n_differ = 0;
+		worse = 0;
+		for (j = 1; j < n; j++) {
+			unsigned long long level = edges[j] - edges[j - 1];
+			unsigned long long old_level = old_edges[j] - old_edges[j - 1];
+			double extra_ns = j == n - 2 ? 500 : 0;
+
+			if (level == old_level)
+				continue;
+			n_differ++;
+			if (!worse && txLevelError(level, extra_ns) >= txLevelError(old_level, extra_ns))
+				worse = j;
+		}
+		if (!n_differ) {
+			printf(": %d edges, on the same cycles as with the previous loop\n", n);
+			continue;
+		}
+		printf(": %d edges, %d of the levels differ from the previous loop\n", n, n_differ);
+		check(!worse, "level %d lasts %.0fns, %.0fns with the previous loop", worse,
+				cyclesToNs(edges[worse] - edges[worse - 1]),
+				cyclesToNs(old_edges[worse] - old_edges[worse - 1]));
+	}
+}
+#endif
+
+/* No controller, or the line held low: gcn64_receive gives up */
+static void testAbsent(void)
+{
+	static const unsigned char getid[] = { GC_GETID };
+	int count;
+
+	cur_test = "absent";
+	padSet(&pad_timings[0], NULL, 0);
+	count = transfer(getid, 1, RX_MAX_BITS + 1);
+	printf("no controller: %d bits\n", count);
+	check(count == 0, "%d bits received", count);
+
+	cur_test = "stuck low";
+	padSet(&pad_timings[0], NULL, 0);
+	vpad.stuck_low = 1;
+	count = transfer(getid, 1, RX_MAX_BITS + 1);
+	printf("line stuck low: %d bits\n", count);
+	check(count == 0, "%d bits received", count);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc == 2 && !strcmp(argv[1], "-S")) {
+		printAsm();
+		return 0;
+	}
+	if (argc != 2) {
+		printf("Usage: ./joybus -S > joybus.s\n");
+		printf("       ./joybus joybus.o\n");
+		return 1;
+	}
+
+	if (avrLoad(&avr, argv[1]))
+		return 1;
+	avr.io_read = ioRead;
+	avr.io_write = ioWrite;
+
+	printf("F_CPU %ld, %s timings\n", F_CPU,
+#ifdef GAMECUBE_TIMINGS
+			"gamecube"
+#else
+			"N64"
+#endif
+			);
+
+	testTransfer();
+	testAbsent();
+	testReceiveJitter();
+	testReceiveThreshold();
+	testSendTimings();
+#if F_CPU == 12000000L
+	testSendEdges();
+#endif
+
+	if (failures) {
+		printf("%d failed checks\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,288 @@
+/*  GC to NES : Gamecube controller to NES adapter
+    Copyright (C) 2012-2016  Raphael Assenat <raph@raphnet.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Compile a text profile file (see profiles.txt) into the EEPROM image
+ * format of profile.h, or decode an image back to text (-d). The image
+ * is raw binary, for avrdude -Ueeprom:w:file:r
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include "../profile.h"
+#include "profnames.h"
+#include "gate.h"
+
+static unsigned char checksum(const unsigned char *image, int size)
+{
+	unsigned char sum = 0;
+	int i;
+
+	// From the version to the end of the last profile
+	for (i=2; i<size-1; i++)
+		sum += image[i];
+
+	return sum;
+}
+
+/* Returns the image size, or -1 on error */
+static int compile(FILE *fptr, const char *filename, unsigned char *image)
+{
+	struct profile profiles[PROFILE_MAX] = { };
+	struct profile *p = NULL;
+	const char **out_names = nes_names;
+	int n = 0, line = 0, snes = 0;
+	int gc, bit, period, size, i;
+	int params[4];
+	char buf[256], *tok, *arg;
+
+	while (fgets(buf, sizeof(buf), fptr)) {
+		line++;
+		if (strchr(buf, '#'))
+			*strchr(buf, '#') = 0;
+
+		tok = strtok(buf, " \t\r\n");
+		if (!tok)
+			continue;
+		arg = strtok(NULL, " \t\r\n");
+
+		if (!strcmp(tok, "output")) {
+			if (n || !arg || (strcmp(arg, "nes") && strcmp(arg, "snes")))
+				goto syntax;
+			snes = !strcmp(arg, "snes");
+			out_names = snes ? snes_names : nes_names;
+			continue;
+		}
+
+		if (!strcmp(tok, "profile")) {
+			if (n == PROFILE_MAX) {
+				fprintf(stderr, "%s:%d: Too many profiles (max. %d)\n", filename, line, PROFILE_MAX);
+				return -1;
+			}
+			p = &profiles[n++];
+			gateStick(&p->stick, mappings[0].walk, mappings[0].run, mappings[0].diagonal,
+						mappings[0].hysteresis);
+			continue;
+		}
+
+		if (!p || !arg)
+			goto syntax;
+
+		if (!strcmp(tok, "joystick")) {
+			if (arg[0] >= '0' && arg[0] <= '9') {
+				for (i=0; i<4; i++) {
+					if (!arg)
+						goto syntax;
+					params[i] = atoi(arg);
+					arg = strtok(NULL, " \t\r\n");
+				}
+			} else {
+				for (i=0; i<num_mappings && strcasecmp(arg, mappings[i].name); i++)
+					;
+				if (i == num_mappings) {
+					fprintf(stderr, "%s:%d: Unknown joystick mapping '%s'\n", filename, line, arg);
+					return -1;
+				}
+				params[0] = mappings[i].walk;
+				params[1] = mappings[i].run;
+				params[2] = mappings[i].diagonal;
+				params[3] = mappings[i].hysteresis;
+			}
+			if (gateCheck(params[0], params[1], params[2], params[3])) {
+				fprintf(stderr, "%s:%d: Invalid joystick parameters\n", filename, line);
+				return -1;
+			}
+			gateStick(&p->stick, params[0], params[1], params[2], params[3]);
+		} else if (!strcmp(tok, "button")) {
+			gc = lookup(arg, gc_names, PROFILE_GC_BUTTONS);
+			if (gc < 0) {
+				fprintf(stderr, "%s:%d: Unknown gamecube button '%s'\n", filename, line, arg);
+				return -1;
+			}
+			while ((arg = strtok(NULL, " \t\r\n"))) {
+				bit = lookup(arg, out_names, PROFILE_BITS);
+				if (bit < 0) {
+					fprintf(stderr, "%s:%d: Unknown %s button '%s'\n", filename, line,
+							snes ? "SNES" : "NES", arg);
+					return -1;
+				}
+				p->buttons[gc][bit / 8] |= 1 << (bit % 8);
+			}
+		} else if (!strcmp(tok, "turbo")) {
+			bit = lookup(arg, out_names, PROFILE_BITS);
+			arg = strtok(NULL, " \t\r\n");
+			if (bit < 0 || !arg)
+				goto syntax;
+			period = atoi(arg);
+			if (period < 2 || period > 255) {
+				fprintf(stderr, "%s:%d: Invalid turbo period %d (2 to 255)\n", filename, line, period);
+				return -1;
+			}
+			p->turbo[bit] = period;
+		} else {
+			goto syntax;
+		}
+	}
+
+	if (!n) {
+		fprintf(stderr, "%s: No profiles\n", filename);
+		return -1;
+	}
+
+	size = PROFILE_IMAGE_SIZE(n);
+	image[0] = PROFILE_MAGIC1;
+	image[1] = PROFILE_MAGIC2;
+	image[2] = PROFILE_VERSION;
+	image[3] = snes ? PROFILE_FLAG_SNES : 0;
+	image[4] = n;
+	memcpy(image + PROFILE_HEADER_SIZE, profiles, n * sizeof(struct profile));
+	image[size-1] = checksum(image, size);
+
+	return size;
+
+syntax:
+	fprintf(stderr, "%s:%d: Syntax error\n", filename, line);
+	return -1;
+}
+
+static int decode(const unsigned char *image, int size)
+{
+	const struct profile *p;
+	const char **out_names;
+	int i, m, gc, bit;
+
+	if (size < PROFILE_HEADER_SIZE || image[0] != PROFILE_MAGIC1 || image[1] != PROFILE_MAGIC2) {
+		fprintf(stderr, "Not a profile image\n");
+		return 1;
+	}
+	if (image[2] != PROFILE_VERSION) {
+		fprintf(stderr, "Unsupported version %d\n", image[2]);
+		return 1;
+	}
+	if (image[4] < 1 || image[4] > PROFILE_MAX || size < PROFILE_IMAGE_SIZE(image[4])) {
+		fprintf(stderr, "Invalid number of profiles (%d)\n", image[4]);
+		return 1;
+	}
+	size = PROFILE_IMAGE_SIZE(image[4]);
+	if (checksum(image, size) != image[size-1]) {
+		fprintf(stderr, "Bad checksum\n");
+		return 1;
+	}
+
+	out_names = image[3] & PROFILE_FLAG_SNES ? snes_names : nes_names;
+	printf("output %s\n", image[3] & PROFILE_FLAG_SNES ? "snes" : "nes");
+
+	for (i=0; i<image[4]; i++) {
+		p = (const struct profile *)(image + PROFILE_HEADER_SIZE) + i;
+
+		printf("\nprofile %d\n", i + 1);
+		for (m=0; m<num_mappings; m++) {
+			if (p->stick.walk == mappings[m].walk && p->stick.run == mappings[m].run &&
+					p->stick.diagonal == mappings[m].diagonal &&
+					p->stick.hysteresis == mappings[m].hysteresis)
+				break;
+		}
+		if (m < num_mappings) {
+			printf("joystick %s\n", mappings[m].name);
+		} else {
+			printf("joystick %d %d %d %d\n", p->stick.walk, p->stick.run,
+					p->stick.diagonal, p->stick.hysteresis);
+		}
+		for (gc=0; gc<PROFILE_GC_BUTTONS; gc++) {
+			if (!p->buttons[gc][0] && !p->buttons[gc][1])
+				continue;
+			printf("button %s", gc_names[gc]);
+			for (bit=0; bit<PROFILE_BITS; bit++) {
+				if (p->buttons[gc][bit / 8] & (1 << (bit % 8)))
+					printf(" %s", out_names[bit] ? out_names[bit] : "?");
+			}
+			printf("\n");
+		}
+		for (bit=0; bit<PROFILE_BITS; bit++) {
+			if (p->turbo[bit])
+				printf("turbo %s %d\n", out_names[bit] ? out_names[bit] : "?", p->turbo[bit]);
+		}
+	}
+
+	return 0;
+}
+
+static void printUsage(void)
+{
+	printf("Usage: ./mkprofile profiles.txt image.eep\n");
+	printf("       ./mkprofile -d image.eep\n");
+	printf("\n");
+	printf("  -d   Decode an image\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char image[PROFILE_IMAGE_SIZE(PROFILE_MAX)];
+	int opt, do_decode = 0, size;
+	FILE *fptr;
+
+	while ((opt = getopt(argc, argv, "dh")) != -1) {
+		switch (opt) {
+			case 'd': do_decode = 1; break;
+			default: printUsage(); return 1;
+		}
+	}
+
+	if (argc - optind != (do_decode ? 1 : 2)) {
+		printUsage();
+		return 1;
+	}
+
+	if (do_decode) {
+		fptr = fopen(argv[optind], "rb");
+		if (!fptr) {
+			perror(argv[optind]);
+			return 1;
+		}
+		size = fread(image, 1, sizeof(image), fptr);
+		fclose(fptr);
+
+		return decode(image, size);
+	}
+
+	fptr = fopen(argv[optind], "r");
+	if (!fptr) {
+		perror(argv[optind]);
+		return 1;
+	}
+	size = compile(fptr, argv[optind], image);
+	fclose(fptr);
+	if (size < 0)
+		return 1;
+
+	fptr = fopen(argv[optind+1], "wb");
+	if (!fptr) {
+		perror(argv[optind+1]);
+		return 1;
+	}
+	if (fwrite(image, 1, size, fptr) != size) {
+		perror(argv[optind+1]);
+		fclose(fptr);
+		return 1;
+	}
+	fclose(fptr);
+
+	printf("%d profile(s), %d bytes\n", image[4], size);
+
+	return 0;
+}
@@ -0,0 +1,1826 @@
+/*  GC to NES : Gamecube controller to NES adapter
+    Copyright (C) 2012-2016  Raphael Assenat <raph@raphnet.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Run the controller and mapping code (gamecube.c, n64.c, profile.c,
+ * mapping.c) on the host against virtual controllers, and check the
+ * reports and the bytes published for the NES ('make -C tools check').
+ *
+ * The virtual controllers replace gcn64_protocol.c: each answers the
+ * Joybus commands it receives with the reply set by the test, and the
+ * commands are logged. The EEPROM is port_eeprom (see port.h).
+ *
+ * The polls are those of the main loop: gamepadUpdate(), mapPads()
+ * and publishOutput(), with mapNextFrame() when the NES starts a new
+ * frame. The NES side reads out_bytes[out_buf] like the latch
+ * interrupt. Built with OVERSAMPLING, the tap test runs the main loop
+ * itself (mainloop.c) and sync.c, in simulated time.
+ *
+ * profile.c is included, to load the EEPROM profiles one by one. With
+ * -p, the profiles of an EEPROM image are loaded and printed in the
+ * text format of tools/mkprofile (see profiles.txt), for a round trip
+ * check of the image format.
+ *
+ * Prints each failed check and exits with a non-zero status if any
+ * failed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <math.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "../port.h"
+#include "../gamepad.h"
+#include "../gcn64_protocol.h"
+#include "../mapping.h"
+#include "../sync.h"
+#include "../mainloop.h"
+#include "../profile.c"
+#include "gate.h"
+#include "profnames.h"
+
+unsigned char port_eeprom[PORT_EEPROM_SIZE];
+
+/* Gamecube status reply (see gamecube.c) */
+#define ST0_GET_ORIGIN	0x20
+#define ST0_START		0x10
+#define ST0_Y			0x08
+#define ST0_X			0x04
+#define ST0_B			0x02
+#define ST0_A			0x01
+#define ST1_ALWAYS		0x80
+#define ST1_L			0x40
+#define ST1_R			0x20
+#define ST1_Z			0x10
+#define ST1_UP			0x08
+#define ST1_DOWN		0x04
+#define ST1_RIGHT		0x02
+#define ST1_LEFT		0x01
+
+/* Output bits of this build (nes.h) */
+#ifdef SNES_OUTPUT
+#define OUT_BIT_A		SNES_BIT_A
+#define OUT_A			PAD_MASK(SNES_BIT_A)
+#define OUT_B			PAD_MASK(SNES_BIT_B)
+#define OUT_SELECT		PAD_MASK(SNES_BIT_SELECT)
+#define OUT_START		PAD_MASK(SNES_BIT_START)
+#else
+#define OUT_BIT_A		NES_BIT_A
+#define OUT_A			PAD_MASK(NES_BIT_A)
+#define OUT_B			PAD_MASK(NES_BIT_B)
+#define OUT_SELECT		PAD_MASK(NES_BIT_SELECT)
+#define OUT_START		PAD_MASK(NES_BIT_START)
+#endif
+
+/**** Virtual controllers ****/
+
+#define LOG_SIZE		64
+
+struct vpad {
+	int type; // CONTROLLER_IS_*, the commands answered
+	unsigned char id[3]; // Reply to GC_GETID (N64_GET_CAPABILITIES)
+	unsigned char status[8]; // Reply to the status command (4 bytes: N64)
+	unsigned char origin[10]; // Reply to GC_GETORIGIN
+	int need_origin; // Get origin bit of the status, until GC_GETORIGIN
+	int preempt; // Number of next transactions disturbed by the NES
+	// WaveBird receiver, controller off or not synced: the id is
+	// 0xA80000, and the other commands are only answered with
+	// answer_asleep. Once wake is set (controller on), the next GC_GETID
+	// wakes it up and the id becomes 0xE9A017.
+	int asleep, wake, answer_asleep;
+	unsigned char log[LOG_SIZE]; // First byte of each command received
+	int n_log;
+	int partial; // Replies cut short by gcn64_transactionPartial
+};
+
+static struct vpad vpads[GC_NUM_PADS];
+static unsigned char channel;
+static unsigned char rxbuf[10];
+
+Gcn64Stats gcn64_stats;
+volatile unsigned char gcn64_interrupted;
+
+#ifdef OVERSAMPLING
+static int tapTransaction(void);
+#endif
+
+void gcn64protocol_hwinit(void)
+{
+}
+
+void gcn64_setChannel(unsigned char c)
+{
+	channel = c;
+}
+
+/* The reply of the current virtual controller to a command, in bits.
+ * Same return values as the real one. */
+int gcn64_transaction(unsigned char *data_out, int data_out_len)
+{
+	struct vpad *vp = &vpads[channel];
+
+	if (vp->n_log < LOG_SIZE)
+		vp->log[vp->n_log++] = data_out[0];
+
+#ifdef OVERSAMPLING
+	if (tapTransaction()) {
+		gcn64_stats.dropped++;
+		return GCN64_PREEMPTED;
+	}
+#endif
+	if (vp->preempt) {
+		vp->preempt--;
+		gcn64_stats.dropped++;
+		return GCN64_PREEMPTED;
+	}
+
+	if (vp->type == CONTROLLER_IS_ABSENT)
+		return 0;
+
+	switch (data_out[0]) {
+		case GC_GETID:
+			memcpy(rxbuf, vp->id, 3);
+			if (vp->asleep && vp->wake) {
+				vp->asleep = 0;
+				memcpy(vp->id, "\xe9\xa0\x17", 3);
+			}
+			return GC_GETID_REPLY_LENGTH;
+
+		case GC_GETSTATUS1:
+			if (vp->type != CONTROLLER_IS_GC || data_out_len != 3)
+				break;
+			if (vp->asleep && !vp->answer_asleep)
+				break;
+			memcpy(rxbuf, vp->status, 8);
+			if (vp->need_origin)
+				rxbuf[0] |= ST0_GET_ORIGIN;
+			return GC_GETSTATUS_REPLY_LENGTH;
+
+		case GC_GETORIGIN:
+			if (vp->type != CONTROLLER_IS_GC || data_out_len != 1)
+				break;
+			if (vp->asleep && !vp->answer_asleep)
+				break;
+			memcpy(rxbuf, vp->origin, 10);
+			vp->need_origin = 0;
+			return GC_GETORIGIN_REPLY_LENGTH;
+
+		case N64_GET_STATUS:
+			if (vp->type != CONTROLLER_IS_N64 || data_out_len != 1)
+				break;
+			memcpy(rxbuf, vp->status, 4);
+			return N64_GET_STATUS_REPLY_LENGTH;
+	}
+
+	return 0; // No reply
+}
+
+/* Like gcn64_transaction, but only the first reply_bits bits are
+ * received. The rest of the buffer is left with garbage. */
+int gcn64_transactionPartial(unsigned char *data_out, int data_out_len, unsigned char reply_bits)
+{
+	int count;
+
+	count = gcn64_transaction(data_out, data_out_len);
+	if (count > reply_bits) {
+		memset(rxbuf + reply_bits / 8, 0x5a, sizeof(rxbuf) - reply_bits / 8);
+		vpads[channel].partial++;
+		return reply_bits;
+	}
+
+	return count;
+}
+
+/* Identifies the controller from its id like the real one */
+int gcn64_detectController(void)
+{
+	unsigned char tmp = GC_GETID;
+	int count;
+
+	count = gcn64_transaction(&tmp, 1);
+	if (count == GCN64_PREEMPTED)
+		return GCN64_PREEMPTED;
+	if (count == 0)
+		return CONTROLLER_IS_ABSENT;
+	if (count != GC_GETID_REPLY_LENGTH)
+		return CONTROLLER_IS_UNKNOWN;
+
+	switch (rxbuf[0] & 0x0f) {
+		case 0x05:
+			return CONTROLLER_IS_N64;
+		case 0x09:
+		case 0x0b:
+			return CONTROLLER_IS_GC;
+		case 0x08:
+			return rxbuf[1] == 0x20 ? CONTROLLER_IS_GC_KEYBOARD : CONTROLLER_IS_GC;
+	}
+
+	return CONTROLLER_IS_UNKNOWN;
+}
+
+unsigned char gcn64_protocol_getByte(int offset)
+{
+	return rxbuf[offset >> 3];
+}
+
+void gcn64_protocol_getBytes(int offset, int n_bytes, unsigned char *dstbuf)
+{
+	memcpy(dstbuf, rxbuf + (offset >> 3), n_bytes);
+}
+
+/* Plug a gamecube controller, at rest (stick centered on 0x80). Like
+ * a real one, it asks for its origin to be read. */
+static void vpadGamecube(unsigned char pad)
+{
+	static const unsigned char id[3] = { 0x09, 0x00, 0x20 };
+	struct vpad *vp = &vpads[pad];
+
+	memset(vp, 0, sizeof(*vp));
+	vp->type = CONTROLLER_IS_GC;
+	memcpy(vp->id, id, 3);
+	vp->status[1] = ST1_ALWAYS;
+	memset(vp->status + 2, 0x80, 4);
+	vp->origin[1] = ST1_ALWAYS;
+	memset(vp->origin + 2, 0x80, 4);
+	vp->need_origin = 1;
+}
+
+/* Plug an N64 controller (no pack), at rest */
+static void vpadN64(unsigned char pad)
+{
+	static const unsigned char id[3] = { 0x05, 0x00, 0x00 };
+	struct vpad *vp = &vpads[pad];
+
+	memset(vp, 0, sizeof(*vp));
+	vp->type = CONTROLLER_IS_N64;
+	memcpy(vp->id, id, 3);
+}
+
+/* Status reply of an N64 controller: buttons, and signed stick */
+static void vpadN64Set(unsigned char pad, unsigned char b0, unsigned char b1,
+						signed char x, signed char y)
+{
+	struct vpad *vp = &vpads[pad];
+
+	vp->status[0] = b0;
+	vp->status[1] = b1;
+	vp->status[2] = x;
+	vp->status[3] = y;
+}
+
+static void vpadOrigin(unsigned char pad, unsigned char x, unsigned char y)
+{
+	vpads[pad].origin[2] = x;
+	vpads[pad].origin[3] = y;
+}
+
+/* Number of times a command was received since the log was cleared */
+static int vpadCommands(unsigned char pad, unsigned char cmd)
+{
+	int i, n = 0;
+
+	for (i=0; i<vpads[pad].n_log; i++) {
+		if (vpads[pad].log[i] == cmd)
+			n++;
+	}
+
+	return n;
+}
+
+static void vpadSet(unsigned char pad, unsigned char st0, unsigned char st1,
+					unsigned char x, unsigned char y)
+{
+	struct vpad *vp = &vpads[pad];
+
+	vp->status[0] = st0;
+	vp->status[1] = st1 | ST1_ALWAYS;
+	vp->status[2] = x;
+	vp->status[3] = y;
+}
+
+/**** Checks ****/
+
+static int failures;
+static const char *cur_test;
+
+static void check(int ok, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (ok)
+		return;
+
+	failures++;
+	printf("FAIL %s: ", cur_test);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+}
+
+/* The main loop, as far as the controllers are concerned: a poll, and
+ * optionally the start of a frame before it. Returns what
+ * gamepadUpdate() returned. */
+static char poll(void)
+{
+	char res;
+
+	res = gamepadUpdate();
+	if (res == 0)
+		mapPads();
+	publishOutput();
+
+	return res;
+}
+
+static char frameAndPoll(void)
+{
+	mapNextFrame();
+	return poll();
+}
+
+/* Buttons pressed in what the NES reads for a controller */
+static PadMask nesPressed(unsigned char pad)
+{
+	volatile unsigned char *src = out_bytes[out_buf];
+	PadMask dat;
+
+#ifdef FOUR_SCORE
+	if (pad)
+		return (unsigned char)~src[OUT_PORT2];
+#endif
+	dat = src[0];
+#if PAD_BITS > 8
+	dat = dat << 8 | src[1];
+	// PadMask is wider than 16 bits on the host
+	return ~dat & 0xffff;
+#else
+	return (PadMask)~dat;
+#endif
+}
+
+/* Unplug a controller, and poll until it is considered lost
+ * (GC_LOST_FAILURES). Returns how many of the polls succeeded. */
+static int unplug(unsigned char pad)
+{
+	int i, n = 0;
+
+	vpads[pad].type = CONTROLLER_IS_ABSENT;
+	for (i=0; i<GC_LOST_FAILURES; i++) {
+		if (poll() == 0)
+			n++;
+	}
+
+	return n;
+}
+
+/* Unplug the controllers and plug a gamecube controller at rest in
+ * the first port, so the sessions (gamecube.c) start over. With
+ * FOUR_SCORE, the second port stays empty unless a test plugs it: the
+ * result of a poll is then that of the first controller. */
+static void replug(void)
+{
+	unsigned char pad;
+	int i;
+
+	for (pad=0; pad<GC_NUM_PADS; pad++) {
+		vpads[pad].type = CONTROLLER_IS_ABSENT;
+	}
+	for (i=0; i<GC_LOST_FAILURES; i++) {
+		gamepadUpdate();
+	}
+	vpadGamecube(0);
+}
+
+/* Power on with the given buttons held */
+static void powerOn(unsigned char st0)
+{
+	replug();
+	vpadSet(0, st0, 0, 0x80, 0x80);
+
+	gamepadInit();
+	gamepadUpdate();
+	gamepadReport(0, gc_report[0]);
+	profile_init(gc_report[0]);
+	publishOutput();
+}
+
+/**** Tests ****/
+
+/* Each button of the status reply to its report bit (gamecube.h) */
+static void testReportButtons(void)
+{
+	static const struct {
+		unsigned char st0, st1;
+		unsigned char byte, mask;
+	} buttons[] = {
+		{ ST0_START, 0, 6, 0x01 },
+		{ ST0_Y, 0, 6, 0x02 },
+		{ ST0_X, 0, 6, 0x04 },
+		{ ST0_B, 0, 6, 0x08 },
+		{ ST0_A, 0, 6, 0x10 },
+		{ 0, ST1_L, 6, 0x20 },
+		{ 0, ST1_R, 6, 0x40 },
+		{ 0, ST1_Z, 6, 0x80 },
+		{ 0, ST1_UP, 7, 0x01 },
+		{ 0, ST1_DOWN, 7, 0x02 },
+		{ 0, ST1_RIGHT, 7, 0x04 },
+		{ 0, ST1_LEFT, 7, 0x08 },
+	};
+	unsigned char i, *report = gc_last_report[0];
+
+	cur_test = "report_buttons";
+	powerOn(0);
+
+	for (i=0; i<sizeof(buttons)/sizeof(buttons[0]); i++) {
+		vpadSet(0, buttons[i].st0, buttons[i].st1, 0x80, 0x80);
+		check(gamepadUpdate() == 0, "button %d: update failed", i);
+		check(report[6] == (buttons[i].byte == 6 ? buttons[i].mask : 0) &&
+				report[7] == (buttons[i].byte == 7 ? buttons[i].mask : 0),
+				"button %d: report %02x %02x", i, report[6], report[7]);
+	}
+}
+
+/* Stick position relative to the origin, Y inverted */
+static void testReportStick(void)
+{
+	unsigned char *report = gc_last_report[0];
+
+	cur_test = "report_stick";
+	replug();
+	vpadOrigin(0, 0x84, 0x7a); // Off-center at rest
+	vpadSet(0, 0, 0, 0x84, 0x7a);
+	gamepadInit();
+	gamepadUpdate();
+	check(report[0] == 0x80 && report[1] == 0x7f, "rest %02x %02x", report[0], report[1]);
+
+	vpadSet(0, 0, 0, 0x84 + 0x30, 0x7a + 0x20); // Right and up
+	gamepadUpdate();
+	check(report[0] == 0xb0 && report[1] == (0xa0 ^ 0xff), "right-up %02x %02x",
+			report[0], report[1]);
+
+	vpadSet(0, 0, 0, 0x00, 0xff); // Clamped
+	gamepadUpdate();
+	check(report[0] == 0x00 && report[1] == 0x00, "clamped %02x %02x", report[0], report[1]);
+}
+
+/* The origin is read once per session and when the controller asks
+ * for it, and the stick is relative to it meanwhile. */
+static void testOrigin(void)
+{
+	struct vpad *vp = &vpads[0];
+	unsigned char *report = gc_last_report[0];
+	int i;
+
+	cur_test = "origin";
+	replug();
+	vpadOrigin(0, 0x70, 0x90);
+	vpadSet(0, 0, 0, 0x70 + 0x40, 0x90);
+	for (i=0; i<8; i++) {
+		check(gamepadUpdate() == 0, "poll %d failed", i);
+		check(report[0] == 0xc0 && report[1] == 0x7f, "poll %d: %02x %02x", i,
+				report[0], report[1]);
+	}
+	check(vpadCommands(0, GC_GETORIGIN) == 1, "origin read %d times",
+			vpadCommands(0, GC_GETORIGIN));
+
+	// Held X+Y+Start: new rest position, and the get origin bit
+	vpadOrigin(0, 0x80, 0x80);
+	vp->need_origin = 1;
+	gamepadUpdate();
+	check(report[0] == 0xc0, "report with the get origin bit: %02x", report[0]);
+	gamepadUpdate();
+	check(report[0] == 0xb0, "after the new origin: %02x", report[0]);
+	check(vpadCommands(0, GC_GETORIGIN) == 2, "origin read %d times",
+			vpadCommands(0, GC_GETORIGIN));
+
+	// Reading the origin preempted: tried again, same session
+	vp->need_origin = 1;
+	gamepadUpdate();
+	vp->n_log = 0;
+	vp->preempt = 1;
+	check(gamepadUpdate() != 0, "preempted origin read succeeded");
+	check(gamepadUpdate() == 0, "poll after a preempted origin read failed");
+	check(vp->n_log == 3 && vp->log[0] == GC_GETORIGIN && vp->log[1] == GC_GETORIGIN &&
+			vp->log[2] == GC_GETSTATUS1, "commands after a preempted origin read: %d",
+			vp->n_log);
+}
+
+/* A controller which stops answering is identified again, and its
+ * buttons released, but not after fewer than GC_LOST_FAILURES bad
+ * replies in a row. */
+static void testUnplug(void)
+{
+	struct vpad *vp = &vpads[0];
+	int i, round;
+
+	cur_test = "unplug";
+	powerOn(0);
+	check(poll() == 0, "first poll failed");
+
+	// Glitches: the same session, and A stays pressed
+	vpadSet(0, ST0_A, 0, 0x80, 0x80);
+	poll();
+	for (round=0; round<2; round++) {
+		vp->type = CONTROLLER_IS_ABSENT;
+		for (i=0; i<GC_LOST_FAILURES-1; i++) {
+			check(poll() != 0, "glitch %d succeeded", i);
+			check(nesPressed(0) == OUT_A, "glitch %d: %02x pressed", i, nesPressed(0));
+		}
+		vp->type = CONTROLLER_IS_GC;
+		vp->n_log = 0;
+		check(poll() == 0, "poll after the glitches failed");
+		check(vp->n_log == 1 && vp->log[0] == GC_GETSTATUS1,
+				"commands after the glitches: %d", vp->n_log);
+		check(nesPressed(0) == OUT_A, "after the glitches: %02x pressed", nesPressed(0));
+	}
+
+	// Lost: at rest
+	vp->type = CONTROLLER_IS_ABSENT;
+	for (i=0; i<GC_LOST_FAILURES; i++) {
+		poll();
+	}
+	check(gc_last_report[0][6] == 0, "lost: %02x pressed", gc_last_report[0][6]);
+	vpadSet(0, 0, 0, 0x80, 0x80);
+
+	check(unplug(0) == 0, "poll of an absent controller succeeded");
+
+	vpadGamecube(0);
+	vp->n_log = 0;
+	check(poll() == 0, "poll after replugging failed");
+	check(vp->n_log == 3 && vp->log[0] == GC_GETID && vp->log[1] == GC_GETORIGIN &&
+			vp->log[2] == GC_GETSTATUS1, "commands after replugging: %d", vp->n_log);
+
+	// Identification preempted: tried again at the next poll
+	unplug(0);
+	vpadGamecube(0);
+	vp->preempt = 1;
+	check(poll() != 0, "preempted identification succeeded");
+	check(vp->n_log == 1 && vp->log[0] == GC_GETID, "commands of a preempted identification: %d",
+			vp->n_log);
+	vp->n_log = 0;
+	check(poll() == 0, "poll after a preempted identification failed");
+	check(vp->n_log == 3 && vp->log[0] == GC_GETID && vp->log[1] == GC_GETORIGIN &&
+			vp->log[2] == GC_GETSTATUS1, "commands after a preempted identification: %d",
+			vp->n_log);
+}
+
+/* A WaveBird receiver is asked for its id at each poll until it wakes
+ * up (0xA8 becomes 0xE9), then only read. Whether or not it answers
+ * the other commands meanwhile. */
+static void testWavebird(void)
+{
+	struct vpad *vp = &vpads[0];
+	int answer, i;
+
+	cur_test = "wavebird";
+
+	for (answer=0; answer<2; answer++) {
+		powerOn(0);
+		unplug(0);
+		vpadGamecube(0);
+		memcpy(vp->id, "\xa8\x00\x00", 3);
+		vp->asleep = 1;
+		vp->answer_asleep = answer;
+
+		// Controller off: polls succeed only if the receiver answers
+		for (i=0; i<4; i++) {
+			check((poll() == 0) == answer, "answer %d: off, poll %d", answer, i);
+		}
+		check(vpadCommands(0, GC_GETID) == 4, "answer %d: off: %d ids in 4 polls", answer,
+				vpadCommands(0, GC_GETID));
+
+		// Turned on: woken up by the next id request, identified by the
+		// one after
+		vp->wake = 1;
+		vp->n_log = 0;
+		for (i=0; i<2; i++) {
+			check(poll() == 0, "answer %d: waking up, poll %d failed", answer, i);
+		}
+		check(!vp->asleep, "answer %d: not woken up", answer);
+		check(vpadCommands(0, GC_GETID) == 2, "answer %d: %d ids to wake up", answer,
+				vpadCommands(0, GC_GETID));
+
+		// Then only read
+		vp->n_log = 0;
+		for (i=0; i<8; i++) {
+			check(poll() == 0, "answer %d: on, poll %d failed", answer, i);
+		}
+		check(vp->n_log == 8 && vpadCommands(0, GC_GETSTATUS1) == 8,
+				"answer %d: on: %d commands, %d status", answer, vp->n_log,
+				vpadCommands(0, GC_GETSTATUS1));
+	}
+}
+
+/* N64 status reply (see n64.c) */
+#define N64_0_A			0x80
+#define N64_0_B			0x40
+#define N64_0_Z			0x20
+#define N64_0_START		0x10
+#define N64_0_UP		0x08
+#define N64_0_DOWN		0x04
+#define N64_0_LEFT		0x02
+#define N64_0_RIGHT		0x01
+#define N64_1_L			0x20
+#define N64_1_R			0x10
+#define N64_1_C_UP		0x08
+#define N64_1_C_DOWN	0x04
+#define N64_1_C_LEFT	0x02
+#define N64_1_C_RIGHT	0x01
+
+/* An N64 controller is identified, read with its own status command,
+ * and its reply decoded into a gamecube report. */
+static void testN64(void)
+{
+	static const struct {
+		unsigned char b0, b1;
+		unsigned char byte, mask; // Report bit (gamecube.h)
+	} buttons[] = {
+		{ N64_0_START, 0, 6, 0x01 },
+		{ 0, N64_1_C_LEFT, 6, 0x02 }, // Y
+		{ 0, N64_1_C_DOWN, 6, 0x04 }, // X
+		{ N64_0_B, 0, 6, 0x08 },
+		{ N64_0_A, 0, 6, 0x10 },
+		{ 0, N64_1_L, 6, 0x20 },
+		{ 0, N64_1_R, 6, 0x40 },
+		{ N64_0_Z, 0, 6, 0x80 },
+		{ N64_0_UP, 0, 7, 0x01 },
+		{ N64_0_DOWN, 0, 7, 0x02 },
+		{ N64_0_RIGHT, 0, 7, 0x04 },
+		{ N64_0_LEFT, 0, 7, 0x08 },
+		{ 0, N64_1_C_UP, 0, 0 },
+		{ 0, N64_1_C_RIGHT, 0, 0 },
+	};
+	struct vpad *vp = &vpads[0];
+	unsigned char i, *report = gc_last_report[0];
+
+	cur_test = "n64";
+	powerOn(0);
+	unplug(0);
+	vpadN64(0);
+
+	check(poll() == 0, "first poll failed");
+	check(vp->n_log == 2 && vp->log[0] == GC_GETID && vp->log[1] == N64_GET_STATUS,
+			"commands: %d", vp->n_log);
+	check(report[0] == 0x80 && report[1] == 0x7f && report[2] == 0x80 && report[3] == 0x7f &&
+			report[4] == 0xff && report[5] == 0xff && !report[6] && !report[7],
+			"at rest: %02x %02x %02x %02x %02x %02x %02x %02x", report[0], report[1],
+			report[2], report[3], report[4], report[5], report[6], report[7]);
+
+	for (i=0; i<sizeof(buttons)/sizeof(buttons[0]); i++) {
+		vpadN64Set(0, buttons[i].b0, buttons[i].b1, 0, 0);
+		check(gamepadUpdate() == 0, "button %d: update failed", i);
+		check(report[6] == (buttons[i].byte == 6 ? buttons[i].mask : 0) &&
+				report[7] == (buttons[i].byte == 7 ? buttons[i].mask : 0),
+				"button %d: report %02x %02x", i, report[6], report[7]);
+	}
+
+	// C buttons as a digital C stick, L and R as the analog triggers
+	vpadN64Set(0, 0, N64_1_C_LEFT | N64_1_C_UP | N64_1_L, 0, 0);
+	gamepadUpdate();
+	check(report[2] == 0x00 && report[3] == 0x00 && report[4] == 0x00 && report[5] == 0xff,
+			"C left-up, L: %02x %02x %02x %02x", report[2], report[3], report[4], report[5]);
+	vpadN64Set(0, 0, N64_1_C_RIGHT | N64_1_C_DOWN | N64_1_R, 0, 0);
+	gamepadUpdate();
+	check(report[2] == 0xff && report[3] == 0xff && report[4] == 0xff && report[5] == 0x00,
+			"C right-down, R: %02x %02x %02x %02x", report[2], report[3], report[4], report[5]);
+
+	// Stick scaled by 5/4 (rounded down), clamped
+	vpadN64Set(0, 0, 0, 80, 80);
+	gamepadUpdate();
+	check(report[0] == 0x80 + 100 && report[1] == ((0x80 + 100) ^ 0xff), "80,80: %02x %02x",
+			report[0], report[1]);
+	vpadN64Set(0, 0, 0, -80, -3);
+	gamepadUpdate();
+	check(report[0] == 0x80 - 100 && report[1] == ((0x80 - 4) ^ 0xff), "-80,-3: %02x %02x",
+			report[0], report[1]);
+	vpadN64Set(0, 0, 0, 127, -128);
+	gamepadUpdate();
+	check(report[0] == 0xff && report[1] == 0xff, "127,-128: %02x %02x", report[0], report[1]);
+
+	// Through the default profile
+	vpadN64Set(0, N64_0_A | N64_0_Z, 0, -80, 0);
+	poll();
+	check(nesPressed(0) == (OUT_A | OUT_SELECT | PAD_LEFT), "A Z left: %02x", nesPressed(0));
+
+	// Unplugged: identified again
+	check(unplug(0) == 0, "poll of an absent controller succeeded");
+	vpadN64(0);
+	check(poll() == 0, "poll after replugging failed");
+	check(vp->n_log == 2 && vp->log[0] == GC_GETID && vp->log[1] == N64_GET_STATUS,
+			"commands after replugging: %d", vp->n_log);
+}
+
+/* Buttons only reads (continuously latching game): the buttons are
+ * updated and the rest of the report kept, once the session is
+ * established. */
+static void testButtonsOnly(void)
+{
+	struct vpad *vp = &vpads[0];
+	unsigned char *report = gc_last_report[0];
+	int i;
+
+	cur_test = "buttons_only";
+	replug();
+	check(gamepadUpdateButtons() != 0, "buttons read before identification");
+	check(vp->n_log == 0, "commands before identification: %d", vp->n_log);
+
+	vpadSet(0, 0, 0, 0xc0, 0x80);
+	check(gamepadUpdate() == 0, "first poll failed");
+	vpadSet(0, ST0_START | ST0_A, ST1_UP | ST1_Z, 0x40, 0xff);
+	vp->n_log = 0;
+	check(gamepadUpdateButtons() == 0, "buttons read failed");
+	check(vp->n_log == 1 && vp->log[0] == GC_GETSTATUS1 && vp->partial == 1,
+			"commands: %d, partial replies %d", vp->n_log, vp->partial);
+	check(report[6] == 0x91 && report[7] == 0x01, "buttons %02x %02x", report[6], report[7]);
+	check(report[0] == 0xc0 && report[1] == 0x7f, "stick %02x %02x", report[0], report[1]);
+	check(gamepadUpdate() == 0 && report[0] == 0x40, "stick after a poll %02x", report[0]);
+
+	// Preempted: same session
+	vp->preempt = 1;
+	check(gamepadUpdateButtons() != 0, "preempted buttons read succeeded");
+	vp->n_log = 0;
+	check(gamepadUpdateButtons() == 0, "buttons read after a preempted one failed");
+	check(vp->n_log == 1, "commands after a preempted buttons read: %d", vp->n_log);
+
+	// The get origin bit: read at the next poll
+	vp->need_origin = 1;
+	check(gamepadUpdateButtons() == 0, "buttons read with the get origin bit failed");
+	check(gamepadUpdateButtons() != 0, "buttons read while the origin is invalid");
+	vp->n_log = 0;
+	check(gamepadUpdate() == 0 && vp->n_log == 2 && vp->log[0] == GC_GETORIGIN,
+			"poll after the get origin bit: %d", vp->n_log);
+
+	// Unplugged: identified again at the next poll
+	vp->type = CONTROLLER_IS_ABSENT;
+	for (i=0; i<GC_LOST_FAILURES; i++) {
+		check(gamepadUpdateButtons() != 0, "buttons read of an absent controller succeeded");
+	}
+	vpadGamecube(0);
+	check(gamepadUpdateButtons() != 0, "buttons read before identifying again");
+	vp->n_log = 0;
+	check(gamepadUpdate() == 0 && vp->n_log == 3 && vp->log[0] == GC_GETID,
+			"poll after replugging: %d", vp->n_log);
+
+	// N64 controller
+	unplug(0);
+	vpadN64(0);
+	vpadN64Set(0, 0, 0, 80, 0);
+	check(gamepadUpdate() == 0, "N64 poll failed");
+	vpadN64Set(0, N64_0_START, N64_1_C_LEFT, -80, 0);
+	vp->n_log = 0;
+	check(gamepadUpdateButtons() == 0, "N64 buttons read failed");
+	check(vp->n_log == 1 && vp->log[0] == N64_GET_STATUS && vp->partial == 1,
+			"N64 commands: %d, partial replies %d", vp->n_log, vp->partial);
+	check(report[6] == 0x03 && report[2] == 0x00 && report[0] == 0x80 + 100,
+			"N64 buttons %02x, C stick %02x, stick %02x", report[6], report[2], report[0]);
+}
+
+#ifdef FOUR_SCORE
+/* The 24 bits the NES reads from a port, MSb first, as the console
+ * sees them (1: pressed). Port 2: the byte published, then what the
+ * SPI shift register received from MOSI (pull-up, nothing pressed)
+ * while sending it, then the signature port2Done() loads. */
+static void fourScoreRead(unsigned char port, unsigned char *read)
+{
+	volatile unsigned char *src = out_bytes[out_buf];
+	unsigned char bytes[3];
+	int i;
+
+	if (port) {
+		bytes[0] = src[OUT_PORT2];
+		bytes[1] = 0xff;
+		bytes[2] = FOUR_SCORE_SIG2;
+	} else {
+		memcpy(bytes, (unsigned char *)src, 3);
+	}
+	for (i=0; i<24; i++) {
+		read[i] = !(bytes[i / 8] & (0x80 >> (i % 8)));
+	}
+}
+
+/* Bits read from each port: player 1 or 2, player 3 or 4 (not
+ * connected), and the signature of the port (0001 0000 on port 1,
+ * 0010 0000 on port 2). */
+static void checkFourScore(PadMask player1, PadMask player2)
+{
+	unsigned char read[24], port;
+	int i, expected;
+
+	for (port=0; port<2; port++) {
+		fourScoreRead(port, read);
+		for (i=0; i<24; i++) {
+			if (i < 8)
+				expected = ((port ? player2 : player1) & PAD_MASK(i)) != 0;
+			else if (i < 16)
+				expected = 0;
+			else
+				expected = i == (port ? 18 : 19);
+			check(read[i] == expected, "port %d, bit %d read %d", port + 1, i + 1, read[i]);
+		}
+	}
+}
+
+/* Two controllers answering the Four Score protocol on both ports */
+static void testFourScore(void)
+{
+	cur_test = "four_score";
+	replug();
+	vpadGamecube(1);
+	check(poll() == 0, "first poll failed");
+	checkFourScore(0, 0);
+
+	vpadSet(0, ST0_A, ST1_UP, 0x80, 0x80);
+	vpadSet(1, ST0_B | ST0_START, ST1_Z, 0x80, 0x80);
+	vpads[0].n_log = vpads[1].n_log = 0;
+	check(poll() == 0, "poll failed");
+	check(vpads[0].n_log == 1 && vpads[0].log[0] == GC_GETSTATUS1 &&
+			vpads[1].n_log == 1 && vpads[1].log[0] == GC_GETSTATUS1,
+			"commands: %d, %d", vpads[0].n_log, vpads[1].n_log);
+	checkFourScore(OUT_A | PAD_UP, OUT_B | OUT_START | OUT_SELECT);
+
+	// One controller unplugged: the other one keeps working, and the
+	// buttons of the unplugged one are released
+	check(unplug(1) == GC_LOST_FAILURES, "poll with the second controller unplugged failed");
+	checkFourScore(OUT_A | PAD_UP, 0);
+	vpads[1].type = CONTROLLER_IS_GC;
+	vpadSet(1, ST0_B, 0, 0x80, 0x80);
+	check(unplug(0) == GC_LOST_FAILURES, "poll with the first controller unplugged failed");
+	check(poll() == 0, "poll with the first controller unplugged failed");
+	checkFourScore(0, OUT_B);
+}
+#endif
+
+/* A gamecube keyboard is not supported: it is only asked for its id. */
+static void testKeyboard(void)
+{
+	static const unsigned char id[3] = { 0x08, 0x20, 0x00 };
+	struct vpad *vp = &vpads[0];
+	int i;
+
+	cur_test = "keyboard";
+	powerOn(0);
+	unplug(0);
+	vpadGamecube(0);
+	vp->type = CONTROLLER_IS_GC_KEYBOARD;
+	memcpy(vp->id, id, 3);
+
+	for (i=0; i<4; i++) {
+		check(poll() != 0, "poll %d succeeded", i);
+	}
+	check(vpadCommands(0, GC_GETID) == 4 && vp->n_log == 4, "%d commands, %d ids", vp->n_log,
+			vpadCommands(0, GC_GETID));
+}
+
+/* Buttons and D-Pad of the default profile */
+static void testMappingButtons(void)
+{
+	cur_test = "mapping_buttons";
+	powerOn(0);
+
+	vpadSet(0, 0, 0, 0x80, 0x80);
+	poll();
+	check(nesPressed(0) == 0, "at rest %02x", nesPressed(0));
+
+	vpadSet(0, ST0_A | ST0_START, ST1_Z | ST1_UP, 0x80, 0x80);
+	poll();
+	check(nesPressed(0) == (OUT_A | OUT_START | OUT_SELECT | PAD_UP),
+			"A Start Z Up: %02x", nesPressed(0));
+
+	vpadSet(0, ST0_B, ST1_DOWN | ST1_LEFT, 0x80, 0x80);
+	poll();
+	check(nesPressed(0) == (OUT_B | PAD_DOWN | PAD_LEFT), "B Down Left: %02x", nesPressed(0));
+
+	vpadSet(0, ST0_X | ST0_Y, ST1_R, 0x80, 0x80);
+	poll();
+#ifdef SNES_OUTPUT
+	check(nesPressed(0) == (PAD_MASK(SNES_BIT_X) | PAD_MASK(SNES_BIT_Y) | PAD_MASK(SNES_BIT_R)),
+			"X Y R: %04x", nesPressed(0));
+#else
+	check(nesPressed(0) == 0, "X Y R: %02x", nesPressed(0));
+#endif
+
+	vpadSet(0, 0, 0, 0x80, 0x80);
+	poll();
+	check(nesPressed(0) == 0, "released %02x", nesPressed(0));
+}
+
+#ifdef SNES_OUTPUT
+/* What the SNES reads after a latch, one bit per clock pulse (1:
+ * pressed): the 16 bits published, then the 0s shifted in behind
+ * them (line low), read as 1 like a standard controller. */
+#define SNES_READ_BITS	20
+
+static void snesRead(unsigned char *read)
+{
+	volatile unsigned char *src = out_bytes[out_buf];
+	unsigned int dat = src[0] << 8 | src[1];
+	int i;
+
+	for (i=0; i<SNES_READ_BITS; i++) {
+		read[i] = i < 16 ? !(dat & (0x8000 >> i)) : 1;
+	}
+}
+
+/* Each gamecube button alone to its SNES bit, the controller ID (bits
+ * 13 to 16) not pressed. */
+static void testSnesRead(void)
+{
+	static const struct {
+		unsigned char st0, st1;
+		unsigned char bit;
+		const char *name;
+	} buttons[] = {
+		{ ST0_B, 0, SNES_BIT_B, "B" },
+		{ ST0_Y, 0, SNES_BIT_Y, "Y" },
+		{ 0, ST1_Z, SNES_BIT_SELECT, "Z" },
+		{ ST0_START, 0, SNES_BIT_START, "Start" },
+		{ 0, ST1_UP, SNES_BIT_UP, "Up" },
+		{ 0, ST1_DOWN, SNES_BIT_DOWN, "Down" },
+		{ 0, ST1_LEFT, SNES_BIT_LEFT, "Left" },
+		{ 0, ST1_RIGHT, SNES_BIT_RIGHT, "Right" },
+		{ ST0_A, 0, SNES_BIT_A, "A" },
+		{ ST0_X, 0, SNES_BIT_X, "X" },
+		{ 0, ST1_L, SNES_BIT_L, "L" },
+		{ 0, ST1_R, SNES_BIT_R, "R" },
+	};
+	unsigned char read[SNES_READ_BITS];
+	int i, b;
+
+	cur_test = "snes_read";
+	powerOn(0);
+
+	for (b=0; b<sizeof(buttons)/sizeof(buttons[0]); b++) {
+		vpadSet(0, buttons[b].st0, buttons[b].st1, 0x80, 0x80);
+		poll();
+		snesRead(read);
+		for (i=0; i<SNES_READ_BITS; i++) {
+			check(read[i] == (i == buttons[b].bit || i >= 16), "%s: bit %d read %d",
+					buttons[b].name, i + 1, read[i]);
+		}
+	}
+
+	// All of them: still nothing in the ID
+	vpadSet(0, ST0_A | ST0_B | ST0_X | ST0_Y | ST0_START,
+			ST1_L | ST1_R | ST1_Z | ST1_UP | ST1_LEFT, 0x80, 0x80);
+	poll();
+	snesRead(read);
+	for (i=12; i<16; i++) {
+		check(read[i] == 0, "all buttons: ID bit %d read 1", i + 1);
+	}
+}
+#endif
+
+/* Stick directions of the default profile: within the walk threshold
+ * nothing, beyond it the direction, both at 45 degrees. */
+static void testMappingStick(void)
+{
+	static const struct {
+		int dx, dy; // Stick up is positive
+		PadMask expected;
+	} positions[] = {
+		{ 0, 0, 0 },
+		{ 30, 0, 0 },
+		{ 100, 0, PAD_RIGHT },
+		{ -100, 0, PAD_LEFT },
+		{ 0, 100, PAD_UP },
+		{ 0, -100, PAD_DOWN },
+		{ 70, 70, PAD_UP | PAD_RIGHT },
+		{ -70, -70, PAD_DOWN | PAD_LEFT },
+		{ 100, 10, PAD_RIGHT },
+	};
+	unsigned char i;
+
+	cur_test = "mapping_stick";
+	powerOn(0);
+
+	for (i=0; i<sizeof(positions)/sizeof(positions[0]); i++) {
+		// From the center each time, so the hysteresis does not apply
+		vpadSet(0, 0, 0, 0x80, 0x80);
+		poll();
+		vpadSet(0, 0, 0, 0x80 + positions[i].dx, 0x80 + positions[i].dy);
+		poll();
+		check(nesPressed(0) == positions[i].expected, "%d,%d: %02x",
+				positions[i].dx, positions[i].dy, nesPressed(0));
+	}
+}
+
+/* While L is held, A and B alternate with the period of the profile,
+ * pressed for the first half, one step per frame. L is a button of
+ * the SNES, where the built-in profiles have no turbo. */
+static void testTurbo(void)
+{
+	unsigned char period, pressed;
+	int frame, start, on[64];
+
+	cur_test = "turbo";
+	powerOn(0);
+	period = turbo_period[OUT_BIT_A];
+	pressed = turbo_pressed[OUT_BIT_A];
+#ifdef SNES_OUTPUT
+	check(period == 0, "turbo on A in the default profile");
+
+	vpadSet(0, ST0_A, ST1_L, 0x80, 0x80);
+	for (frame=0; frame<16; frame++) {
+		frameAndPoll();
+		check(nesPressed(0) == (OUT_A | PAD_MASK(SNES_BIT_L)), "frame %d: %04x",
+				frame, nesPressed(0));
+	}
+	return;
+#endif
+	check(period >= 2, "no turbo on A in the default profile");
+
+	if (period < 2 || period > 16)
+		return;
+
+	vpadSet(0, ST0_A, ST1_L, 0x80, 0x80);
+	poll();
+	for (frame=0; frame<period*4; frame++) {
+		frameAndPoll();
+		// A second poll in the same frame changes nothing
+		poll();
+		on[frame] = (nesPressed(0) & OUT_A) != 0;
+	}
+
+	// From the first press, pressed for the first frames of each period
+	for (start=1; start<period*4 && !(on[start] && !on[start-1]); start++)
+		;
+	check(start <= period, "A not pressed again within %d frames", period);
+	for (frame=start; frame<period*4; frame++) {
+		check(on[frame] == ((frame - start) % period < pressed), "frame %d: A %d",
+				frame - start, on[frame]);
+	}
+
+	// Without L, A stays pressed
+	vpadSet(0, ST0_A, 0, 0x80, 0x80);
+	for (frame=0; frame<period; frame++) {
+		frameAndPoll();
+		check(nesPressed(0) & OUT_A, "frame %d without L: A released", frame);
+	}
+}
+
+/* Latch interrupt of the publication stress test: a signal, which
+ * like an AVR interrupt runs to completion between any two
+ * instructions of the main loop. The bytes read are checked by the
+ * main loop once the publication in progress is over. */
+#define STRESS_READS	4096
+
+static volatile unsigned char stress_read[STRESS_READS][OUT_BYTES];
+static volatile int n_stress_read;
+static volatile unsigned long stress_reads;
+
+static void stressLatch(int sig)
+{
+	volatile unsigned char *src = out_bytes[out_buf];
+	unsigned char i;
+
+	if (n_stress_read == STRESS_READS)
+		return;
+	for (i=0; i<OUT_BYTES; i++) {
+		stress_read[n_stress_read][i] = src[i];
+	}
+	n_stress_read++;
+	stress_reads++;
+}
+
+/* Every set of bytes the NES reads is a complete publication: either
+ * the previous one or the one in progress, never a mix of both. Random
+ * buttons, stick and turbo so that consecutive publications differ in
+ * many bits, with latches at random points of the polls. */
+static void testPublishStress(void)
+{
+	struct sigaction sa;
+	struct itimerval timer;
+	sigset_t latch_mask;
+	unsigned char prev[OUT_BYTES], cur[OUT_BYTES];
+	int i, j, bad = 0;
+
+	cur_test = "publish_stress";
+	powerOn(0);
+	srand(1);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stressLatch;
+	sigaction(SIGALRM, &sa, NULL);
+	sigemptyset(&latch_mask);
+	sigaddset(&latch_mask, SIGALRM);
+
+	memcpy(prev, (unsigned char *)out_bytes[out_buf], OUT_BYTES);
+	n_stress_read = 0;
+	stress_reads = 0;
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = 20;
+	timer.it_value = timer.it_interval;
+	setitimer(ITIMER_REAL, &timer, NULL);
+
+	for (i=0; i<300000 && !bad; i++) {
+		vpadSet(0, rand() & 0x1f, rand() & 0x7f, rand(), rand());
+		if (!(i & 7))
+			mapNextFrame();
+		poll();
+
+		sigprocmask(SIG_BLOCK, &latch_mask, NULL);
+		memcpy(cur, (unsigned char *)out_bytes[out_buf], OUT_BYTES);
+		for (j=0; j<n_stress_read; j++) {
+			if (memcmp((unsigned char *)stress_read[j], prev, OUT_BYTES) &&
+					memcmp((unsigned char *)stress_read[j], cur, OUT_BYTES)) {
+				check(0, "poll %d: read %02x, published %02x then %02x", i,
+						stress_read[j][0], prev[0], cur[0]);
+				bad = 1;
+				break;
+			}
+		}
+		n_stress_read = 0;
+		memcpy(prev, cur, OUT_BYTES);
+		sigprocmask(SIG_UNBLOCK, &latch_mask, NULL);
+	}
+
+	timer.it_value.tv_usec = 0;
+	timer.it_interval.tv_usec = 0;
+	setitimer(ITIMER_REAL, &timer, NULL);
+	signal(SIGALRM, SIG_DFL);
+
+	check(bad || stress_reads >= 1000, "only %lu latches", stress_reads);
+}
+
+#ifdef OVERSAMPLING
+/* Simulated time of the tap test, in CPU cycles, and Timer1 (port.h)
+ * for sync.c */
+#define CYCLES_PER_US	(F_CPU / 1000000)
+#define TIMER_PRESCALER	64
+
+static unsigned long long now, timer_start, timer_overflows_seen;
+
+void timer_init(void)
+{
+	timer_restart();
+}
+
+unsigned int timer_now(void)
+{
+	return ((now - timer_start) / TIMER_PRESCALER) & 0xffff;
+}
+
+void timer_restart(void)
+{
+	timer_start = now;
+	timer_overflows_seen = 0;
+}
+
+char timer_overflowed(void)
+{
+	unsigned long long overflows = (now - timer_start) / TIMER_PRESCALER >> 16;
+
+	if (overflows > timer_overflows_seen) {
+		timer_overflows_seen = overflows;
+		return 1;
+	}
+
+	return 0;
+}
+
+#define TAP_POLL_US		290
+#define TAP_PHASES		331
+#define TAP_FRAMES		4 // From a tap to the next
+
+static unsigned long long next_latch, tap_start, tap_end, tap_frame;
+static int tap_running, tap_seen;
+
+/* A transaction of the tap test, started now: it takes a whole poll,
+ * and the controller answers with A pressed during a tap. Returns
+ * non-zero if a latch disturbed it. Outside of the tap test, takes no
+ * time. */
+static int tapTransaction(void)
+{
+	unsigned long long end = now + TAP_POLL_US * CYCLES_PER_US;
+
+	if (!tap_running)
+		return 0;
+
+	vpadSet(0, now >= tap_start && now < tap_end ? ST0_A : 0, 0, 0x80, 0x80);
+	if (end > next_latch) {
+		now = next_latch;
+		return 1;
+	}
+	now = end;
+
+	return 0;
+}
+
+/* The NES of the tap test never latches continuously */
+char nes_latch_mask(void)
+{
+	return 0;
+}
+
+void nes_latch_unmask(void)
+{
+}
+
+/* The main loop of the firmware (mainloop.c), against a NES latching
+ * once per frame and reading the byte at once, until the given time.
+ * The latch interrupt is modelled between the iterations. */
+static void tapLoop(unsigned long long until)
+{
+	unsigned long long start;
+
+	while (now < until) {
+		if (now >= next_latch) {
+			if (nesPressed(0) & OUT_A)
+				tap_seen = 1;
+			next_latch += tap_frame;
+			latch_tcnt = timer_now();
+			if (nes_reuse != 0xff)
+				nes_reuse++;
+			g_nes_polled = 1;
+		} else {
+			start = now;
+			mainloop_step();
+			if (now == start)
+				now += TIMER_PRESCALER;
+		}
+	}
+}
+
+/* Taps of A from 1 to 3ms, starting anywhere in the frame, all reach
+ * the NES, read by a latch before the next tap. At several frame
+ * periods, as the extra polls fall at the same places in each frame. */
+static void testTaps(void)
+{
+	static const int tap_us[] = { 1000, 1500, 2000, 2500, 3000 };
+	static const int frame_us[] = { 16639, 16739, 16839, 16939, 19997 };
+	unsigned long long base;
+	int f, i, phase;
+
+	cur_test = "taps";
+
+	for (f=0; f<sizeof(frame_us)/sizeof(frame_us[0]); f++) {
+		powerOn(0);
+		now = 0;
+		tap_frame = frame_us[f] * CYCLES_PER_US;
+		next_latch = tap_frame;
+		sync_init();
+		mainloop_init();
+		g_nes_polled = 0;
+		nes_reuse = 0;
+		tap_running = 1;
+
+		// Until the frame period is known
+		base = 10 * tap_frame;
+		tap_start = tap_end = 0;
+		tapLoop(base);
+
+		for (i=0; i<sizeof(tap_us)/sizeof(tap_us[0]); i++) {
+			for (phase=0; phase<TAP_PHASES; phase++) {
+				tap_start = base + tap_frame * phase / TAP_PHASES;
+				tap_end = tap_start + tap_us[i] * CYCLES_PER_US;
+				tapLoop(tap_start);
+				tap_seen = 0;
+				base += TAP_FRAMES * tap_frame;
+				tapLoop(base);
+				check(tap_seen, "frame %dus: %dus tap at %d/%d of the frame not seen",
+						frame_us[f], tap_us[i], phase, TAP_PHASES);
+			}
+		}
+		tap_running = 0;
+	}
+}
+#endif
+
+/* Whether the gate table of the current profile is that of these
+ * joystick parameters, decided in floating point by tools/gate.c */
+static int gateIsStick(int walk, int run, int diagonal, int hysteresis)
+{
+	double c = (1 << GATE_SHIFT) / 2.0 - 0.5; // Center of a cell
+	int x, y;
+
+	for (y=0; y<GATE_CELLS; y++) {
+		for (x=0; x<GATE_CELLS; x++) {
+			if (profile_gate[y][x] != gateCell((x << GATE_SHIFT) + c, (y << GATE_SHIFT) + c,
+										walk, run, diagonal, hysteresis))
+				return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Whether the gate table of the current profile is that of a mapping */
+static int gateIs(unsigned char mapping)
+{
+	return gateIsStick(mappings[mapping].walk, mappings[mapping].run,
+						mappings[mapping].diagonal, mappings[mapping].hysteresis);
+}
+
+/* Directions (GATE_* bits) doMapping() presses for a stick position,
+ * coming from the center */
+static int stickGate(unsigned char x, unsigned char y)
+{
+	PadMask pressed;
+	int dirs = 0;
+
+	gc_report[0][0] = gc_report[0][1] = 0x80;
+	gc_report[0][6] = gc_report[0][7] = 0;
+	doMapping(0);
+	gc_report[0][0] = x;
+	gc_report[0][1] = y;
+	doMapping(0);
+	publishOutput();
+
+	pressed = nesPressed(0);
+	if (pressed & (x < 0x80 ? PAD_LEFT : PAD_RIGHT))
+		dirs |= GATE_HORIZ;
+	if (pressed & (y < 0x80 ? PAD_UP : PAD_DOWN))
+		dirs |= GATE_VERT;
+	if (pressed & PAD_RUN)
+		dirs |= GATE_RUN;
+	// Nothing else
+	if (pressed & ~((x < 0x80 ? PAD_LEFT : PAD_RIGHT) | (y < 0x80 ? PAD_UP : PAD_DOWN) | PAD_RUN))
+		dirs |= 0x80;
+
+	return dirs;
+}
+
+/* The gate table lookups of doMapping() against the floating point
+ * decision the tables are built like, at every stick position. The
+ * tables are decided at the center of cells of 8x8 positions, so
+ * where they differ, the lookup must be the decision of another
+ * position of the same cell. */
+static void testGateTable(void)
+{
+	unsigned char m;
+	int x, y, ax, ay, cx, cy, dirs, ref, found;
+	double walk, run, half_diagonal;
+
+	cur_test = "gate_table";
+	powerOn(0);
+
+	for (m=0; m<NUM_MAPPINGS; m++) {
+		check(gateIs(m), "mapping %d not selected", m);
+		walk = mappings[m].walk;
+		run = mappings[m].run;
+		half_diagonal = mappings[m].diagonal / 2.0;
+
+		for (y=0; y<256; y++) {
+			for (x=0; x<256; x++) {
+				// Offsets as doMapping() computes them (one's complement)
+				ax = x < 0x80 ? 0x7f - x : x - 0x80;
+				ay = y < 0x80 ? 0x7f - y : y - 0x80;
+
+				dirs = stickGate(x, y);
+				ref = gateDecide(ax, ay, walk, run, half_diagonal);
+				if (dirs == ref)
+					continue;
+
+				found = 0;
+				for (cy = ay & ~7; cy < (ay | 7) + 1 && !found; cy++) {
+					for (cx = ax & ~7; cx < (ax | 7) + 1 && !found; cx++) {
+						found = gateDecide(cx, cy, walk, run, half_diagonal) == dirs;
+					}
+				}
+				check(found, "mapping %d at %02x,%02x: %02x, expected %02x", m, x, y,
+						dirs, ref);
+			}
+		}
+
+		switchProfile(1);
+	}
+}
+
+/* The gate tables built from joystick parameters (in integers, by
+ * profile.c) against the floating point decision at the cell centers,
+ * over the range of the parameters. */
+static void testGateBuild(void)
+{
+	static const int runs[] = { 0, 64, 127 };
+	struct profile_stick stick;
+	int walk, diagonal, hysteresis, i, run;
+
+	cur_test = "gate_build";
+
+	for (walk=1; walk<=127; walk+=3) {
+		for (diagonal=0; diagonal<=90; diagonal+=5) {
+			for (hysteresis=0; hysteresis<=walk; hysteresis += hysteresis < 16 ? 4 : walk) {
+				for (i=0; i<3; i++) {
+					run = runs[i];
+					gateStick(&stick, walk, run, diagonal, hysteresis);
+					buildGate(&stick);
+					check(gateIsStick(walk, run, diagonal, hysteresis),
+							"walk %d run %d diagonal %d hysteresis %d", walk, run,
+							diagonal, hysteresis);
+				}
+			}
+		}
+	}
+}
+
+/* Noise of +/- NOISE positions, deterministic */
+#define NOISE	3
+
+static int noise(void)
+{
+	static unsigned int seed = 1;
+
+	seed = seed * 1103515245 + 12345;
+	return (int)((seed >> 16) % (2 * NOISE + 1)) - NOISE;
+}
+
+/* Move the stick along a path through doMapping(), with noise on both
+ * axes, and count the changes of each output bit. The path is at
+ * radius r0 to r1 and angle a0 to a1 (degrees, 0: right, 90: up), in
+ * steps of a quarter position, then back. */
+static void sweep(double r0, double r1, double a0, double a1, int *changes)
+{
+	int i, n, steps, x, y, bit;
+	double t, r, a;
+	PadMask pressed, prev = 0;
+
+	n = fabs(r1 - r0) > fabs(a1 - a0) ? fabs(r1 - r0) * 4 : fabs(a1 - a0) * 4;
+	steps = 2 * n;
+	memset(changes, 0, PAD_BITS * sizeof(int));
+
+	for (i=0; i<=steps; i++) {
+		t = i <= n ? (double)i / n : (double)(steps - i) / n;
+		r = r0 + (r1 - r0) * t;
+		a = (a0 + (a1 - a0) * t) * M_PI / 180.0;
+		x = 0x80 + (int)lround(r * cos(a)) + noise();
+		y = 0x80 - (int)lround(r * sin(a)) + noise(); // Report Y is inverted
+		gc_report[0][0] = x < 0 ? 0 : x > 0xff ? 0xff : x;
+		gc_report[0][1] = y < 0 ? 0 : y > 0xff ? 0xff : y;
+		gc_report[0][6] = gc_report[0][7] = 0;
+		doMapping(0);
+		publishOutput();
+
+		pressed = nesPressed(0);
+		if (i > 0) {
+			for (bit=0; bit<PAD_BITS; bit++) {
+				if ((pressed ^ prev) & PAD_MASK(bit))
+					changes[bit]++;
+			}
+		}
+		prev = pressed;
+	}
+}
+
+/* Bit number of a mask (PAD_MASK) */
+static int padBit(PadMask mask)
+{
+	int bit;
+
+	for (bit=0; bit<PAD_BITS && PAD_MASK(bit) != mask; bit++)
+		;
+
+	return bit;
+}
+
+/* A noisy stick slowly crossing a threshold, or the edge of the
+ * diagonal zone, presses and releases each direction once, in every
+ * mapping (the noise is less than the hysteresis). */
+static void testHysteresis(void)
+{
+	static const struct {
+		double r0, r1, a0, a1; // Path (see sweep)
+		PadMask once; // Change twice (there and back), the others never
+	} paths[] = {
+		{ 0, 127, 0, 0, PAD_RIGHT },
+		{ 0, 127, 180, 180, PAD_LEFT },
+		{ 0, 127, 90, 90, PAD_UP },
+		{ 0, 127, 270, 270, PAD_DOWN },
+		{ 0, 127, 45, 45, PAD_RIGHT | PAD_UP },
+		{ 100, 100, 0, 89, PAD_RIGHT | PAD_UP },
+		{ 100, 100, 91, 180, PAD_UP | PAD_LEFT },
+		{ 100, 100, 181, 269, PAD_LEFT | PAD_DOWN },
+	};
+	PadMask dirs = PAD_UP | PAD_DOWN | PAD_LEFT | PAD_RIGHT;
+	int changes[PAD_BITS], bit, expected;
+	unsigned char m, i;
+
+	cur_test = "hysteresis";
+	powerOn(0);
+
+	for (m=0; m<NUM_MAPPINGS; m++) {
+		check(gateIs(m), "mapping %d not selected", m);
+
+		for (i=0; i<sizeof(paths)/sizeof(paths[0]); i++) {
+			sweep(paths[i].r0, paths[i].r1, paths[i].a0, paths[i].a1, changes);
+			for (bit=0; bit<PAD_BITS; bit++) {
+				if (!(dirs & PAD_MASK(bit)))
+					continue;
+				expected = paths[i].once & PAD_MASK(bit) ? 2 : 0;
+				check(changes[bit] == expected, "mapping %d path %d: bit %d changed %d times", m, i, bit, changes[bit]);
+			}
+		}
+
+		// Run, along each axis
+		if (mappings[m].run) {
+			sweep(0, 127, 0, 0, changes);
+			check(changes[padBit(PAD_RUN)] == 2, "mapping %d: run changed %d times", m,
+					changes[padBit(PAD_RUN)]);
+			sweep(0, 127, 90, 90, changes);
+			check(changes[padBit(PAD_RUN)] == 2, "mapping %d: run changed %d times (up)", m,
+					changes[padBit(PAD_RUN)]);
+		}
+
+		switchProfile(1);
+	}
+}
+
+/* Stick at x, y (report values), the directions the NES gets */
+static PadMask stickAt(int x, int y)
+{
+	gc_report[0][0] = x;
+	gc_report[0][1] = y;
+	gc_report[0][6] = gc_report[0][7] = 0;
+	doMapping(0);
+	publishOutput();
+
+	return nesPressed(0) & (PAD_RIGHT | PAD_LEFT | PAD_UP | PAD_DOWN);
+}
+
+/* A direction is only held on the side it was pressed on: jumping
+ * between two polls from one side of an axis to the hysteresis zone
+ * of the other side presses nothing. */
+static void testHoldSide(void)
+{
+	static const struct {
+		int dx, dy; // Unit vector, stick up is positive
+		PadMask dir, opposite;
+	} axes[] = {
+		{ 1, 0, PAD_RIGHT, PAD_LEFT },
+		{ -1, 0, PAD_LEFT, PAD_RIGHT },
+		{ 0, 1, PAD_UP, PAD_DOWN },
+		{ 0, -1, PAD_DOWN, PAD_UP },
+	};
+	unsigned char m, i;
+	int hold, dx, dy;
+
+	cur_test = "hold_side";
+	powerOn(0);
+
+	for (m=0; m<NUM_MAPPINGS; m++) {
+		check(gateIs(m), "mapping %d not selected", m);
+		if (!mappings[m].hysteresis) {
+			switchProfile(1);
+			continue;
+		}
+		// In the hysteresis zone of the walk threshold
+		hold = mappings[m].walk - mappings[m].hysteresis / 2;
+
+		for (i=0; i<sizeof(axes)/sizeof(axes[0]); i++) {
+			dx = axes[i].dx;
+			dy = axes[i].dy;
+			stickAt(0x80, 0x80);
+			check(stickAt(0x80 - dx * hold, 0x80 + dy * hold) == 0,
+					"mapping %d axis %d: pressed from the center", m, i);
+			check(stickAt(0x80 + dx * 127, 0x80 - dy * 127) == axes[i].dir,
+					"mapping %d axis %d: not pressed", m, i);
+			check(stickAt(0x80 - dx * hold, 0x80 + dy * hold) == 0,
+					"mapping %d axis %d: opposite pressed from the other side", m, i);
+			check(stickAt(0x80 + dx * 127, 0x80 - dy * 127) == axes[i].dir,
+					"mapping %d axis %d: not pressed again", m, i);
+			check(stickAt(0x80 + dx * hold, 0x80 - dy * hold) == axes[i].dir,
+					"mapping %d axis %d: not held", m, i);
+		}
+		stickAt(0x80, 0x80);
+
+		switchProfile(1);
+	}
+}
+
+/* Image with the given profiles (profile.h) in port_eeprom */
+static void writeProfiles(const struct profile *profiles, unsigned char n, unsigned char flags)
+{
+	unsigned int size = PROFILE_IMAGE_SIZE(n), i;
+	unsigned char sum = 0;
+
+	memset(port_eeprom, 0xff, sizeof(port_eeprom));
+	port_eeprom[0] = PROFILE_MAGIC1;
+	port_eeprom[1] = PROFILE_MAGIC2;
+	port_eeprom[2] = PROFILE_VERSION;
+	port_eeprom[3] = flags;
+	port_eeprom[4] = n;
+	memcpy(port_eeprom + PROFILE_HEADER_SIZE, profiles, n * sizeof(struct profile));
+	for (i=2; i<size-1; i++)
+		sum += port_eeprom[i];
+	port_eeprom[size - 1] = sum;
+}
+
+/* Built-in profiles selected at power on and by switchProfile() */
+static void testBuiltinProfiles(void)
+{
+	unsigned char i;
+
+	cur_test = "builtin_profiles";
+	memset(port_eeprom, 0xff, sizeof(port_eeprom));
+
+	powerOn(0);
+	check(gateIs(MAPPING_DEFAULT), "default mapping not selected");
+	powerOn(ST0_B);
+	check(gateIs(MAPPING_LOWER_THRESHOLD), "B: lower threshold not selected");
+	powerOn(ST0_A);
+	check(gateIs(MAPPING_AUTORUN), "A: auto run not selected");
+
+	powerOn(0);
+	for (i=1; i<=NUM_MAPPINGS; i++) {
+		switchProfile(1);
+		check(gateIs(i % NUM_MAPPINGS), "next %d", i);
+	}
+	switchProfile(0);
+	check(gateIs(NUM_MAPPINGS - 1), "previous from the first");
+}
+
+/* Profiles from the EEPROM replace the built-in ones if the image is
+ * valid for this build. */
+static void testEepromProfiles(void)
+{
+	struct profile p[2];
+	unsigned char b;
+
+	cur_test = "eeprom_profiles";
+
+	// Swapped A and B, no turbo. Then A on every button, with a wide
+	// diagonal zone and a high threshold.
+	memset(p, 0, sizeof(p));
+	gateStick(&p[0].stick, mappings[MAPPING_LOWER_THRESHOLD].walk,
+				mappings[MAPPING_LOWER_THRESHOLD].run,
+				mappings[MAPPING_LOWER_THRESHOLD].diagonal,
+				mappings[MAPPING_LOWER_THRESHOLD].hysteresis);
+	p[0].buttons[3][0] = 1 << NES_BIT_A; // B
+	p[0].buttons[4][0] = 1 << NES_BIT_B; // A
+	gateStick(&p[1].stick, 100, 0, 70, 4);
+	for (b=0; b<PROFILE_GC_BUTTONS; b++)
+		p[1].buttons[b][0] = 1 << NES_BIT_A;
+
+#ifdef SNES_OUTPUT
+	writeProfiles(p, 2, PROFILE_FLAG_SNES);
+#else
+	writeProfiles(p, 2, 0);
+#endif
+	powerOn(0);
+	check(gateIs(MAPPING_LOWER_THRESHOLD), "first profile gate");
+	vpadSet(0, ST0_A, 0, 0x80, 0x80);
+	poll();
+	check(nesPressed(0) == PAD_MASK(NES_BIT_B), "A: %02x", nesPressed(0));
+	frameAndPoll();
+	check(turbo_period[NES_BIT_A] == 0, "turbo period %d", turbo_period[NES_BIT_A]);
+
+	switchProfile(1);
+	vpadSet(0, 0, ST1_R, 0x80, 0x80);
+	poll();
+	check(nesPressed(0) == PAD_MASK(NES_BIT_A), "R in the second profile: %02x", nesPressed(0));
+	check(gateIsStick(100, 0, 70, 4), "second profile gate");
+	vpadSet(0, 0, 0, 0x80 + 90, 0x80); // Below the threshold
+	poll();
+	check(nesPressed(0) == 0, "stick right 90: %02x", nesPressed(0));
+	vpadSet(0, 0, 0, 0x80 + 100, 0x80 + 30); // 17 degrees up: diagonal
+	poll();
+	check(nesPressed(0) == (PAD_RIGHT | PAD_UP), "stick right 100 up 30: %02x", nesPressed(0));
+	switchProfile(1);
+	check(gateIs(MAPPING_LOWER_THRESHOLD), "wraps after 2 profiles");
+
+	// Holding A selects the third profile, which does not exist
+	powerOn(ST0_A);
+	check(gateIs(MAPPING_LOWER_THRESHOLD), "A held: not the first profile");
+
+	// Bad checksum
+	port_eeprom[PROFILE_IMAGE_SIZE(2) - 1]++;
+	powerOn(0);
+	check(gateIs(MAPPING_DEFAULT), "bad checksum: image used");
+
+	// Image for the other console
+#ifdef SNES_OUTPUT
+	writeProfiles(p, 2, 0);
+#else
+	writeProfiles(p, 2, PROFILE_FLAG_SNES);
+#endif
+	powerOn(0);
+	check(gateIs(MAPPING_DEFAULT), "other console: image used");
+
+	memset(port_eeprom, 0xff, sizeof(port_eeprom));
+}
+
+/* Load the profiles of an EEPROM image with profile.c, and print them
+ * in the text format (see profiles.txt). The joystick parameters are
+ * those of the image, once the gate table built from them is checked. */
+static int printProfiles(const char *filename)
+{
+	const char **out_names = PROFILE_FLAGS & PROFILE_FLAG_SNES ? snes_names : nes_names;
+	struct profile p;
+	unsigned char n, i, b, bit;
+	PadMask mask;
+	FILE *fptr;
+
+	fptr = fopen(filename, "rb");
+	if (!fptr) {
+		perror(filename);
+		return 1;
+	}
+	memset(port_eeprom, 0xff, sizeof(port_eeprom));
+	fread(port_eeprom, 1, sizeof(port_eeprom), fptr);
+	fclose(fptr);
+
+	n = eeprom_profiles = eepromProfiles();
+	if (!n) {
+		fprintf(stderr, "%s: image not accepted\n", filename);
+		return 1;
+	}
+
+	printf("output %s\n", PROFILE_FLAGS & PROFILE_FLAG_SNES ? "snes" : "nes");
+	for (i=0; i<n; i++) {
+		loadProfile(i);
+		eeprom_get_block(&p, PROFILE_HEADER_SIZE + i * sizeof(struct profile), sizeof(p));
+		if (!gateIsStick(p.stick.walk, p.stick.run, p.stick.diagonal, p.stick.hysteresis)) {
+			fprintf(stderr, "%s: profile %d: wrong gate table\n", filename, i + 1);
+			return 1;
+		}
+
+		printf("\nprofile %d\n", i + 1);
+		printf("joystick %d %d %d %d\n", p.stick.walk, p.stick.run, p.stick.diagonal,
+				p.stick.hysteresis);
+		for (b=0; b<PROFILE_GC_BUTTONS; b++) {
+			if (b < 4) {
+				mask = btn1_lo_table[1 << b];
+			} else if (b < 8) {
+				mask = btn1_hi_table[1 << (b - 4)];
+			} else {
+				mask = btn2_table[1 << (b - 8)];
+			}
+			if (!mask)
+				continue;
+			printf("button %s", gc_names[b]);
+			for (bit=0; bit<PAD_BITS; bit++) {
+				if (mask & PAD_MASK(bit))
+					printf(" %s", out_names[bit]);
+			}
+			printf("\n");
+		}
+		for (bit=0; bit<PAD_BITS; bit++) {
+			if (turbo_period[bit])
+				printf("turbo %s %d\n", out_names[bit], turbo_period[bit]);
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc == 3 && !strcmp(argv[1], "-p"))
+		return printProfiles(argv[2]);
+	if (argc != 1) {
+		printf("Usage: ./padtest [-p image.eep]\n");
+		return 1;
+	}
+
+	memset(port_eeprom, 0xff, sizeof(port_eeprom));
+
+	testReportButtons();
+	testReportStick();
+	testOrigin();
+	testUnplug();
+	testWavebird();
+	testN64();
+	testButtonsOnly();
+#ifdef FOUR_SCORE
+	testFourScore();
+#endif
+	testKeyboard();
+	testMappingButtons();
+	testMappingStick();
+#ifdef SNES_OUTPUT
+	testSnesRead();
+#endif
+	testTurbo();
+	testPublishStress();
+#ifdef OVERSAMPLING
+	testTaps();
+#endif
+	testGateTable();
+	testGateBuild();
+	testHysteresis();
+	testHoldSide();
+	testBuiltinProfiles();
+	testEepromProfiles();
+
+	if (failures) {
+		printf("%d failed checks\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
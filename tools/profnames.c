@@ -0,0 +1,77 @@
+/*  GC to NES : Gamecube controller to NES adapter
+    Copyright (C) 2012-2016  Raphael Assenat <raph@raphnet.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stddef.h>
+#include <strings.h>
+#include "profnames.h"
+
+const char *gc_names[PROFILE_GC_BUTTONS] = {
+	"START", "Y", "X", "B", "A", "L", "R", "Z",
+	"D_UP", "D_DOWN", "D_RIGHT", "D_LEFT",
+};
+
+const char *nes_names[PROFILE_BITS] = {
+	[NES_BIT_A] = "A",
+	[NES_BIT_B] = "B",
+	[NES_BIT_SELECT] = "SELECT",
+	[NES_BIT_START] = "START",
+	[NES_BIT_UP] = "UP",
+	[NES_BIT_DOWN] = "DOWN",
+	[NES_BIT_LEFT] = "LEFT",
+	[NES_BIT_RIGHT] = "RIGHT",
+};
+
+const char *snes_names[PROFILE_BITS] = {
+	[SNES_BIT_B] = "B",
+	[SNES_BIT_Y] = "Y",
+	[SNES_BIT_SELECT] = "SELECT",
+	[SNES_BIT_START] = "START",
+	[SNES_BIT_UP] = "UP",
+	[SNES_BIT_DOWN] = "DOWN",
+	[SNES_BIT_LEFT] = "LEFT",
+	[SNES_BIT_RIGHT] = "RIGHT",
+	[SNES_BIT_A] = "A",
+	[SNES_BIT_X] = "X",
+	[SNES_BIT_L] = "L",
+	[SNES_BIT_R] = "R",
+};
+
+const struct mapping_params mappings[] = {
+#define BUTTON(gc_get, nes_bit)
+#define SNES_BUTTON(gc_get, snes_bit)
+#define TURBO(nes_bit, period)
+#define SNES_TURBO(snes_bit, period)
+#define MAPPING(name, walk, run, diagonal, hysteresis) { #name, walk, run, diagonal, hysteresis },
+#include "../mappings.def"
+#undef BUTTON
+#undef SNES_BUTTON
+#undef TURBO
+#undef SNES_TURBO
+#undef MAPPING
+};
+const int num_mappings = sizeof(mappings) / sizeof(mappings[0]);
+
+int lookup(const char *name, const char **names, int count)
+{
+	int i;
+
+	for (i=0; i<count; i++) {
+		if (names[i] && !strcasecmp(name, names[i]))
+			return i;
+	}
+
+	return -1;
+}
@@ -0,0 +1,26 @@
+#ifndef _profnames_h__
+#define _profnames_h__
+
+#include "../profile.h"
+
+/* Names of the profile text format (see profiles.txt), for
+ * tools/mkprofile and tools/padtest */
+
+// Gamecube buttons, in profile.h order
+extern const char *gc_names[PROFILE_GC_BUTTONS];
+// NES and SNES buttons, by bit (NULL: unused bit)
+extern const char *nes_names[PROFILE_BITS];
+extern const char *snes_names[PROFILE_BITS];
+
+// The MAPPING entries of mappings.def
+struct mapping_params {
+	const char *name;
+	int walk, run, diagonal, hysteresis;
+};
+extern const struct mapping_params mappings[];
+extern const int num_mappings;
+
+/* Index of a name (case insensitive), or -1 */
+int lookup(const char *name, const char **names, int count);
+
+#endif // _profnames_h__
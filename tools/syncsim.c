@@ -0,0 +1,944 @@
+/*  GC to NES : Gamecube controller to NES adapter
+    Copyright (C) 2012-2016  Raphael Assenat <raph@raphnet.net>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Run the poll scheduler (sync.c) on the host against a simulated NES
+ * and controller, and report how old the samples read by the NES are.
+ *
+ * sync.c and the main loop of the firmware (mainloop.c) are built with
+ * PORT_HOST (see port.h): Timer1 is derived from a simulated CPU cycle
+ * counter. mainloop_step() runs as is, between the latches; what it
+ * calls and the latch interrupt are modelled as follows:
+ *
+ *  - The NES latches at a fixed frame period (with optional jitter and
+ *    lag frames), one or several times per frame. Each latch keeps the
+ *    main loop busy for the duration of the read (latch interrupt),
+ *    then sets g_nes_polled, latch_tcnt and nes_reuse like the
+ *    interrupt.
+ *  - gamepadUpdate() takes a fixed time. A latch during a poll
+ *    disturbs it: it is retried up to GCN64_MAX_RETRIES times, as
+ *    gcn64_transaction does, and the disturbed attempts are added to
+ *    gcn64_stats.lost_time. With two controllers (-P 2, FOUR_SCORE),
+ *    they are read one after the other, which takes twice as long.
+ *  - gamepadUpdateButtons() (quick poll, continuous latching) is
+ *    disturbed and retried like a poll, and the controller is busy
+ *    sending the rest of its reply for poll - quick poll duration
+ *    afterwards, which the next transaction waits for.
+ *  - Without -s, nes_latch_mask() masks the latch interrupt: the
+ *    latches are then not answered and do not disturb the poll, and
+ *    the NES reads nothing pressed (masked latches).
+ *  - Turbo advances at each mapNextFrame(). Every latch of a frame must
+ *    see the same turbo buttons, and each of them must be pressed for
+ *    half of any period of frames (turbo errors). The other mapping
+ *    functions do nothing: each successful read publishes a new byte.
+ *  - The sample age is the time between the end of the first
+ *    controller read of the last successful poll (the oldest sample)
+ *    and the first latch of a frame. The input latency is the
+ *    number of latches from a press to the first latch answered with
+ *    it, in the worst case: the press just missed a poll.
+ *
+ * Instead of a fixed number of latches, the reads of a frame can be
+ * given by a trace file (-t, see loadTrace). The duration of each
+ * read then follows from its clock timing and from the timeout of the
+ * latch interrupt, which also tells whether the interrupt gives up
+ * before the game is done clocking (lost bits), and whether the clock
+ * is too fast for the bits it sends (wrong bits). A latch occuring while
+ * the interrupt is still busy restarts it (relatch).
+ *
+ * With -s, the NES is answered by the SPI peripheral (NES_SPI_OUTPUT):
+ * the latch interrupt only loads SPDR, and the bits the console
+ * samples are checked against a model of the SPI slave shift register
+ * (see spiRead), clocked like the reads of the trace.
+ *
+ * Everything is deterministic for a given seed (-r).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../port.h"
+#include "../sync.h"
+#include "../instrument.h"
+#include "../gcn64_protocol.h"
+#include "../gamepad.h"
+#include "../mapping.h"
+#include "../mainloop.h"
+
+/* The latch interrupt waits for each clock falling edge with 172
+ * unrolled clock and latch checks (main.c), 5 cycles each. */
+#define ISR_TIMEOUT_CYCLES	(172 * 5)
+
+/* Latch interrupt, worst case from a clock falling edge to the next
+ * bit on the data line: the edge seen one check late, the shift and
+ * the port write, after the load of the next byte in the bit before
+ * (main.c, about 30 cycles). The console samples the line at the next
+ * clock pulse, taken as half a clock period later at the earliest. */
+#define ISR_BIT_CYCLES		30
+
+/* NES_SPI_OUTPUT latch interrupt: about 60 cycles from the latch to
+ * the return, SPDR loaded after about 30 (vector, prologue, load). */
+#define SPI_ISR_CYCLES		60
+#define SPI_LOAD_CYCLES		30
+
+/* The level shifted in from MOSI, which has a pull-down (README). */
+#define SPI_MOSI_LEVEL		0
+
+/* Width of the NES latch pulse. SS is low, and the SPI shift register
+ * live, once it is over. */
+#define LATCH_US			12
+
+#define CYCLES_PER_US		(F_CPU / 1000000.0)
+#define TIMER_PRESCALER		64
+
+/* Sample age histogram, in bins of AGE_BIN_US */
+#define AGE_BIN_US			10
+#define AGE_BINS			4096
+
+/* Simulated time, in CPU cycles */
+static unsigned long long now;
+
+/* Timer1 (port.h) */
+static unsigned long long timer_start;
+static unsigned long long timer_overflows_seen;
+
+void timer_init(void)
+{
+	timer_restart();
+}
+
+unsigned int timer_now(void)
+{
+	return ((now - timer_start) / TIMER_PRESCALER) & 0xffff;
+}
+
+void timer_restart(void)
+{
+	timer_start = now;
+	timer_overflows_seen = 0;
+}
+
+char timer_overflowed(void)
+{
+	unsigned long long overflows = (now - timer_start) / TIMER_PRESCALER >> 16;
+
+	if (overflows > timer_overflows_seen) {
+		timer_overflows_seen = overflows;
+		return 1;
+	}
+
+	return 0;
+}
+
+#ifdef INSTRUMENTATION
+void instr_init(void) { }
+void instr_record(unsigned char id, unsigned int ticks) { }
+void instr_sample(unsigned int now) { }
+void instr_latch(unsigned int now) { }
+void instr_count(unsigned char id) { }
+void instr_dump(void) { }
+#endif
+
+/* Simulation parameters, in microseconds */
+static double frame_us = 16639.3; // NTSC
+static int latches = 1;
+static double latch_gap_us = 1000;
+static double jitter_us = 0;
+static double lag_percent = 0;
+static double read_us = 110;
+static double poll_us = 300;
+static double quick_us = 170; // Command and 16 bits of reply
+static double timeout_us = ISR_TIMEOUT_CYCLES / CYCLES_PER_US;
+static int out_bits = 8;
+static int pads = 1;
+static int spi;
+
+/* The reads of a frame */
+#define MAX_READS	512
+
+struct nes_read {
+	double offset_us; // From the first latch of the frame
+	double read_us; // Latch interrupt duration
+	int lost_bits; // Bits still to send when the interrupt gave up
+	int late_bits; // Bits on the data line too late for the console
+	int bits; // Clock pulses
+	double clock_us; // Clock period
+};
+
+static struct nes_read pattern[MAX_READS];
+static int pattern_len;
+
+static unsigned long long cycles(double us)
+{
+	return us * CYCLES_PER_US + 0.5;
+}
+
+/* Results */
+static unsigned long frames, n_latches, polls, preempted, dropped, stale;
+static unsigned int poll_time_max; // Worst sync_stats.last_poll_time
+static unsigned long quick, relatches, lost_bits, masked_latches;
+static unsigned long aged_frames, wrong_bits, input_latches_max;
+static unsigned long turbo_errors;
+static unsigned long age_bins[AGE_BINS];
+static double age_min = -1, age_max, age_sum;
+
+/* Bounds given by the trace file (see loadTrace) */
+#define MAX_EXPECTS	16
+
+static struct {
+	char name[32];
+	double max, max_spi;
+} expects[MAX_EXPECTS];
+static int n_expects;
+
+/* The output the trace is for (see loadTrace), 0 if any */
+#define OUTPUT_SPI			1
+#define OUTPUT_FOUR_SCORE	2
+#define OUTPUT_SNES			3
+
+static int trace_output;
+
+/* Latch schedule */
+static double frame_start_us, frame_jitter_us;
+static unsigned long long next_latch;
+static int latch_in_frame;
+
+
+/* The latch interrupt is masked (nes_latch_mask) */
+static int latch_masked;
+
+/* End of the reply a quick poll did not wait for */
+static unsigned long long line_busy;
+
+/* Latches counted at the start of the poll whose data is published and
+ * of the previous one, and whether a latch answered since */
+static unsigned long published_from, previous_from;
+static int answered;
+
+/* Last successful poll */
+static unsigned long long sample_time;
+static int sample_read;
+
+/* The byte published by the last successful poll, a different one each
+ * time, and the SPI shift register (-s) */
+static unsigned char published = 0xff, spi_reg;
+
+/* Turbo (see mapping.c): buttons of period 2, 3, 4 and 6 frames (30,
+ * 20, 15 and 10Hz), pressed for the first half of each period. The
+ * positions advance at the frame starts sync_master_polled_us()
+ * reports, each poll publishes the buttons pressed, and the
+ * latches of a frame must all see the same ones. */
+#define TURBO_BUTTONS	4
+
+static const int turbo_period[TURBO_BUTTONS] = { 2, 3, 4, 6 };
+static int turbo_pos[TURBO_BUTTONS];
+static unsigned char turbo_published, turbo_frame;
+/* Turbo buttons pressed in the last frames read, by frames % 8 */
+static unsigned char turbo_history[8];
+
+static double randomUs(double range)
+{
+	return range * (2.0 * rand() / RAND_MAX - 1.0);
+}
+
+static void scheduleFrame(void)
+{
+	do {
+		frame_start_us += frame_us;
+	} while (lag_percent > 0 && 100.0 * rand() / RAND_MAX < lag_percent);
+
+	latch_in_frame = 0;
+	frame_jitter_us = randomUs(jitter_us);
+	next_latch = cycles(frame_start_us + frame_jitter_us);
+}
+
+static void recordAge(void)
+{
+	double age = (now - sample_time) / CYCLES_PER_US;
+	int bin = age / AGE_BIN_US;
+
+	if (bin >= AGE_BINS)
+		bin = AGE_BINS - 1;
+	age_bins[bin]++;
+	age_sum += age;
+	if (age_min < 0 || age < age_min)
+		age_min = age;
+	if (age > age_max)
+		age_max = age;
+	aged_frames++;
+}
+
+/* The NES started a new frame: like turboNextFrame in mapping.c */
+static void turboNextFrame(void)
+{
+	int i;
+
+	for (i=0; i<TURBO_BUTTONS; i++) {
+		turbo_pos[i]++;
+		if (turbo_pos[i] >= turbo_period[i])
+			turbo_pos[i] = 0;
+	}
+}
+
+static unsigned char turboPressed(void)
+{
+	unsigned char bits = 0;
+	int i;
+
+	for (i=0; i<TURBO_BUTTONS; i++) {
+		if (turbo_pos[i] < turbo_period[i] / 2)
+			bits |= 1 << i;
+	}
+
+	return bits;
+}
+
+/* Turbo buttons seen by a latch. Over any period of frames read, each
+ * button must be pressed for half of the frames. */
+static void turboLatch(void)
+{
+	int i, f, n;
+
+	if (latch_in_frame) {
+		if (turbo_published != turbo_frame)
+			turbo_errors++;
+		return;
+	}
+
+	turbo_frame = turbo_published;
+	turbo_history[frames % 8] = turbo_frame;
+	for (i=0; i<TURBO_BUTTONS; i++) {
+		if (frames < turbo_period[i])
+			continue;
+		for (f=0, n=0; f<turbo_period[i]; f++) {
+			if (turbo_history[(frames - f) % 8] & (1 << i))
+				n++;
+		}
+		if (n != turbo_period[i] / 2) {
+			turbo_errors++;
+			break;
+		}
+	}
+}
+
+/* The console reads the SPI output (-s). The latch interrupt loads the
+ * published byte in SPDR, which must be done
+ * before the latch falls. The console samples the MSb of the shift
+ * register before each clock pulse. The falling edge samples MOSI, the
+ * rising edge shifts it in (CPOL=1, CPHA=0), so once the 8 bits are
+ * out, the MOSI level follows. Those bits must be low, like the 4021
+ * of an original controller whose serial input is grounded. */
+static void spiRead(const struct nes_read *rd)
+{
+	int bit, expected;
+
+	if (SPI_LOAD_CYCLES < cycles(LATCH_US))
+		spi_reg = published;
+
+	for (bit=0; bit<rd->bits; bit++) {
+		expected = bit < 8 ? (published >> (7 - bit)) & 1 : 0;
+		// The SPI slave needs each clock level for more than 2 cycles
+		if ((spi_reg >> 7) != expected || cycles(rd->clock_us / 2) <= 2)
+			wrong_bits++;
+		spi_reg = (spi_reg << 1) | SPI_MOSI_LEVEL;
+	}
+}
+
+/* The NES latches the controller (at next_latch). Returns the read
+ * which follows, and moves on to the next one. */
+static const struct nes_read *nesLatch(void)
+{
+	const struct nes_read *rd = &pattern[latch_in_frame];
+	unsigned long latency;
+
+	n_latches++;
+	if (latch_in_frame == 0)
+		frames++;
+
+	if (latch_masked) {
+		// Nothing pressed, and no sample read
+		masked_latches++;
+	} else {
+		if (spi)
+			spiRead(rd);
+		turboLatch();
+
+		// A press right after the start of the previous poll is seen by
+		// the first latch answered with the published one. Until then,
+		// one right after the start of the published poll is not seen.
+		latency = n_latches - (answered ? published_from : previous_from);
+		if (latency > input_latches_max)
+			input_latches_max = latency;
+		answered = 1;
+
+		if (latch_in_frame == 0) {
+			recordAge();
+			if (sample_read)
+				stale++;
+			sample_read = 1;
+		}
+	}
+
+	latch_in_frame++;
+	if (latch_in_frame < pattern_len) {
+		next_latch = cycles(frame_start_us + frame_jitter_us + pattern[latch_in_frame].offset_us);
+	} else {
+		scheduleFrame();
+	}
+
+	return rd;
+}
+
+/* The latch interrupt answers the NES */
+static void latch(void)
+{
+	const struct nes_read *rd;
+	unsigned long long end;
+
+	now = next_latch;
+	if (nes_reuse != 0xff)
+		nes_reuse++;
+
+	while (1) {
+		latch_tcnt = timer_now();
+		rd = nesLatch();
+		end = now + (spi ? SPI_ISR_CYCLES : cycles(rd->read_us));
+		if (next_latch >= end)
+			break;
+
+		// Latched again before the end of the read
+		relatches++;
+		now = next_latch;
+	}
+
+	if (!spi) {
+		lost_bits += rd->lost_bits;
+		wrong_bits += rd->late_bits;
+	}
+	now = end;
+	g_nes_polled = 1;
+}
+
+/* A poll, or a quick poll (buttons only). Like the transactions, it
+ * first waits for the end of a reply a quick poll left. Returns 0 on
+ * success, like gamepadUpdate(). */
+static char poll(int buttons)
+{
+	unsigned long long start, attempt, end;
+	unsigned long start_latches;
+	int retries = 0;
+
+	if (buttons) {
+		quick++;
+	} else {
+		polls++;
+	}
+
+	while (1) {
+		if (now < line_busy)
+			now = line_busy;
+		if (!retries) {
+			start = now;
+			start_latches = n_latches;
+		}
+		attempt = now;
+		end = now + cycles((buttons ? quick_us : poll_us) * pads);
+		while (latch_masked && next_latch < end)
+			nesLatch();
+		if (end <= next_latch)
+			break;
+
+		preempted++;
+		latch();
+		if (retries == GCN64_MAX_RETRIES) {
+			dropped++;
+			gcn64_stats.dropped++;
+			gcn64_stats.lost_time += (now - start) / TIMER_PRESCALER;
+			return 1;
+		}
+		retries++;
+	}
+
+	now = end;
+	gcn64_stats.lost_time += (attempt - start) / TIMER_PRESCALER;
+	if (buttons)
+		line_busy = now + cycles(poll_us - quick_us);
+	previous_from = published_from;
+	published_from = start_latches;
+	answered = 0;
+	// The first controller read is the oldest sample
+	sample_time = attempt + cycles(buttons ? quick_us : poll_us);
+	sample_read = 0;
+	published = published * 5 + 59;
+	turbo_published = turboPressed();
+
+	return 0;
+}
+
+/* The controller driver (gamepad.h) and the mapping code (mapping.h),
+ * as far as mainloop_step() is concerned */
+Gcn64Stats gcn64_stats;
+unsigned char gc_report[GC_NUM_PADS][GCN64_REPORT_SIZE];
+
+char gamecubeUpdate(void)
+{
+	return poll(0);
+}
+
+char gamecubeUpdateButtons(void)
+{
+	return poll(1);
+}
+
+void mapNextFrame(void)
+{
+	turboNextFrame();
+}
+
+char nes_latch_mask(void)
+{
+	if (spi)
+		return 0;
+	latch_masked = 1;
+
+	return 1;
+}
+
+void nes_latch_unmask(void)
+{
+	latch_masked = 0;
+}
+
+void mapPads(void) { }
+void publishOutput(void) { }
+void switchProfile(char next) { }
+
+static double agePercentile(double p)
+{
+	unsigned long count = 0;
+	int i;
+
+	for (i=0; i<AGE_BINS; i++) {
+		count += age_bins[i];
+		if (count >= p * aged_frames)
+			return (i + 1) * AGE_BIN_US;
+	}
+
+	return age_max;
+}
+
+/* A read of bits clock pulses, period clock_us, the first one delay_us
+ * after the latch (one period if 0). The interrupt sends out_bits bits,
+ * and gives up when a clock falling edge does not come within
+ * timeout_us. */
+static struct nes_read timedRead(double offset_us, int bits, double clock_us, double delay_us)
+{
+	struct nes_read rd = { offset_us, 0, 0, 0, bits, clock_us };
+	double wait_us = delay_us > 0 ? delay_us : clock_us;
+	int bit;
+
+	// The first bit is out before the first clock pulse
+	if (bits > 1 && cycles(clock_us / 2) <= ISR_BIT_CYCLES)
+		rd.late_bits = (bits < out_bits ? bits : out_bits) - 1;
+
+	for (bit=0; bit<out_bits; bit++) {
+		if (bit == bits) {
+			// The game is done, wait for the timeout
+			rd.read_us += timeout_us;
+			return rd;
+		}
+		if (wait_us > timeout_us) {
+			rd.read_us += timeout_us;
+			rd.lost_bits = out_bits - bit;
+			return rd;
+		}
+		rd.read_us += wait_us;
+		wait_us = clock_us;
+	}
+
+	return rd;
+}
+
+/* The value of a result by name, for the bounds of a trace file.
+ * Returns -1 if there is no such result. */
+static int resultValue(const char *name, double *value)
+{
+	if (!strcmp(name, "stale_frames"))
+		*value = stale;
+	else if (!strcmp(name, "dropped_polls"))
+		*value = dropped;
+	else if (!strcmp(name, "relatches"))
+		*value = relatches;
+	else if (!strcmp(name, "lost_bits"))
+		*value = lost_bits;
+	else if (!strcmp(name, "wrong_bits"))
+		*value = wrong_bits;
+	else if (!strcmp(name, "age_p99"))
+		*value = agePercentile(0.99);
+	else if (!strcmp(name, "age_max"))
+		*value = age_max;
+	else if (!strcmp(name, "input_latches_max"))
+		*value = input_latches_max;
+	else if (!strcmp(name, "turbo_errors"))
+		*value = turbo_errors;
+	else if (!strcmp(name, "masked_latches"))
+		*value = masked_latches;
+	else
+		return -1;
+
+	return 0;
+}
+
+/* Returns the number of results above their bound */
+static int checkExpects(void)
+{
+	double value, max;
+	int i, failed = 0;
+
+	for (i=0; i<n_expects; i++) {
+		resultValue(expects[i].name, &value);
+		max = spi ? expects[i].max_spi : expects[i].max;
+		if (value > max) {
+			printf("# FAILED: %s %.0f, expected at most %.0f\n",
+					expects[i].name, value, max);
+			failed++;
+		}
+	}
+
+	return failed;
+}
+
+/* Set the bound of a result, replacing any previous one. Returns -1 if
+ * there is no such result or too many bounds. */
+static int setExpect(const char *name, double max, double max_spi)
+{
+	double value;
+	int i;
+
+	if (strlen(name) >= sizeof(expects[0].name) || resultValue(name, &value))
+		return -1;
+
+	for (i=0; i<n_expects; i++) {
+		if (!strcmp(expects[i].name, name))
+			break;
+	}
+	if (i == MAX_EXPECTS)
+		return -1;
+	if (i == n_expects)
+		n_expects++;
+
+	strcpy(expects[i].name, name);
+	expects[i].max = max;
+	expects[i].max_spi = max_spi;
+
+	return 0;
+}
+
+/* Read the reads of a frame from a trace file (see traces/). Times in
+ * microseconds, # starts a comment:
+ *
+ *  frame <period>
+ *  latch <offset> <bits> <clock period> [<delay>]
+ *    A latch at offset from the first latch of the frame (which is at
+ *    0), then bits clock pulses, the first one delay after the latch.
+ *  repeat <count> <interval>
+ *    Repeat the previous latch count times, interval apart.
+ *  expect <result> <max> [<max with -s>]
+ *    Fail (exit status 1) if the result is above max. Lost bits and
+ *    stale frames must be 0 unless given another bound, and age_p99
+ *    must be bounded.
+ *  output spi
+ *    The game can only be served by the SPI output (-s). Without -s,
+ *    nothing is simulated.
+ *  output fourscore
+ *    The FOUR_SCORE build: 24 bits sent, two controllers read. Before
+ *    the latches. It has no SPI output, so with -s nothing is
+ *    simulated.
+ *  output snes
+ *    The SNES_OUTPUT build: 16 bits sent. Before the latches. No SPI
+ *    output either.
+ */
+static int loadTrace(const char *filename)
+{
+	FILE *fptr;
+	char buf[256], *tok;
+	int line = 0, count, bits, n;
+	double offset, clock, delay, interval, max, max_spi;
+
+	fptr = fopen(filename, "r");
+	if (!fptr) {
+		perror(filename);
+		return -1;
+	}
+
+	pattern_len = 0;
+	n_expects = 0;
+	setExpect("lost_bits", 0, 0);
+	setExpect("stale_frames", 0, 0);
+	setExpect("turbo_errors", 0, 0);
+
+	while (fgets(buf, sizeof(buf), fptr)) {
+		line++;
+		if (strchr(buf, '#'))
+			*strchr(buf, '#') = 0;
+
+		tok = strtok(buf, " \t\r\n");
+		if (!tok)
+			continue;
+
+		if (!strcmp(tok, "frame")) {
+			if (sscanf(tok + strlen(tok) + 1, "%lf", &frame_us) != 1 || frame_us <= 0)
+				goto syntax;
+		} else if (!strcmp(tok, "latch")) {
+			delay = 0;
+			if (sscanf(tok + strlen(tok) + 1, "%lf %d %lf %lf", &offset, &bits, &clock, &delay) < 3 ||
+					offset < 0 || bits < 0 || clock <= 0 || delay < 0)
+				goto syntax;
+			if (pattern_len && offset <= pattern[pattern_len-1].offset_us) {
+				fprintf(stderr, "%s:%d: Latches must be in time order\n", filename, line);
+				goto error;
+			}
+			if (pattern_len == MAX_READS)
+				goto too_many;
+			pattern[pattern_len++] = timedRead(offset, bits, clock, delay);
+		} else if (!strcmp(tok, "repeat")) {
+			if (sscanf(tok + strlen(tok) + 1, "%d %lf", &count, &interval) != 2 ||
+					!pattern_len || count < 1 || interval <= 0)
+				goto syntax;
+			while (count--) {
+				if (pattern_len == MAX_READS)
+					goto too_many;
+				pattern[pattern_len] = pattern[pattern_len-1];
+				pattern[pattern_len].offset_us += interval;
+				pattern_len++;
+			}
+		} else if (!strcmp(tok, "expect")) {
+			tok = strtok(NULL, " \t\r\n");
+			if (!tok)
+				goto syntax;
+			n = sscanf(tok + strlen(tok) + 1, "%lf %lf", &max, &max_spi);
+			if (n < 1)
+				goto syntax;
+			if (setExpect(tok, max, n == 2 ? max_spi : max)) {
+				fprintf(stderr, "%s:%d: Unknown result or too many bounds (max. %d)\n",
+						filename, line, MAX_EXPECTS);
+				goto error;
+			}
+		} else if (!strcmp(tok, "output")) {
+			tok = strtok(NULL, " \t\r\n");
+			if (!tok)
+				goto syntax;
+			if (!strcmp(tok, "spi")) {
+				trace_output = OUTPUT_SPI;
+			} else if (!strcmp(tok, "fourscore")) {
+				if (pattern_len)
+					goto output_late;
+				trace_output = OUTPUT_FOUR_SCORE;
+				out_bits = 24;
+				pads = 2;
+			} else if (!strcmp(tok, "snes")) {
+				if (pattern_len)
+					goto output_late;
+				trace_output = OUTPUT_SNES;
+				out_bits = 16;
+			} else {
+				goto syntax;
+			}
+		} else {
+			goto syntax;
+		}
+	}
+	fclose(fptr);
+
+	if (!pattern_len || pattern[0].offset_us != 0) {
+		fprintf(stderr, "%s: The first latch must be at 0\n", filename);
+		return -1;
+	}
+
+	for (n=0; n<n_expects; n++) {
+		if (!strcmp(expects[n].name, "age_p99"))
+			break;
+	}
+	if (n == n_expects) {
+		fprintf(stderr, "%s: No bound for age_p99 (expect age_p99 ...)\n", filename);
+		return -1;
+	}
+
+	return 0;
+
+output_late:
+	fprintf(stderr, "%s:%d: The output must be given before the latches\n", filename, line);
+	goto error;
+too_many:
+	fprintf(stderr, "%s:%d: Too many latches per frame (max. %d)\n", filename, line, MAX_READS);
+	goto error;
+syntax:
+	fprintf(stderr, "%s:%d: Syntax error\n", filename, line);
+error:
+	fclose(fptr);
+	return -1;
+}
+
+static void printUsage(void)
+{
+	printf("Usage: syncsim [options]\n");
+	printf("\n");
+	printf("Options:\n");
+	printf("  -n frames   Number of NES frames to simulate (default 100000)\n");
+	printf("  -f us       Frame period (default %.1f)\n", frame_us);
+	printf("  -l count    Latches per frame (default %d)\n", latches);
+	printf("  -g us       Time between the latches of a frame (default %.0f)\n", latch_gap_us);
+	printf("  -j us       Latch jitter, +/- (default %.0f)\n", jitter_us);
+	printf("  -L percent  Lag frames (no latch) (default %.0f)\n", lag_percent);
+	printf("  -R us       Time spent reading the controller per latch (default %.0f)\n", read_us);
+	printf("  -p us       Controller poll duration (default %.0f)\n", poll_us);
+	printf("  -q us       Buttons only poll duration (default %.0f)\n", quick_us);
+	printf("  -r seed     Random seed (default 1)\n");
+	printf("  -t file     Reads of a frame from a trace file, instead of -f -l -g -R\n");
+	printf("  -b bits     Bits sent per latch (default %d, 16 for SNES, 24 for the Four Score)\n", out_bits);
+	printf("  -T us       Latch interrupt timeout (default %.1f)\n", timeout_us);
+	printf("  -P count    Controllers read one after the other per poll (default 1, 2 for FOUR_SCORE)\n");
+	printf("  -s          SPI output (NES_SPI_OUTPUT), check the bits read\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long n = 100000;
+	unsigned int seed = 1;
+	const char *trace = NULL;
+	unsigned long long start;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "n:f:l:g:j:L:R:p:q:r:t:b:T:P:sh")) != -1) {
+		switch (opt) {
+			case 'n': n = strtoul(optarg, NULL, 0); break;
+			case 'f': frame_us = atof(optarg); break;
+			case 'l': latches = atoi(optarg); break;
+			case 'g': latch_gap_us = atof(optarg); break;
+			case 'j': jitter_us = atof(optarg); break;
+			case 'L': lag_percent = atof(optarg); break;
+			case 'R': read_us = atof(optarg); break;
+			case 'p': poll_us = atof(optarg); break;
+			case 'q': quick_us = atof(optarg); break;
+			case 'r': seed = strtoul(optarg, NULL, 0); break;
+			case 't': trace = optarg; break;
+			case 'b': out_bits = atoi(optarg); break;
+			case 'T': timeout_us = atof(optarg); break;
+			case 'P': pads = atoi(optarg); break;
+			case 's': spi = 1; break;
+			default: printUsage(); return 1;
+		}
+	}
+
+	if (trace) {
+		if (loadTrace(trace))
+			return 1;
+		if (trace_output == OUTPUT_SPI && !spi) {
+			printf("# Not simulated: %s needs the SPI output (-s)\n", trace);
+			return 0;
+		}
+		if (trace_output == OUTPUT_FOUR_SCORE && spi) {
+			printf("# Not simulated: %s is for the FOUR_SCORE build, without SPI output\n", trace);
+			return 0;
+		}
+		if (trace_output == OUTPUT_SNES && spi) {
+			printf("# Not simulated: %s is for the SNES_OUTPUT build, without SPI output\n", trace);
+			return 0;
+		}
+	} else {
+		if (latches < 1 || latches > MAX_READS) {
+			fprintf(stderr, "Invalid number of latches\n");
+			return 1;
+		}
+		for (i=0; i<latches; i++) {
+			pattern[i].offset_us = i * latch_gap_us;
+			pattern[i].read_us = read_us;
+			pattern[i].bits = out_bits;
+			pattern[i].clock_us = read_us / out_bits;
+		}
+		pattern_len = latches;
+	}
+
+	if (spi && (out_bits != 8 || pads != 1)) {
+		fprintf(stderr, "The SPI output sends 8 bits, for one controller\n");
+		return 1;
+	}
+
+	if (pads < 1 || pads > 2) {
+		fprintf(stderr, "Invalid number of controllers\n");
+		return 1;
+	}
+
+	if (quick_us <= 0 || quick_us > poll_us) {
+		fprintf(stderr, "Invalid poll durations\n");
+		return 1;
+	}
+
+	if (out_bits < 1 || timeout_us <= 0 || lag_percent >= 100 ||
+			frame_us <= pattern[pattern_len-1].offset_us + pattern[pattern_len-1].read_us + jitter_us * 2) {
+		fprintf(stderr, "Invalid frame parameters\n");
+		return 1;
+	}
+
+	srand(seed);
+	sync_init();
+	mainloop_init();
+	scheduleFrame();
+
+	while (frames < n) {
+		if (now >= next_latch) {
+			latch();
+		} else {
+			start = now;
+			mainloop_step();
+			if (sync_stats.last_poll_time > poll_time_max)
+				poll_time_max = sync_stats.last_poll_time;
+			// Nothing to do: one main loop iteration, about a timer tick
+			if (now == start)
+				now += TIMER_PRESCALER;
+		}
+	}
+
+	printf("# F_CPU %ld kHz, frame %.1f us, %d latch(es), poll %.0f us x %d controller(s)\n",
+			F_CPU / 1000, frame_us, pattern_len, poll_us, pads);
+	printf("# counter value\n");
+	printf("frames %lu\n", frames);
+	printf("latches %lu\n", n_latches);
+	printf("polls %lu\n", polls);
+	printf("preempted_polls %lu\n", preempted);
+	printf("dropped_polls %lu\n", dropped);
+	printf("quick_polls %lu\n", quick);
+	printf("stale_frames %lu\n", stale);
+	printf("relatches %lu\n", relatches);
+	printf("lost_bits %lu\n", lost_bits);
+	printf("turbo_errors %lu\n", turbo_errors);
+	printf("masked_latches %lu\n", masked_latches);
+	printf("wrong_bits %lu\n", wrong_bits);
+	printf("# sample age (first controller read) at the first latch of a frame, us\n");
+	printf("age_min %.1f\n", age_min);
+	printf("age_mean %.1f\n", aged_frames ? age_sum / aged_frames : 0);
+	printf("age_p50 %.0f\n", agePercentile(0.5));
+	printf("age_p99 %.0f\n", agePercentile(0.99));
+	printf("age_max %.1f\n", age_max);
+	printf("# worst latches from a press to the NES\n");
+	printf("input_latches_max %lu\n", input_latches_max);
+	printf("# worst poll duration measured by the scheduler, us\n");
+	printf("poll_time_max %.0f\n", poll_time_max * TIMER_PRESCALER / CYCLES_PER_US);
+
+	if (checkExpects() || wrong_bits)
+		return 1;
+
+	return 0;
+}